@@ -0,0 +1,83 @@
+/* bifrost benchmark suite
+	usage: bifrost-bench [group...] - runs all groups if none is given
+*/
+
+#include "bench.h"
+#include "../pool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef struct bench_group_t {
+	const char* name;
+	void (*run) ();
+} bench_group_t;
+
+static const bench_group_t groups[] = {
+	{ "bus",	bench_bus },
+	{ "channel",	bench_channel },
+	{ "queue",	bench_queue },
+	{ "broker",	bench_broker }
+};
+
+//=================================================================================================
+
+void bench_touch (const char* path)
+{
+	int fd = open (path, O_CREAT | O_WRONLY | O_CLOEXEC, 0660);
+
+	if (fd >= 0)
+		close (fd);
+}
+
+void bench_report (const char* name, const char* params, unsigned long long ops, double seconds,
+		   unsigned int sample_ops, const latency_histogram_t* latency)
+{
+	printf ("{\"bench\":\"%s\",\"params\":\"%s\",\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.0f,"
+		"\"sample_ops\":%u,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+		name, params, ops, seconds, seconds > 0 ? ops / seconds : 0.0, sample_ops,
+		latency_percentile_ns (latency, 50.0), latency_percentile_ns (latency, 99.0),
+		latency_percentile_ns (latency, 99.9));
+	fflush (stdout);
+}
+
+int main (int argc, char** argv)
+{
+	unsigned int idx;
+	int arg;
+	int found;
+
+	openlog ("bifrost-bench", LOG_CONS, LOG_USER);
+	setlogmask (LOG_UPTO (LOG_WARNING));
+
+	for (arg = 1; arg < argc; arg++)
+	{
+		for (found = 0, idx = 0; idx < sizeof (groups) / sizeof (groups[0]); idx++)
+			found |= !strcmp (argv[arg], groups[idx].name);
+
+		if (!found)
+		{
+			fprintf (stderr, "usage: %s [bus] [channel] [queue] [broker]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// samples are taken in ticks, reported in nanoseconds
+	latency_init ();
+
+	for (idx = 0; idx < sizeof (groups) / sizeof (groups[0]); idx++)
+	{
+		for (found = argc == 1, arg = 1; arg < argc; arg++)
+			found |= !strcmp (argv[arg], groups[idx].name);
+
+		if (found)
+			groups[idx].run ();
+	}
+
+	pool_destroy ();
+	closelog ();
+	return 0;
+}
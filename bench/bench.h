@@ -0,0 +1,38 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "../latency.h"
+#include <time.h>
+
+/* benchmark harness
+	Every benchmark reports one JSON line per configuration to stdout:
+	{"bench":..., "params":..., "ops":..., "seconds":..., "ops_per_sec":..., "sample_ops":..., "p50_ns":..., "p99_ns":..., "p999_ns":...}
+	Latency percentiles are taken over samples; a sample covers sample_ops operations (nanosecond-scale
+	operations are timed in groups, so that clock reading doesn't dominate the result).
+	Samples are latency.h ticks in the same histograms daemon keeps, so both report the same way
+	(upper bounds of buckets); bench_now_ns is for wall time of a run.
+*/
+
+static inline unsigned long long bench_now_ns ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* IPC keys are derived from paths (ftok), which must exist */
+void bench_touch (const char* path);
+
+void bench_report (const char* name, const char* params, unsigned long long ops, double seconds,
+		   unsigned int sample_ops, const latency_histogram_t* latency);
+
+/* benchmark groups - bench/<group>.c
+	every group runs all its configurations and reports them
+*/
+void bench_bus ();
+void bench_channel ();
+void bench_queue ();
+void bench_broker ();
+
+#endif
@@ -0,0 +1,279 @@
+/* broker benchmark
+	broker/process_bus_messages - bus is filled with data messages for local units, then drained by
+		process_bus_messages with routing in the calling thread (no routing workers), as main loop does.
+		Sample is one process_bus_messages call; units' rings are drained by reader threads meanwhile.
+	broker/daemon_defaults - the same traffic with daemon configuration: default routing workers,
+		bounded bus with BUS_OVERLOAD_BLOCK. Producer thread pushes while bus is drained, so it's held
+		back by the bus; ops/s is end to end, until units have got every message.
+*/
+
+#include "bench.h"
+#include "../broker.h"
+#include "../message.h"
+#include "../settings.h"
+#include "../stats.h"
+#include "../ipc/ipc.h"
+#include "../ipc/dbus.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BROKER_UNITS		8
+#define BROKER_MESSAGES		500000
+#define BROKER_PAYLOAD		64
+#define UNIT_RING_CAPACITY	(4 * 1024 * 1024)
+#define UNIT_PREFIX		"/tmp/bifrost_bench_"
+
+// no D-Bus server here: channel registration signals and replies go nowhere
+void bifrost_dbus_emit_signal (signal_type_t signal_type, ...)
+{
+	(void) signal_type;
+}
+
+void bifrost_dbus_return_channels (void* reply, const bifrost_channel_descriptor_t* channels, unsigned int count)
+{
+	(void) reply;
+	(void) channels;
+	(void) count;
+}
+
+typedef struct reader_t {
+	pthread_t thread;
+	char path[64];
+	unsigned long received;
+} reader_t;
+
+static volatile int readers_stop = 0;
+
+static void on_record (const char* data, unsigned int size, void* user_data)
+{
+	(void) data;
+	(void) size;
+
+	// progress is watched by daemon_defaults from another thread
+	__atomic_add_fetch (&((reader_t*) user_data)->received, 1, __ATOMIC_RELAXED);
+}
+
+static void* reader (void* arg)
+{
+	reader_t* r = (reader_t*) arg;
+	struct channel_t* channel = channel_open (r->path, UNIT_RING_CAPACITY, CHANNEL_MODE_RING, 0);
+
+	// after stop, ring is drained to the end
+	while (channel)
+	{
+		if (channel_drain (channel, on_record, r, 0) > 0)
+			continue;
+		if (__atomic_load_n (&readers_stop, __ATOMIC_ACQUIRE))
+			break;
+		channel_wait (channel, 10);
+	}
+
+	channel_close (channel);
+	return NULL;
+}
+
+static void register_bench_unit (const char* name)
+{
+	unsigned int size = sizeof (bifrost_register_unit_command_t) + strlen (name) + 1;
+	command_t* cmd = (command_t*) bifrost_create_message (MESSAGE_COMMAND, size);
+	bifrost_register_unit_command_t* args = (bifrost_register_unit_command_t*) cmd->args;
+
+	cmd->command_type = BIFROST_REGISTER_UNIT;
+	args->packet_size = UNIT_RING_CAPACITY;
+	args->channel_mode = CHANNEL_MODE_RING;
+	strcpy (args->name, name);
+	bifrost_push_message ((message_t*)cmd);
+}
+
+// units get ids 2.. in registration order
+static void start_units (reader_t* readers)
+{
+	char name[32];
+	unsigned int i;
+
+	for (i = 0; i < BROKER_UNITS; i++)
+	{
+		snprintf (name, sizeof (name), "unit%u", i);
+		snprintf (readers[i].path, sizeof (readers[i].path), UNIT_PREFIX "%s_shm", name);
+		bench_touch (readers[i].path);
+		register_bench_unit (name);
+	}
+	while (bifrost_bus_depth ())
+		process_bus_messages ();
+
+	readers_stop = 0;
+	for (i = 0; i < BROKER_UNITS; i++)
+	{
+		readers[i].received = 0;
+		pthread_create (&readers[i].thread, NULL, reader, &readers[i]);
+	}
+}
+
+// returns number of messages readers have got
+static unsigned long stop_units (reader_t* readers)
+{
+	unsigned long delivered = 0;
+	unsigned int i;
+
+	__atomic_store_n (&readers_stop, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < BROKER_UNITS; i++)
+	{
+		pthread_join (readers[i].thread, NULL);
+		delivered += readers[i].received;
+	}
+
+	return delivered;
+}
+
+static data_message_t* bench_message (unsigned int i)
+{
+	data_message_t* msg = (data_message_t*) bifrost_create_message (MESSAGE_DATA, BROKER_PAYLOAD);
+
+	msg->src_id.id = 1;
+	msg->dest_id.id = 2 + i % BROKER_UNITS;
+	memset (msg->buf, 'x', BROKER_PAYLOAD);
+	return msg;
+}
+
+//=================================================================================================
+
+static void bench_process_bus_messages (unsigned int batch_size, const char* batch_name)
+{
+	reader_t readers[BROKER_UNITS];
+	latency_histogram_t latency;
+	unsigned long long start, begin, calls = 0;
+	unsigned long delivered;
+	char params[64];
+	unsigned int i;
+
+	// whole run fits into bus
+	bifrost_bus_configure (0, 0, 0, 0, BUS_OVERLOAD_BLOCK);
+	bifrost_settings.broker_workers = 0;
+	bifrost_settings.message_batch_size = batch_size;
+	bifrost_settings.channel_prefix = UNIT_PREFIX;
+	broker_init ();
+	start_units (readers);
+
+	for (i = 0; i < BROKER_MESSAGES; i++)
+		bifrost_push_message ((message_t*) bench_message (i));
+
+	memset (&latency, 0, sizeof (latency));
+	begin = bench_now_ns ();
+	while (bifrost_bus_depth ())
+	{
+		start = latency_now ();
+		process_bus_messages ();
+		latency_record (&latency, latency_now () - start);
+		calls++;
+	}
+
+	snprintf (params, sizeof (params), "batch=%s,units=%u,size=%u", batch_name, BROKER_UNITS, BROKER_PAYLOAD);
+	bench_report ("broker/process_bus_messages", params, BROKER_MESSAGES, (bench_now_ns () - begin) * 1e-9,
+		      calls ? BROKER_MESSAGES / calls : 0, &latency);
+
+	if ((delivered = stop_units (readers)) < BROKER_MESSAGES)
+		fprintf (stderr, "broker/process_bus_messages: %lu messages dropped on full rings\n", BROKER_MESSAGES - delivered);
+
+	broker_uninit ();
+}
+
+static void* producer (void* arg)
+{
+	unsigned int i;
+
+	(void) arg;
+
+	// BUS_OVERLOAD_BLOCK: push sleeps while bus is full
+	for (i = 0; i < BROKER_MESSAGES; i++)
+		bifrost_push_message ((message_t*) bench_message (i));
+
+	return NULL;
+}
+
+static unsigned long units_received (const reader_t* readers)
+{
+	unsigned long received = 0;
+	unsigned int i;
+
+	for (i = 0; i < BROKER_UNITS; i++)
+		received += __atomic_load_n (&readers[i].received, __ATOMIC_RELAXED);
+
+	return received;
+}
+
+static void bench_daemon_defaults ()
+{
+	reader_t readers[BROKER_UNITS];
+	latency_histogram_t latency;
+	pthread_t thread;
+	unsigned long long start, begin, progress_at, calls = 0;
+	unsigned long received, last = 0;
+	char params[96];
+
+	settings_init ();
+	bifrost_bus_configure (bifrost_settings.bus_capacity, bifrost_settings.bus_high_watermark,
+			       bifrost_settings.bus_low_watermark, bifrost_settings.bus_producer_credits,
+			       BUS_OVERLOAD_BLOCK);
+	bifrost_settings.channel_prefix = UNIT_PREFIX;
+	broker_init ();
+	start_units (readers);
+
+	memset (&latency, 0, sizeof (latency));
+	begin = progress_at = bench_now_ns ();
+	pthread_create (&thread, NULL, producer, NULL);
+
+	// with workers, messages are delivered after bus is drained; a second without progress ends the run
+	while ((received = units_received (readers)) < BROKER_MESSAGES)
+	{
+		if (received != last)
+		{
+			last = received;
+			progress_at = bench_now_ns ();
+		} else if (bench_now_ns () - progress_at > 1000000000ULL)
+			break;
+
+		if (!bifrost_bus_depth ())
+		{
+			sched_yield ();
+			continue;
+		}
+
+		start = latency_now ();
+		process_bus_messages ();
+		latency_record (&latency, latency_now () - start);
+		calls++;
+	}
+
+	snprintf (params, sizeof (params), "workers=%u,capacity=%u,policy=block,units=%u,size=%u",
+		  bifrost_settings.broker_workers, bifrost_settings.bus_capacity, BROKER_UNITS, BROKER_PAYLOAD);
+	bench_report ("broker/daemon_defaults", params, received, (bench_now_ns () - begin) * 1e-9,
+		      calls ? received / calls : 0, &latency);
+
+	pthread_join (thread, NULL);
+	if ((received = stop_units (readers)) < BROKER_MESSAGES)
+		fprintf (stderr, "broker/daemon_defaults: %lu messages were not delivered\n", BROKER_MESSAGES - received);
+
+	broker_uninit ();
+	settings_free ();
+}
+
+//=================================================================================================
+
+void bench_broker ()
+{
+	settings_init ();
+
+	bench_process_bus_messages (BIFROST_BATCH_SIZE_ADAPTIVE, "adaptive");
+	bench_process_bus_messages (64, "64");
+	bench_process_bus_messages (1024, "1024");
+	bench_process_bus_messages (0, "all");
+	settings_free ();
+
+	bench_daemon_defaults ();
+
+	bifrost_clear_bus ();
+	stats_destroy ();
+}
@@ -0,0 +1,271 @@
+/* message allocation and bus benchmarks
+	message/create_free - pool allocation, single and concurrent threads
+	bus/push_pop - push and pop by one thread: bare cost of the lock-free fifo
+	bus/contention - N producers push, a single consumer (as broker does) pops; latency is
+		push-to-pop time. Lock-free bus from message.c is compared with the former mutex-guarded fifo.
+*/
+
+#include "bench.h"
+#include "../message.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SAMPLE_OPS	64		// nanosecond-scale operations are timed in groups
+#define CREATE_OPS		2000000
+#define PUSH_POP_OPS		4000000
+#define MESSAGES_PER_PRODUCER	1000000
+#define MAX_THREADS		16
+
+//=================================================================================================
+// reference: mutex-guarded fifo (bus implementation before lock-free one)
+
+static message_t* head = NULL;
+static message_t* tail = NULL;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int mutex_push_message (message_t* msg)
+{
+	pthread_mutex_lock (&mutex);
+	msg->next = NULL;
+	if (head == NULL)
+	{
+		head = msg;
+		tail = msg;
+	} else
+	{
+		tail->next = msg;
+		tail = msg;
+	}
+	pthread_mutex_unlock (&mutex);
+	return 0;
+}
+
+static message_t* mutex_pop_message ()
+{
+	message_t* msg = NULL;
+
+	pthread_mutex_lock (&mutex);
+	if (head != NULL)
+	{
+		msg = head;
+		head = head->next;
+		if (head == NULL)
+			tail = NULL;
+	}
+	pthread_mutex_unlock (&mutex);
+
+	return msg;
+}
+
+typedef struct bench_queue_t {
+	const char* name;
+	int (*push) (message_t*);
+	message_t* (*pop) ();
+} bench_queue_t;
+
+static const bench_queue_t queues[] = {
+	{ "mutex",	mutex_push_message,	mutex_pop_message },
+	{ "lockfree",	bifrost_push_message,	bifrost_pop_message }
+};
+
+//=================================================================================================
+
+typedef struct worker_t {
+	pthread_t thread;
+	const bench_queue_t* queue;
+	unsigned int size;
+	unsigned long count;
+	struct stamped_message_t* messages;
+	latency_histogram_t latency;
+} worker_t;
+
+// preallocated message with push time; only every BENCH_SAMPLE_OPS-th one is stamped.
+// Bus looks into data message header (admission), so messages must be complete data messages
+typedef struct stamped_message_t {
+	data_message_t msg;
+	unsigned long long pushed_at;
+} stamped_message_t;
+
+static volatile int start_flag = 0;
+
+static void start_workers (worker_t* workers, unsigned int count, void* (*fn) (void*))
+{
+	unsigned int i;
+
+	start_flag = 0;
+	for (i = 0; i < count; i++)
+	{
+		memset (&workers[i].latency, 0, sizeof (workers[i].latency));
+		pthread_create (&workers[i].thread, NULL, fn, &workers[i]);
+	}
+}
+
+static void join_workers (worker_t* workers, unsigned int count, latency_histogram_t* latency)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+	{
+		pthread_join (workers[i].thread, NULL);
+		if (latency)
+			latency_merge (latency, &workers[i].latency);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static void* create_free_worker (void* arg)
+{
+	worker_t* w = (worker_t*) arg;
+	message_t* batch[BENCH_SAMPLE_OPS];
+	unsigned long long start;
+	unsigned int i, j;
+
+	while (!__atomic_load_n (&start_flag, __ATOMIC_ACQUIRE));
+
+	// messages live for a while, as they do on the bus
+	for (i = 0; i < w->count / BENCH_SAMPLE_OPS; i++)
+	{
+		start = latency_now ();
+		for (j = 0; j < BENCH_SAMPLE_OPS; j++)
+			batch[j] = bifrost_create_message (MESSAGE_DATA, w->size);
+		for (j = 0; j < BENCH_SAMPLE_OPS; j++)
+			bifrost_free_message (batch[j]);
+		latency_record (&w->latency, latency_now () - start);
+	}
+
+	return NULL;
+}
+
+static void bench_create_free (unsigned int threads, unsigned int size)
+{
+	worker_t workers[MAX_THREADS];
+	latency_histogram_t latency;
+	unsigned long long start;
+	// large blocks are slower to come by - fewer of them, so that every size takes similar time
+	unsigned long count = CREATE_OPS / (1 + size / 1024) / BENCH_SAMPLE_OPS * BENCH_SAMPLE_OPS;
+	char params[64];
+	unsigned int i;
+
+	memset (&latency, 0, sizeof (latency));
+	for (i = 0; i < threads; i++)
+	{
+		workers[i].size = size;
+		workers[i].count = count;
+	}
+
+	start_workers (workers, threads, create_free_worker);
+	start = bench_now_ns ();
+	__atomic_store_n (&start_flag, 1, __ATOMIC_RELEASE);
+	join_workers (workers, threads, &latency);
+
+	snprintf (params, sizeof (params), "threads=%u,size=%u", threads, size);
+	bench_report ("message/create_free", params, (unsigned long long) threads * count,
+		      (bench_now_ns () - start) * 1e-9, BENCH_SAMPLE_OPS, &latency);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static void bench_push_pop ()
+{
+	data_message_t* messages = calloc (BENCH_SAMPLE_OPS, sizeof (data_message_t));
+	latency_histogram_t latency;
+	unsigned long long start, begin;
+	unsigned int i, j;
+
+	memset (&latency, 0, sizeof (latency));
+	begin = bench_now_ns ();
+
+	for (i = 0; i < PUSH_POP_OPS / BENCH_SAMPLE_OPS; i++)
+	{
+		start = latency_now ();
+		for (j = 0; j < BENCH_SAMPLE_OPS; j++)
+			bifrost_push_message ((message_t*)&messages[j]);
+		for (j = 0; j < BENCH_SAMPLE_OPS; j++)
+			bifrost_pop_message ();
+		latency_record (&latency, latency_now () - start);
+	}
+
+	bench_report ("bus/push_pop", "threads=1", (unsigned long long)(PUSH_POP_OPS / BENCH_SAMPLE_OPS) * BENCH_SAMPLE_OPS,
+		      (bench_now_ns () - begin) * 1e-9, BENCH_SAMPLE_OPS, &latency);
+	free (messages);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static void* producer (void* arg)
+{
+	worker_t* w = (worker_t*) arg;
+	unsigned int i;
+
+	while (!__atomic_load_n (&start_flag, __ATOMIC_ACQUIRE));
+
+	for (i = 0; i < MESSAGES_PER_PRODUCER; i++)
+	{
+		if (i % BENCH_SAMPLE_OPS == 0)
+			w->messages[i].pushed_at = latency_now ();
+		w->queue->push ((message_t*)&w->messages[i].msg);
+	}
+
+	return NULL;
+}
+
+static void bench_contention (const bench_queue_t* queue, unsigned int producers_count)
+{
+	worker_t producers[MAX_THREADS];
+	unsigned long total = (unsigned long) producers_count * MESSAGES_PER_PRODUCER;
+	unsigned long received = 0;
+	stamped_message_t* msg;
+	latency_histogram_t latency;
+	unsigned long long start;
+	char params[64];
+	unsigned int i;
+
+	memset (&latency, 0, sizeof (latency));
+	for (i = 0; i < producers_count; i++)
+	{
+		producers[i].queue = queue;
+		producers[i].messages = calloc (MESSAGES_PER_PRODUCER, sizeof (stamped_message_t));
+	}
+
+	start_workers (producers, producers_count, producer);
+	start = bench_now_ns ();
+	__atomic_store_n (&start_flag, 1, __ATOMIC_RELEASE);
+
+	while (received < total)
+	{
+		if (!(msg = (stamped_message_t*) queue->pop ()))
+			continue;
+
+		received++;
+		if (msg->pushed_at)
+			latency_record (&latency, latency_now () - msg->pushed_at);
+	}
+
+	snprintf (params, sizeof (params), "queue=%s,producers=%u", queue->name, producers_count);
+	bench_report ("bus/contention", params, total, (bench_now_ns () - start) * 1e-9, 1, &latency);
+
+	join_workers (producers, producers_count, NULL);
+	for (i = 0; i < producers_count; i++)
+		free (producers[i].messages);
+}
+
+//=================================================================================================
+
+void bench_bus ()
+{
+	static const unsigned int sizes[] = { 64, 1024, 16384 };
+	unsigned int n, s, q;
+
+	for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+		for (n = 1; n <= 8; n *= 2)
+			bench_create_free (n, sizes[s]);
+
+	bench_push_pop ();
+
+	for (n = 1; n <= 8; n *= 2)
+		for (q = 0; q < sizeof (queues) / sizeof (queues[0]); q++)
+			bench_contention (&queues[q], n);
+}
@@ -0,0 +1,177 @@
+/* channel benchmarks across payload sizes
+	channel/slot - write and read of a single-slot channel by one thread
+	channel/ring - write and read of a ring by one thread: bare cost of a record
+	channel/ring_pipe - writer and reader threads; latency is write-to-read time
+*/
+
+#include "bench.h"
+#include "../ipc/ipc.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SAMPLE_OPS	64
+#define CHANNEL_BYTES		(256 * 1024 * 1024)	// data moved by one configuration
+#define CHANNEL_MIN_OPS		(64 * 1024)
+#define RING_CAPACITY		(4 * 1024 * 1024)
+#define SLOT_PATH		"/tmp/bifrost_bench_slot"
+#define RING_PATH		"/tmp/bifrost_bench_ring"
+
+static inline unsigned long ops_for_size (unsigned int size)
+{
+	unsigned long ops = CHANNEL_BYTES / size;
+
+	ops = ops < CHANNEL_MIN_OPS ? CHANNEL_MIN_OPS : ops;
+	return ops / BENCH_SAMPLE_OPS * BENCH_SAMPLE_OPS;
+}
+
+//=================================================================================================
+
+static void bench_single_thread (const char* name, int mode, unsigned int size)
+{
+	struct channel_t* channel;
+	latency_histogram_t latency;
+	unsigned long long start, begin;
+	unsigned long ops = ops_for_size (size);
+	unsigned int buffer_size = size;
+	unsigned long i;
+	unsigned int j;
+	char* payload = malloc (size);
+	char* buffer = malloc (size);
+	char params[64];
+
+	channel = channel_open (mode == CHANNEL_MODE_RING ? RING_PATH : SLOT_PATH,
+				mode == CHANNEL_MODE_RING ? RING_CAPACITY : (int)size, mode, 1);
+	if (!channel)
+	{
+		fprintf (stderr, "%s: failed to open channel\n", name);
+		goto exit;
+	}
+
+	memset (payload, 'x', size);
+	memset (&latency, 0, sizeof (latency));
+	begin = bench_now_ns ();
+
+	// one op - write and read of one record
+	for (i = 0; i < ops; i += BENCH_SAMPLE_OPS)
+	{
+		start = latency_now ();
+		for (j = 0; j < BENCH_SAMPLE_OPS; j++)
+		{
+			channel_write (channel, payload, size);
+			channel_read (channel, &buffer, &buffer_size);
+		}
+		latency_record (&latency, latency_now () - start);
+	}
+
+	snprintf (params, sizeof (params), "size=%u", size);
+	bench_report (name, params, ops, (bench_now_ns () - begin) * 1e-9, BENCH_SAMPLE_OPS, &latency);
+	channel_close (channel);
+
+exit:
+	free (payload);
+	free (buffer);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+typedef struct pipe_t {
+	struct channel_t* channel;
+	unsigned int size;
+	unsigned long ops;
+	latency_histogram_t latency;
+} pipe_t;
+
+static void* pipe_reader (void* arg)
+{
+	pipe_t* p = (pipe_t*) arg;
+	struct channel_t* channel = channel_open (RING_PATH, RING_CAPACITY, CHANNEL_MODE_RING, 0);
+	unsigned long long stamp;
+	unsigned long got = 0;
+	unsigned int size;
+	const char* data;
+
+	while (channel && got < p->ops)
+	{
+		if (!(data = channel_read_loan (channel, &size)))
+		{
+			channel_wait (channel, 100);
+			continue;
+		}
+
+		memcpy (&stamp, data, sizeof (stamp));
+		if (stamp)
+			latency_record (&p->latency, latency_now () - stamp);
+		channel_read_release (channel);
+		got++;
+	}
+
+	channel_close (channel);
+	return NULL;
+}
+
+static void bench_ring_pipe (unsigned int size)
+{
+	pipe_t p;
+	pthread_t reader;
+	unsigned long long begin, stamp;
+	unsigned long i;
+	char* payload;
+	char params[64];
+
+	size = size < sizeof (stamp) ? sizeof (stamp) : size;
+	payload = calloc (1, size);
+
+	p.size = size;
+	p.ops = ops_for_size (size);
+	memset (&p.latency, 0, sizeof (p.latency));
+	if (!(p.channel = channel_open (RING_PATH, RING_CAPACITY, CHANNEL_MODE_RING, 1)))
+	{
+		fprintf (stderr, "channel/ring_pipe: failed to open channel\n");
+		free (payload);
+		return;
+	}
+
+	pthread_create (&reader, NULL, pipe_reader, &p);
+	begin = bench_now_ns ();
+
+	for (i = 0; i < p.ops; i++)
+	{
+		// only every BENCH_SAMPLE_OPS-th record is timed
+		stamp = i % BENCH_SAMPLE_OPS ? 0 : latency_now ();
+		memcpy (payload, &stamp, sizeof (stamp));
+
+		while (channel_try_write (p.channel, payload, size) == -4)
+			sched_yield ();	// ring is full
+	}
+
+	pthread_join (reader, NULL);
+
+	snprintf (params, sizeof (params), "size=%u", size);
+	bench_report ("channel/ring_pipe", params, p.ops, (bench_now_ns () - begin) * 1e-9, 1, &p.latency);
+
+	channel_close (p.channel);
+	free (payload);
+}
+
+//=================================================================================================
+
+void bench_channel ()
+{
+	static const unsigned int sizes[] = { 16, 64, 256, 1024, 4096, 16384, 65536 };
+	unsigned int s;
+
+	bench_touch (SLOT_PATH);
+	bench_touch (RING_PATH);
+
+	for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+		bench_single_thread ("channel/slot", CHANNEL_MODE_SLOT, sizes[s]);
+
+	for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+		bench_single_thread ("channel/ring", CHANNEL_MODE_RING, sizes[s]);
+
+	for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+		bench_ring_pipe (sizes[s]);
+}
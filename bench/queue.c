@@ -0,0 +1,203 @@
+/* message queue benchmarks
+	queue/round_trip - ping-pong between two threads through queue; latency is round trip time
+	queue/scaling - N sender threads send to their own message type, N receiver threads take them back.
+		Shows how queue throughput scales with number of concurrent senders.
+	Sizes cover inline (64) and staged (1024) messages.
+*/
+
+#include "bench.h"
+#include "../ipc/ipc.h"
+#include "../settings.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUND_TRIPS		100000
+#define MESSAGES_PER_SENDER	200000
+#define MAX_SENDERS		16
+
+// message types: round trip uses its own pair, scaling takes 1..MAX_SENDERS
+#define PING_TYPE		(MAX_SENDERS + 1)
+#define PONG_TYPE		(MAX_SENDERS + 2)
+
+typedef struct worker_t {
+	pthread_t thread;
+	long type;
+	unsigned int size;
+	unsigned long count;
+	latency_histogram_t latency;
+} worker_t;
+
+static volatile int start_flag = 0;
+
+// staging area may be exhausted by fast senders - wait for receivers then
+static int send_message (long type, char* payload, unsigned int size)
+{
+	int rc;
+
+	while ((rc = queue_send_message (type, payload, size)) == -4)
+		sched_yield ();
+
+	return rc;
+}
+
+//=================================================================================================
+
+static void* echo (void* arg)
+{
+	worker_t* w = (worker_t*) arg;
+	char* buffer = NULL;
+	unsigned int size = 0;
+	unsigned long i;
+	int n;
+
+	for (i = 0; i < w->count; i++)
+	{
+		if ((n = queue_receive_message (PING_TYPE, &buffer, &size)) < 0 || send_message (PONG_TYPE, buffer, n))
+		{
+			fprintf (stderr, "queue/round_trip: echo failed\n");
+			break;
+		}
+	}
+
+	free (buffer);
+	return NULL;
+}
+
+static void bench_round_trip (unsigned int size)
+{
+	worker_t echo_worker = { .count = ROUND_TRIPS, .size = size };
+	latency_histogram_t latency;
+	unsigned long long start, begin;
+	char* payload = calloc (1, size);
+	char* buffer = NULL;
+	unsigned int buffer_size = 0;
+	char params[64];
+	unsigned long i;
+
+	memset (&latency, 0, sizeof (latency));
+	pthread_create (&echo_worker.thread, NULL, echo, &echo_worker);
+	begin = bench_now_ns ();
+
+	for (i = 0; i < ROUND_TRIPS; i++)
+	{
+		start = latency_now ();
+		if (send_message (PING_TYPE, payload, size) || queue_receive_message (PONG_TYPE, &buffer, &buffer_size) < 0)
+		{
+			fprintf (stderr, "queue/round_trip: send failed\n");
+			break;
+		}
+		latency_record (&latency, latency_now () - start);
+	}
+
+	pthread_join (echo_worker.thread, NULL);
+
+	snprintf (params, sizeof (params), "size=%u", size);
+	bench_report ("queue/round_trip", params, i, (bench_now_ns () - begin) * 1e-9, 1, &latency);
+
+	free (payload);
+	free (buffer);
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static void* sender (void* arg)
+{
+	worker_t* w = (worker_t*) arg;
+	char payload[1024];
+	unsigned long long start;
+	unsigned int i;
+
+	memset (payload, 'x', w->size);
+	while (!__atomic_load_n (&start_flag, __ATOMIC_ACQUIRE));
+
+	for (i = 0; i < MESSAGES_PER_SENDER; i++)
+	{
+		start = latency_now ();
+		if (send_message (w->type, payload, w->size))
+		{
+			fprintf (stderr, "queue/scaling: send failed\n");
+			break;
+		}
+		latency_record (&w->latency, latency_now () - start);
+	}
+
+	return NULL;
+}
+
+static void* receiver (void* arg)
+{
+	worker_t* w = (worker_t*) arg;
+	char* buffer = NULL;
+	unsigned int size = 0;
+	unsigned int i;
+
+	for (i = 0; i < MESSAGES_PER_SENDER; i++)
+		queue_receive_message (w->type, &buffer, &size);
+
+	free (buffer);
+	return NULL;
+}
+
+static void bench_scaling (unsigned int senders_count, unsigned int size)
+{
+	static worker_t senders[MAX_SENDERS];
+	static worker_t receivers[MAX_SENDERS];
+	latency_histogram_t latency;
+	unsigned long long start;
+	char params[64];
+	unsigned int i;
+
+	memset (&latency, 0, sizeof (latency));
+	start_flag = 0;
+	for (i = 0; i < senders_count; i++)
+	{
+		senders[i].type = receivers[i].type = i + 1;
+		senders[i].size = receivers[i].size = size;
+		memset (&senders[i].latency, 0, sizeof (senders[i].latency));
+		pthread_create (&receivers[i].thread, NULL, receiver, &receivers[i]);
+		pthread_create (&senders[i].thread, NULL, sender, &senders[i]);
+	}
+
+	start = bench_now_ns ();
+	__atomic_store_n (&start_flag, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < senders_count; i++)
+	{
+		pthread_join (senders[i].thread, NULL);
+		pthread_join (receivers[i].thread, NULL);
+		latency_merge (&latency, &senders[i].latency);
+	}
+
+	snprintf (params, sizeof (params), "size=%u,senders=%u", size, senders_count);
+	bench_report ("queue/scaling", params, (unsigned long long) senders_count * MESSAGES_PER_SENDER,
+		      (bench_now_ns () - start) * 1e-9, 1, &latency);
+}
+
+//=================================================================================================
+
+void bench_queue ()
+{
+	static const unsigned int sizes[] = { 64, 1024 };	// inline and staged messages
+	unsigned int n, s;
+
+	settings_init ();
+	bench_touch (bifrost_settings.queue_path);
+	if (queue_create ())
+	{
+		fprintf (stderr, "failed to create queue at %s\n", bifrost_settings.queue_path);
+		return;
+	}
+
+	for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+		bench_round_trip (sizes[s]);
+
+	for (s = 0; s < sizeof (sizes) / sizeof (sizes[0]); s++)
+		for (n = 1; n <= 8; n *= 2)
+			bench_scaling (n, sizes[s]);
+
+	queue_destroy ();
+	settings_free ();
+}
@@ -1,9 +1,25 @@
+#define _GNU_SOURCE		// writer-preferring rwlock
 #include "broker.h"
 #include "message.h"
+#include "mpsc.h"
+#include "latency.h"
+#include "trace.h"
 #include "settings.h"
+#include "stats.h"
 #include "ipc/ipc.h"
+#include "ipc/dbus.h"
+#include "net/net.h"
+#include <glib.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
 #include <strings.h>
+#include <stdlib.h>
 #include <syslog.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 enum {
 	BIFROST_DAEMON_QUEUE_ID = 1	//reserved for core daemon
@@ -17,122 +33,350 @@ enum {
 typedef struct bifrost_address_record_t {
 	char* name;
 	bifrost_address_t address;
+	gint64 route_key;	// remote unit: key in remote_routes
+	int transport;		// remote unit: bifrost_transport_t
 } bifrost_address_record_t;
 
 /* local channel description
 	keyed by bifrost_id from address book
 */
+/* latency stages of delivered message, between its timestamps (see data_message_t);
+	time spent in ring until unit reads it is kept by channel itself (channel_get_wait_histogram)
+*/
+typedef enum latency_stage_t {
+	LATENCY_STAGE_PUSH = 0,		// create -> push: producer side
+	LATENCY_STAGE_BUS,		// push -> pop: waiting in bus
+	LATENCY_STAGE_DISPATCH,		// pop -> route: waiting in shard for routing worker
+	LATENCY_STAGE_DELIVER,		// route -> written into channel
+	LATENCY_STAGE_TOTAL,		// create -> written into channel
+	LATENCY_STAGES
+} latency_stage_t;
+
+static const char* latency_stage_names[LATENCY_STAGES + 1] = {
+	"push", "bus", "dispatch", "deliver", "total", "channel"
+};
+
 typedef struct channel_info_t {
 //	int queue_id;			// address id for message_queue
 	int online;
 	char* shm_name;			// shared memory path
-	char* sem_name;			// semaphore path
-	channel_t* channel;
+	struct channel_t* channel;
+	char* tx_name;			// path of ring unit sends through, see unit inbox
+	struct channel_t* tx;
+	int tx_broken;			// unit has published an inconsistent record, inbox doesn't read tx anymore
+	bifrost_address_record_t* record;	// address book record of unit
+	bifrost_unit_stats_t* stats;	// slot of statistics page, or private one if page is full
+	int stats_private;
+	unsigned long long delivery_ticks;	// time spent writing into channel, latency.h ticks
+	latency_histogram_t* latency;	// LATENCY_STAGES histograms, kept while unit is offline
 } channel_info_t;
 
-static GSList* address_book = NULL;
+/* name lookups go through the hash index, routing by id goes through dense channels array;
+   both are O(1) and don't allocate
+*/
+static GHashTable* address_book = NULL;	// name -> bifrost_address_record_t, owns records
 static GArray* channels = NULL;	// index = bifrost_id - 2, because ids 0 and 1 are reserved
+static GHashTable* remote_routes = NULL;	// remote address (route_key) -> record of address book
+static unsigned long dropped_no_route = 0;	// messages to unknown destinations or unreachable peers
+static bifrost_stats_t* stats = NULL;	// statistics page, see stats.h
+
+/* channels array, channel states and remote routes are changed by main loop thread only (commands),
+   routing workers read them under read lock - taken once per drained portion, not per message.
+   Readers take it in tight loops while the writer is the only bus consumer, so writer goes first;
+   read lock must never be nested then, or reader deadlocks behind a waiting writer
+*/
+static pthread_rwlock_t channels_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
 
-#define BIFROST_ID_TO_CHANNEL_INDEX(id) id - 2
-#define CHANNEL_INDEX_TO_BIFROST_ID(idx) idx + 2
+#define BIFROST_ID_TO_CHANNEL_INDEX(id) ((id) - 2)
+#define CHANNEL_INDEX_TO_BIFROST_ID(idx) ((idx) + 2)
+#define REMOTE_ROUTE_KEY(ip, id) (((gint64)(unsigned int)(ip) << 32) | (unsigned int)(id))
 
-bifrost_address_record_t* find_address (const char* name)
+static void address_book_record_free (gpointer data)
 {
-	GSList* item == NULL;
+	bifrost_address_record_t* rec = (bifrost_address_record_t*) data;
 
-	for (item = address_book; item; item = g_slist_next(item))
-	{
-		if (g_strcmp0(((bifrost_address_record_t*)item->data)->name, name) == 0)
-			break;
-	}
+	g_free (rec->name);
+	g_free (rec);
+}
+
+static bifrost_address_record_t* find_address (const char* name)
+{
+	return address_book ? g_hash_table_lookup (address_book, name) : NULL;
+}
+
+// local channel by bifrost id, NULL if there is no such local unit
+static channel_info_t* find_channel (int id)
+{
+	// negative index turns into a big unsigned one and fails the range check
+	unsigned int idx = BIFROST_ID_TO_CHANNEL_INDEX(id);
+
+	return (channels && idx < channels->len) ? &g_array_index (channels, channel_info_t, idx) : NULL;
+}
+
+// remote unit by its address, NULL if it isn't registered
+static bifrost_address_record_t* find_remote (bifrost_address_t address)
+{
+	gint64 key = REMOTE_ROUTE_KEY(address.ip, address.id);
+
+	return remote_routes ? g_hash_table_lookup (remote_routes, &key) : NULL;
+}
+
+static void log_delivery_stats (const channel_info_t* channel)
+{
+	const bifrost_unit_stats_t* st = channel->stats;
+
+	syslog (LOG_INFO, "unit [%s]: sent %llu, delivered %llu (%llu bytes, %llu ns avg), dropped: offline %llu, full %llu, invalid %llu",
+		channel->record ? channel->record->name : "?", (unsigned long long) st->sent,
+		(unsigned long long) st->delivered, (unsigned long long) st->delivered_bytes,
+		st->delivered ? latency_to_ns (channel->delivery_ticks / st->delivered) : 0,
+		(unsigned long long) st->dropped_offline, (unsigned long long) st->dropped_full,
+		(unsigned long long) st->dropped_invalid);
+}
+
+static bifrost_address_record_t* add_address (const char* name, int ip, int id)
+{
+	bifrost_address_record_t* record = g_new0 (bifrost_address_record_t, 1);
+
+	if (!address_book)
+		address_book = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, address_book_record_free);
 
-	return (item != NULL) ? item->data : NULL;
+	record->name = g_strdup (name);
+	record->address.ip = ip;
+	record->address.id = id;
+
+	// key is owned by record
+	g_hash_table_insert (address_book, record->name, record);
+
+	return record;
 }
 
 //====================================================================================================================
 // local unit registration
-int register_unit (const char* name, unsigned int requested_packet_size)
+/* take slot of statistics page for a new local unit (slot index = channel index)
+	units beyond page capacity are counted privately - only daemon log shows them
+*/
+static void publish_unit_stats (channel_info_t* channel, unsigned int idx, int channel_mode)
+{
+	if (stats && idx < stats->max_units)
+		channel->stats = &stats->unit[idx];
+	else
+	{
+		channel->stats = g_new0 (bifrost_unit_stats_t, 1);
+		channel->stats_private = 1;
+	}
+
+	memset (channel->stats, 0, sizeof (bifrost_unit_stats_t));
+	strncpy (channel->stats->name, channel->record->name, BIFROST_STATS_NAME_SIZE - 1);
+	channel->stats->id = channel->record->address.id;
+	channel->stats->online = channel->online;
+	if (channel->channel)
+	{
+		channel->stats->channel_mode = channel_mode;
+		channel->stats->channel_capacity = channel_get_capacity (channel->channel);
+	}
+
+	// readers look only at slots below units
+	if (!channel->stats_private)
+		__atomic_store_n (&stats->units, idx + 1, __ATOMIC_RELEASE);
+}
+
+/* make channels of a local unit, or reopen them for a unit which went offline
+	returns channel index, -1 on failure or if unit is online already
+*/
+static int open_local_unit (const char* name, unsigned int requested_packet_size, int channel_mode)
 {
 	bifrost_address_record_t* record = NULL;
-	channel_info_t channel = NULL;
-	int bifrost_id = -1;
-	const char* prefix = bifrost_settings.channel_prefix;
+	channel_info_t* channel = NULL;
+	channel_info_t new_channel;
+	int idx;
 
-	if (!name)
+	if (!name || !*name)
 	{
 		syslog (LOG_ERR, "Invalid arguments: no id or info!");
 		return -1;
 	}
 
-	syslog (LOG_DEBUG, "requested register (id=%s, size=%u)", id, requested_packet_size);
+	syslog (LOG_DEBUG, "requested register (id=%s, size=%u)", name, requested_packet_size);
 
 	record = find_address (name);
 
-	if (!record)
+	if (record)
 	{
-		syslog (LOG_DEBUG, "new element => allocating memory");
-		record = malloc (sizeof (bifrost_address_record_t));
-		memset (record, 0, sizeof (bifrost_address_record_t));
-		if (!record)
-		{
-			syslog (LOG_DEBUG, "malloc failed!");
-			return -2;
-		}
-		
-		channel.online = 1;
-		channel.shm_name = NULL;
-		channel.sem_name = NULL;
-		channel.channel = NULL;
-		if (requested_packet_size > 0)
+		// unit went offline before - give it its id back
+		if (record->address.ip == 0 && (channel = find_channel (record->address.id)) && !channel->online)
 		{
-			int len = strlen(prefix) + strlen(name) + strlen("_shm") + 1;
-			channel.shm_name = malloc (len);
-			memset (channel.shm_name, 0, len);
-			channel.shm_name = strcat(channel.shm_name, prefix);
-			channel.shm_name = strcat(channel.shm_name, name);
-			channel.shm_name = strcat(channel.shm_name, "_shm");
-
-			len = strlen(prefix) + strlen(name) + strlen("_sem") + 1;
-			channel.sem_name = malloc (len);
-			memset (channel.sem_name, 0, len);
-			channel.sem_name = strcat(channel.sem_name, prefix);
-			channel.sem_name = strcat(channel.sem_name, name);
-			channel.sem_name = strcat(channel.sem_name, "_sem");
-
-			channel.channel = channel_open (channel.shm_name, channel.sem_name, requested_packet_size, TRUE);
-		}
+			struct channel_t* reopened = NULL;
+			struct channel_t* tx = NULL;
 
-		// register new channel
-		if (!channels)
-		{
-			channels = g_array_new (FALSE,				//zero-terminated
-						TRUE,				//memset new val to 0
-						sizeof(channel_info_t));
+			if (channel->shm_name && requested_packet_size > 0)
+				reopened = channel_open (channel->shm_name, requested_packet_size, channel_mode, TRUE);
+			if (channel->tx_name)
+				tx = channel_open (channel->tx_name, bifrost_settings.unit_tx_capacity, CHANNEL_MODE_RING, TRUE);
+
+			pthread_rwlock_wrlock (&channels_lock);
+			channel->channel = reopened;
+			channel->tx = tx;
+			channel->tx_broken = 0;
+			channel->online = 1;
+			pthread_rwlock_unlock (&channels_lock);
+			STATS_SET(channel->stats->online, 1);
+
+			syslog (LOG_INFO, "unit [%s]:{%i:%i} is online again", name, record->address.ip, record->address.id);
+			return BIFROST_ID_TO_CHANNEL_INDEX(record->address.id);
 		}
+		return -1;
+	}
 
-		record->name = strdup (name);
-		record->address.ip = 0;	// local address
-		record->address.id = CHANNEL_INDEX_TO_BIFROST_ID(channels->len);
+	memset (&new_channel, 0, sizeof (channel_info_t));
+	new_channel.online = 1;
+	new_channel.latency = g_new0 (latency_histogram_t, LATENCY_STAGES);
+	if (requested_packet_size > 0)
+	{
+		new_channel.shm_name = g_strconcat (bifrost_settings.channel_prefix, name, "_shm", NULL);
+		new_channel.channel = channel_open (new_channel.shm_name, requested_packet_size, channel_mode, TRUE);
+	}
+	if (bifrost_settings.unit_tx_capacity > 0)
+	{
+		new_channel.tx_name = g_strconcat (bifrost_settings.channel_prefix, name, "_tx", NULL);
+		new_channel.tx = channel_open (new_channel.tx_name, bifrost_settings.unit_tx_capacity, CHANNEL_MODE_RING, TRUE);
+	}
 
-		g_array_append_val (channels, channel);
-		address_book = g_slist_append(address_book, record);
+	// register new channel - array may be reallocated, so workers must not look into it meanwhile
+	pthread_rwlock_wrlock (&channels_lock);
+	if (!channels)
+	{
+		channels = g_array_new (FALSE,				//zero-terminated
+					TRUE,				//memset new val to 0
+					sizeof(channel_info_t));
+	}
+
+	idx = channels->len;
+	new_channel.record = record = add_address (name, 0, CHANNEL_INDEX_TO_BIFROST_ID(idx));
+	publish_unit_stats (&new_channel, idx, channel_mode);
+	g_array_append_val (channels, new_channel);
+	pthread_rwlock_unlock (&channels_lock);
 
-		syslog (LOG_DEBUG, "added records:\n\tto addressbook: [%s]:{%i, %i}"
-				   "\n\tto channels list: {%s, %s}", name, address->ip, address->id,
-									   channel.shm_name, channel.sem_name);
+	syslog (LOG_DEBUG, "added records:\n\tto addressbook: [%s]:{%i, %i}"
+			   "\n\tto channels list: {%s}", name, record->address.ip, record->address.id,
+								   new_channel.shm_name);
 
-		bifrost_dbus_emit_signal (BIFROST_SIGNAL_CHANNEL_REGISTERED, name, address->id, channel.shm_name, channel.sem_name);
+	return idx;
+}
+
+// descriptor of unit channels for D-Bus; strings belong to channels array, name - to caller
+static void describe_channel (bifrost_channel_descriptor_t* descriptor, const char* name, int idx)
+{
+	channel_info_t* channel = idx >= 0 ? &g_array_index (channels, channel_info_t, idx) : NULL;
+
+	descriptor->name = name;
+	descriptor->id = channel ? CHANNEL_INDEX_TO_BIFROST_ID(idx) : -1;
+	descriptor->shm_name = channel && channel->channel ? channel->shm_name : NULL;
+	descriptor->tx_name = channel && channel->tx ? channel->tx_name : NULL;
+}
+
+/* channels made during current bus batch - they are announced by one signal after the batch,
+	so a registration storm costs a few signals instead of one per unit
+*/
+static GArray* announced = NULL;	// channel indices
+
+static void announce_channel (int idx)
+{
+	if (!announced)
+		announced = g_array_new (FALSE, FALSE, sizeof (int));
+	g_array_append_val (announced, idx);
+}
+
+static void announce_channels ()
+{
+	bifrost_channel_descriptor_t* descriptors;
+	unsigned int idx;
+	int channel;
+
+	descriptors = g_new0 (bifrost_channel_descriptor_t, announced->len);
+	for (idx = 0; idx < announced->len; idx++)
+	{
+		channel = g_array_index (announced, int, idx);
+		describe_channel (&descriptors[idx], g_array_index (channels, channel_info_t, channel).record->name, channel);
 	}
 
+	bifrost_dbus_emit_signal (BIFROST_SIGNAL_CHANNELS_REGISTERED, descriptors, announced->len);
+	g_free (descriptors);
+	g_array_set_size (announced, 0);
+}
+
+// single unit: caller learns its channels from ChannelOpen signal
+int register_unit (const char* name, unsigned int requested_packet_size, int channel_mode)
+{
+	bifrost_channel_descriptor_t descriptor;
+	int idx;
+
+	if ((idx = open_local_unit (name, requested_packet_size, channel_mode)) < 0)
+		return -1;
+
+	// announced by its own signal only, ChannelsOpen carries batch registrations
+	describe_channel (&descriptor, name, idx);
+	bifrost_dbus_emit_signal (BIFROST_SIGNAL_CHANNEL_REGISTERED, name, descriptor.id, descriptor.shm_name, descriptor.tx_name);
 	return 0;
 }
 
+/* batch: channels of all units go back to caller in the reply, in request order
+	(id -1 for units which weren't registered); malformed command is answered with an error
+	and no unit of it is registered
+*/
+static void register_units (const command_t* msg)
+{
+	const bifrost_register_units_command_t* cmd = (const bifrost_register_units_command_t*) msg->args;
+	const bifrost_register_unit_command_t* unit;
+	bifrost_channel_descriptor_t* descriptors;
+	unsigned int size, offset = 0, idx;
+	int channel;
+
+	if (msg->buffer_size < sizeof (bifrost_register_units_command_t))
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return;
+	}
+
+	size = msg->buffer_size - sizeof (bifrost_register_units_command_t);
+
+	// whole command is checked before any channel is made
+	for (idx = 0; idx < cmd->count; idx++)
+	{
+		unit = (const bifrost_register_unit_command_t*) (cmd->units + offset);
+		if (offset + sizeof (bifrost_register_unit_command_t) >= size
+			|| !memchr (unit->name, 0, size - offset - sizeof (bifrost_register_unit_command_t)))
+			break;
+		offset += BIFROST_REGISTER_UNIT_ENTRY_SIZE(strlen (unit->name));
+	}
+
+	if (idx < cmd->count)
+	{
+		syslog (LOG_ERR, "%s: malformed request, entry %u of %u is broken", __func__, idx, cmd->count);
+		bifrost_dbus_return_channels (cmd->reply, NULL, 0);
+		return;
+	}
+
+	descriptors = g_new0 (bifrost_channel_descriptor_t, cmd->count ? cmd->count : 1);
+	for (idx = 0, offset = 0; idx < cmd->count; idx++)
+	{
+		unit = (const bifrost_register_unit_command_t*) (cmd->units + offset);
+		offset += BIFROST_REGISTER_UNIT_ENTRY_SIZE(strlen (unit->name));
+
+		if ((channel = open_local_unit (unit->name, unit->packet_size, unit->channel_mode)) >= 0)
+			announce_channel (channel);
+		describe_channel (&descriptors[idx], unit->name, channel);
+	}
+
+	bifrost_dbus_return_channels (cmd->reply, descriptors, cmd->count);
+	g_free (descriptors);
+}
+
 //-------------------------------------------------------------------------------------------------
 // remote unit registration
-int register_unit (const char* name, int ip, int id)
+int register_remote_unit (const char* name, int ip, int id, int transport, int compress_threshold)
 {
 	bifrost_address_record_t* record = NULL;
-	GQuark	 key;
+	unsigned int threshold;
 
 	if (!name)
 	{
@@ -140,27 +384,34 @@ int register_unit (const char* name, int ip, int id)
 		return -1;
 	}
 
-	syslog (LOG_DEBUG, "requested register (id=%s, size=%u)", id, requested_packet_size);
+	if (ip == 0 || (transport != BIFROST_TRANSPORT_TCP && transport != BIFROST_TRANSPORT_UDP))
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
 
-	record = find_address (name);
+	syslog (LOG_DEBUG, "requested register (id=%s, address={%i, %i}, transport=%s)", name, ip, id,
+		transport == BIFROST_TRANSPORT_UDP ? "udp" : "tcp");
 
-	if (!record)
+	if (!find_address (name))
 	{
-		syslog (LOG_DEBUG, "new element => allocating memory");
-		record = malloc (sizeof (bifrost_address_record_t));
-		memset (record, 0, sizeof (bifrost_address_record_t));
-		if (!record)
-		{
-			syslog (LOG_DEBUG, "malloc failed!");
-			return -2;
-		}
-		
-		record->name = strdup (name);
-		record->ip = ip;
-		record->id = id;
+		// compression is set per peer - the last registered unit decides for all units of the node
+		threshold = compress_threshold < 0 ? 0 : compress_threshold ? (unsigned int)compress_threshold : bifrost_settings.net_compress_threshold;
+		if (net_allow_peer (ip)
+			|| (transport == BIFROST_TRANSPORT_UDP ? udp_transport_add_peer (ip, threshold) : tcp_transport_add_peer (ip, threshold)) < 0)
+			return -1;
+
+		record = add_address (name, ip, id);
+		record->route_key = REMOTE_ROUTE_KEY(ip, id);
+		record->transport = transport;
 
-		address_book = g_slist_append(address_book, record);
-		syslog (LOG_DEBUG, "added records:\n\tto addressbook: [%s]:{%i, %i}", name, address->ip, address->id);
+		pthread_rwlock_wrlock (&channels_lock);
+		if (!remote_routes)
+			remote_routes = g_hash_table_new (g_int64_hash, g_int64_equal);
+		g_hash_table_insert (remote_routes, &record->route_key, record);
+		pthread_rwlock_unlock (&channels_lock);
+
+		syslog (LOG_DEBUG, "added records:\n\tto addressbook: [%s]:{%i, %i}", name, record->address.ip, record->address.id);
 	}
 
 	return 0;
@@ -170,57 +421,681 @@ int register_unit (const char* name, int ip, int id)
 
 void unregister_unit (const char* name)
 {
-	bifrost_address_t* address = NULL;
+	bifrost_address_record_t* record = NULL;
 	channel_info_t* channel = NULL;
-	if (!address_book)	// nothing to do
+
+	if (!(record = find_address (name)))	// nothing to do
 		return;
-	
-	address = g_datalist_id_get_data (&address_book,  g_quark_from_string(name));
 
-	if (address && (address->ip == 0))
+	if (record->address.ip == 0)
 	{
-		if (BIFROST_ID_TO_CHANNEL_INDEX(address->id) < channels->len)
+		if ((channel = find_channel (record->address.id)))
 		{
-			channel = &g_array_index(channels, channel_info_t, BIFROST_ID_TO_CHANNEL_INDEX(address->id));
+			struct channel_t* closed;
+			struct channel_t* tx;
+
+			// inbox thread reads tx rings under the lock as well
+			pthread_rwlock_wrlock (&channels_lock);
 			channel->online = 0;
-			channel_close (channel->channel);
-			syslog (LOG_INFO, "unit [%s]:{%i:%i} is marked offline", name, address->ip, address->id);
+			closed = channel->channel;
+			channel->channel = NULL;
+			tx = channel->tx;
+			channel->tx = NULL;
+			pthread_rwlock_unlock (&channels_lock);
+			STATS_SET(channel->stats->online, 0);
+
+			channel_close (closed);
+			channel_close (tx);
+			syslog (LOG_INFO, "unit [%s]:{%i:%i} is marked offline", name, record->address.ip, record->address.id);
+			log_delivery_stats (channel);
 		}
 	} else
 	{
-		g_dataset_id_remove_data (&unit_list, g_quark_from_string(id));
-		syslog (LOG_INFO, "unit [%s]:{%i:%i} is removed", name, address->ip, address->id);
+		syslog (LOG_INFO, "unit [%s]:{%i:%i} is removed", name, record->address.ip, record->address.id);
+
+		// workers may look at the record until route is gone
+		pthread_rwlock_wrlock (&channels_lock);
+		g_hash_table_remove (remote_routes, &record->route_key);
+		pthread_rwlock_unlock (&channels_lock);
+
+		g_hash_table_remove (address_book, name);
 	}
 }
 
 //=================================================================================================
+// routing workers
 
+/* data messages are partitioned by destination into shards, so all messages for one unit pass
+	through one shard in bus order. A shard is drained by at most one worker at a time (busy flag),
+	which keeps per-destination ordering while letting any worker take it.
+	Worker drains its home shards (index % workers_count) first; when they are empty it steals
+	whole shards from other workers' ranges.
+	Shard keeps a queue per data lane, so a high priority message never waits behind bulk data
+	queued for the same destination; bulk lane passed over BROKER_SHARD_STARVATION drains in a row goes first.
+*/
 
+#define BROKER_SHARDS		64	// must be well above workers count, otherwise stealing can't balance load
+#define BROKER_SHARD_QUANTUM	64	// messages routed from shard before it is released to other workers
+#define BROKER_SHARD_LANES	BIFROST_PRIORITY_COMMAND	// data lanes only, commands never reach shards
+#define BROKER_SHARD_STARVATION	8
 
-//=================================================================================================
+typedef struct broker_shard_t {
+	mpsc_queue_t queues[BROKER_SHARD_LANES];
+	unsigned int pending __attribute__ ((aligned (64)));	// queued messages: dispatcher adds, workers subtract
+	int busy;				// some worker drains shard right now
+	unsigned int starved;			// drains in a row bulk lane was left non-empty, busy holder only
+} broker_shard_t;
 
-static unsigned int message_batch_count = bifrost_settings.message_batch_size;
+typedef struct broker_worker_t {
+	pthread_t thread;
+	unsigned int index;
+	unsigned long routed;
+	unsigned long stolen;			// shards drained outside of home range
+} broker_worker_t;
 
-void route_message (data_message_t* msg);
+static broker_shard_t shards[BROKER_SHARDS];
+static broker_worker_t* workers = NULL;
+static unsigned int workers_count = 0;
+
+// worker sleep: dispatcher bumps work_sequence after each batch, takes mutex only if somebody sleeps
+static unsigned int work_sequence = 0;
+static unsigned int workers_sleeping = 0;
+static int workers_stopping = 0;
+static pthread_mutex_t workers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workers_cond = PTHREAD_COND_INITIALIZER;
+
+static unsigned int message_batch_count = 0;	// 0 - all available messages
+static int message_batch_adaptive = 0;
+static unsigned long long message_cost_ns = 0;	// adaptive: average main loop time per message
+
+int route_message (data_message_t* msg);
 void execute_message (command_t* msg);
 
+// local deliveries are recorded by route_message itself, everything else is recorded here
+static inline int route_traced (data_message_t* msg)
+{
+	uint32_t destination = msg->dest_id.id;	// message may belong to transport afterwards
+	int rc = route_message (msg);
+
+	if (rc)
+		trace_instant (TRACE_ROUTE, destination, (uint32_t) rc);
+	return rc;
+}
+
+static inline unsigned int destination_shard (bifrost_address_t* dest)
+{
+	return ((unsigned int)dest->id ^ ((unsigned int)dest->ip * 2654435761u)) % BROKER_SHARDS;
+}
+
+// the same lane as on bus
+static inline unsigned int shard_lane (data_message_t* msg)
+{
+	return msg->priority < BROKER_SHARD_LANES ? msg->priority : BIFROST_PRIORITY_HIGH;
+}
+
+static unsigned int drain_lane (broker_shard_t* shard, unsigned int lane, unsigned int quantum)
+{
+	message_t* msg;
+	unsigned int count = 0;
+
+	while (count < quantum && (msg = mpsc_pop (&shard->queues[lane])))
+	{
+		if (route_traced ((data_message_t*)msg) != 1)
+			bifrost_free_message (msg);
+		count++;
+	}
+
+	return count;
+}
+
+static unsigned int drain_shard (broker_shard_t* shard)
+{
+	unsigned int count = 0;
+	unsigned int bulk = 0;
+
+	if (!__atomic_load_n (&shard->pending, __ATOMIC_RELAXED) || __atomic_load_n (&shard->busy, __ATOMIC_RELAXED)
+		|| __atomic_exchange_n (&shard->busy, 1, __ATOMIC_ACQUIRE))
+		return 0;
+
+	pthread_rwlock_rdlock (&channels_lock);
+	if (shard->starved >= BROKER_SHARD_STARVATION)
+		count = bulk = drain_lane (shard, BIFROST_PRIORITY_BULK, BROKER_SHARD_QUANTUM);
+
+	count += drain_lane (shard, BIFROST_PRIORITY_HIGH, BROKER_SHARD_QUANTUM - count);
+	if (!bulk)
+		count += (bulk = drain_lane (shard, BIFROST_PRIORITY_BULK, BROKER_SHARD_QUANTUM - count));
+	pthread_rwlock_unlock (&channels_lock);
+
+	if (bulk || mpsc_is_empty (&shard->queues[BIFROST_PRIORITY_BULK]))
+		shard->starved = 0;
+	else
+		shard->starved++;
+
+	__atomic_sub_fetch (&shard->pending, count, __ATOMIC_RELAXED);
+	// release hands shard queue consumer state over to the next worker
+	__atomic_store_n (&shard->busy, 0, __ATOMIC_RELEASE);
+
+	return count;
+}
+
+static void* worker_thread (void* arg)
+{
+	broker_worker_t* worker = (broker_worker_t*) arg;
+	unsigned int sequence, routed, count, s;
+	char name[16];
+
+	snprintf (name, sizeof (name), "router %u", worker->index);
+	trace_thread_name (name);
+
+	for (;;)
+	{
+		sequence = __atomic_load_n (&work_sequence, __ATOMIC_SEQ_CST);
+
+		routed = 0;
+		for (s = worker->index; s < BROKER_SHARDS; s += workers_count)
+			routed += drain_shard (&shards[s]);
+
+		if (!routed)
+		{
+			for (s = 0; s < BROKER_SHARDS; s++)
+			{
+				if (s % workers_count != worker->index && (count = drain_shard (&shards[s])))
+				{
+					routed += count;
+					worker->stolen++;
+				}
+			}
+		}
+
+		worker->routed += routed;
+		if (routed)
+			continue;
+
+		// nothing to do anywhere - sleep until dispatcher publishes a new batch
+		pthread_mutex_lock (&workers_mutex);
+		if (workers_stopping)
+		{
+			pthread_mutex_unlock (&workers_mutex);
+			break;
+		}
+		__atomic_add_fetch (&workers_sleeping, 1, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n (&work_sequence, __ATOMIC_SEQ_CST) == sequence && !workers_stopping)
+			pthread_cond_wait (&workers_cond, &workers_mutex);
+		__atomic_sub_fetch (&workers_sleeping, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock (&workers_mutex);
+	}
+
+	return NULL;
+}
+
+// wake up to one sleeping worker per shard touched by the batch
+static void wake_workers (unsigned int touched_shards)
+{
+	unsigned int sleeping;
+
+	__atomic_add_fetch (&work_sequence, 1, __ATOMIC_SEQ_CST);
+	if (!(sleeping = __atomic_load_n (&workers_sleeping, __ATOMIC_SEQ_CST)))
+		return;
+
+	pthread_mutex_lock (&workers_mutex);
+	if (touched_shards >= sleeping)
+		pthread_cond_broadcast (&workers_cond);
+	else
+		while (touched_shards--)
+			pthread_cond_signal (&workers_cond);
+	pthread_mutex_unlock (&workers_mutex);
+}
+
+static void start_workers ()
+{
+	unsigned int idx, lane;
+
+	for (idx = 0; idx < BROKER_SHARDS; idx++)
+		for (lane = 0; lane < BROKER_SHARD_LANES; lane++)
+			mpsc_init (&shards[idx].queues[lane]);
+
+	workers_count = bifrost_settings.broker_workers;
+	if (workers_count > BROKER_SHARDS)
+		workers_count = BROKER_SHARDS;
+	if (!workers_count)
+		return;
+
+	workers_stopping = 0;
+	workers = g_new0 (broker_worker_t, workers_count);
+	for (idx = 0; idx < workers_count; idx++)
+	{
+		workers[idx].index = idx;
+		if (pthread_create (&workers[idx].thread, NULL, worker_thread, &workers[idx]))
+		{
+			syslog (LOG_ERR, "%s: failed to start routing worker, %u started", __func__, idx);
+			break;
+		}
+	}
+
+	if (idx < workers_count)
+	{
+		// home ranges are computed from workers_count - restart with the threads we've got
+		pthread_mutex_lock (&workers_mutex);
+		workers_stopping = 1;
+		pthread_cond_broadcast (&workers_cond);
+		pthread_mutex_unlock (&workers_mutex);
+		while (idx--)
+			pthread_join (workers[idx].thread, NULL);
+		g_free (workers);
+		workers = NULL;
+		workers_count = 0;
+		return;
+	}
+
+	syslog (LOG_INFO, "%u routing workers started", workers_count);
+}
+
+// workers drain everything dispatched before they exit
+static void stop_workers ()
+{
+	unsigned int idx;
+
+	if (!workers_count)
+		return;
+
+	pthread_mutex_lock (&workers_mutex);
+	workers_stopping = 1;
+	pthread_cond_broadcast (&workers_cond);
+	pthread_mutex_unlock (&workers_mutex);
+
+	for (idx = 0; idx < workers_count; idx++)
+	{
+		pthread_join (workers[idx].thread, NULL);
+		syslog (LOG_INFO, "routing worker %u: routed %lu, stolen shards %lu", idx, workers[idx].routed, workers[idx].stolen);
+	}
+
+	g_free (workers);
+	workers = NULL;
+	workers_count = 0;
+}
+
+//=================================================================================================
+// unit inbox
+/* units send through their tx rings (records are bifrost_tx_header_t + payload), inbox thread moves
+	records into bus as data messages and sleeps on shared inbox doorbell (ipc.h) while all rings are empty.
+	Source address is the unit owning the ring, so nobody sends on behalf of another unit.
+	Records are copied out under channels lock and pushed without it: push may wait for overloaded bus,
+	while main loop thread needs write lock to register units.
+	Rings are written by unit processes, so they aren't trusted: a unit whose ring turns out broken
+	is not read anymore and is unregistered.
+*/
+
+#define INBOX_QUANTUM	64	// records taken from one ring per round, so busy units don't starve others
+#define INBOX_IDLE_MS	100	// sleep limit, stop flag is checked in between
+#define INBOX_RETRY_US	1000	// BUS_OVERLOAD_BLOCK: pause before pushing into overloaded bus again
+
+typedef struct inbox_batch_t {
+	bifrost_address_t source;
+	message_t* first;
+	message_t* last;
+	unsigned int count;
+	message_t* unregister;	// commands for units with broken rings
+} inbox_batch_t;
+
+static pthread_t inbox_thread_id;
+static int inbox_running = 0;
+static unsigned long inbox_invalid = 0;	// records without header or failed allocations
+static unsigned long inbox_broken = 0;	// units which have broken their rings
+
+static void take_tx_record (const char* data, unsigned int size, void* user_data)
+{
+	inbox_batch_t* batch = (inbox_batch_t*) user_data;
+	const bifrost_tx_header_t* header = (const bifrost_tx_header_t*) data;
+	data_message_t* msg;
+
+	if (size < sizeof (bifrost_tx_header_t)
+		|| !(msg = (data_message_t*) bifrost_create_message (MESSAGE_DATA, size - sizeof (bifrost_tx_header_t))))
+	{
+		inbox_invalid++;
+		return;
+	}
+
+	msg->src_id = batch->source;
+	msg->dest_id = header->dest_id;
+	msg->priority = header->priority < BIFROST_PRIORITY_COMMAND ? header->priority : BIFROST_PRIORITY_BULK;
+	memcpy (msg->buf, header + 1, msg->buffer_size);
+
+	if (batch->last)
+		batch->last->next = (message_t*) msg;
+	else
+		batch->first = (message_t*) msg;
+	batch->last = (message_t*) msg;
+	batch->count++;
+}
+
+/* unit goes offline through bus as with UnregisterUnit: address book belongs to broker thread
+	tx_broken is written by inbox thread only, main loop thread resets it when the unit comes back
+*/
+static void drop_broken_unit (inbox_batch_t* batch, channel_info_t* ch)
+{
+	command_t* cmd;
+	unsigned int len = strlen (ch->record->name) + 1;
+
+	ch->tx_broken = 1;
+	inbox_broken++;
+	syslog (LOG_ERR, "unit [%s]: tx ring is broken, unit is unregistered", ch->record->name);
+
+	if (!(cmd = (command_t*) bifrost_create_message (MESSAGE_COMMAND, len)))
+		return;
+	cmd->command_type = BIFROST_UNREGISTER_UNIT;
+	memcpy (cmd->args, ch->record->name, len);
+	cmd->next = batch->unregister;
+	batch->unregister = (message_t*) cmd;
+}
+
+// take one round of records from all tx rings
+static void collect_tx_records (inbox_batch_t* batch)
+{
+	unsigned int idx;
+
+	memset (batch, 0, sizeof (inbox_batch_t));
+
+	pthread_rwlock_rdlock (&channels_lock);
+	for (idx = 0; channels && idx < channels->len; idx++)
+	{
+		channel_info_t* ch = &g_array_index (channels, channel_info_t, idx);
+
+		if (!ch->tx || ch->tx_broken)
+			continue;
+		batch->source = ch->record->address;
+		if (channel_drain (ch->tx, take_tx_record, batch, INBOX_QUANTUM) == -3)
+			drop_broken_unit (batch, ch);
+	}
+	pthread_rwlock_unlock (&channels_lock);
+}
+
+static int tx_records_pending ()
+{
+	unsigned int idx;
+	int pending = 0;
+
+	pthread_rwlock_rdlock (&channels_lock);
+	for (idx = 0; channels && idx < channels->len && !pending; idx++)
+	{
+		channel_info_t* ch = &g_array_index (channels, channel_info_t, idx);
+		pending = ch->tx && !ch->tx_broken && channel_get_data_size (ch->tx) > 0;
+	}
+	pthread_rwlock_unlock (&channels_lock);
+
+	return pending;
+}
+
+/* with BUS_OVERLOAD_BLOCK units are held back here - their rings fill up and they see it.
+	Push itself never blocks: nobody drains bus while daemon stops, thread must still be able to quit
+*/
+static void push_tx_message (message_t* msg)
+{
+	int rc;
+
+	while ((rc = bifrost_try_push_message (msg)) && rc != -1
+		&& bifrost_settings.bus_overload_policy == BUS_OVERLOAD_BLOCK
+		&& __atomic_load_n (&inbox_running, __ATOMIC_ACQUIRE))
+		usleep (INBOX_RETRY_US);
+
+	if (rc)
+		bifrost_free_message (msg);
+}
+
+static void* inbox_thread (void* arg)
+{
+	inbox_batch_t batch;
+	message_t* msg;
+	message_t* next;
+	unsigned long moved = 0;
+	unsigned int seen;
+
+	(void) arg;
+	trace_thread_name ("inbox");
+
+	while (__atomic_load_n (&inbox_running, __ATOMIC_ACQUIRE))
+	{
+		collect_tx_records (&batch);
+
+		for (msg = batch.first; msg; msg = next)
+		{
+			next = msg->next;
+			msg->next = NULL;
+			push_tx_message (msg);
+		}
+		moved += batch.count;
+
+		for (msg = batch.unregister; msg; msg = next)
+		{
+			next = msg->next;
+			msg->next = NULL;
+			if (bifrost_push_message (msg))
+				bifrost_free_message (msg);
+		}
+
+		if (batch.count)
+			continue;
+
+		seen = inbox_prepare_sleep ();
+		if (!tx_records_pending ())
+			inbox_wait (seen, INBOX_IDLE_MS);
+		inbox_finish_sleep ();
+	}
+
+	syslog (LOG_INFO, "inbox: moved %lu messages from units, %lu invalid records, %lu broken rings", moved, inbox_invalid,
+		inbox_broken);
+	return NULL;
+}
+
+static void start_inbox ()
+{
+	if (!bifrost_settings.unit_tx_capacity)
+		return;
+
+	if (inbox_create ())
+	{
+		syslog (LOG_WARNING, "units can't send: no inbox");
+		return;
+	}
+
+	inbox_running = 1;
+	if (pthread_create (&inbox_thread_id, NULL, inbox_thread, NULL))
+	{
+		syslog (LOG_ERR, "%s: failed to start inbox thread", __func__);
+		inbox_running = 0;
+		inbox_destroy ();
+	}
+}
+
+static void stop_inbox ()
+{
+	if (!inbox_running)
+		return;
+
+	__atomic_store_n (&inbox_running, 0, __ATOMIC_RELEASE);
+	inbox_notify ();
+	pthread_join (inbox_thread_id, NULL);
+	inbox_destroy ();
+}
+
+//=================================================================================================
+// batch sizing
+
+static void set_batch_size (unsigned int size)
+{
+	if (size == BIFROST_BATCH_SIZE_ADAPTIVE)
+	{
+		message_batch_adaptive = 1;
+		message_cost_ns = 0;
+		syslog (LOG_INFO, "batch size is adaptive (%u..%u messages, %u us)", bifrost_settings.message_batch_min,
+			bifrost_settings.message_batch_max, bifrost_settings.message_batch_latency_us);
+		return;
+	}
+
+	// takes effect from the next batch; 0 - process all available messages
+	message_batch_adaptive = 0;
+	__atomic_store_n (&message_batch_count, size, __ATOMIC_RELAXED);
+	syslog (LOG_INFO, "batch size changed to %u", size);
+}
+
+/* batch follows bus depth: small when traffic is light, so the loop gets back to other event sources soon,
+	large under load to amortize per-batch costs - but never longer than latency target at measured cost
+*/
+static unsigned int adaptive_batch_size ()
+{
+	unsigned long long limit = bifrost_settings.message_batch_max;
+	unsigned int size = bifrost_bus_depth ();
+
+	if (message_cost_ns && limit > bifrost_settings.message_batch_latency_us * 1000ULL / message_cost_ns)
+		limit = bifrost_settings.message_batch_latency_us * 1000ULL / message_cost_ns;
+	if (limit < bifrost_settings.message_batch_min)
+		limit = bifrost_settings.message_batch_min;
+
+	if (size < bifrost_settings.message_batch_min)
+		size = bifrost_settings.message_batch_min;
+	if (size > limit)
+		size = limit;
+
+	return size;
+}
+
+unsigned int broker_get_batch_size ()
+{
+	return __atomic_load_n (&message_batch_count, __ATOMIC_RELAXED);
+}
+
+//=================================================================================================
+
+void broker_init ()
+{
+	size_t prefix_len;
+
+	// 0 would mean "everything" for adaptive batch
+	if (bifrost_settings.message_batch_min == 0)
+		bifrost_settings.message_batch_min = 1;
+	if (bifrost_settings.message_batch_max < bifrost_settings.message_batch_min)
+		bifrost_settings.message_batch_max = bifrost_settings.message_batch_min;
+
+	// channel keys are taken from their paths, so directory of prefix ('/' at its end) must exist
+	prefix_len = strlen (bifrost_settings.channel_prefix);
+	if (prefix_len > 1 && bifrost_settings.channel_prefix[prefix_len - 1] == '/'
+		&& mkdir (bifrost_settings.channel_prefix, 0755) == -1 && errno != EEXIST)
+		syslog (LOG_WARNING, "failed to create channel directory '%s': %s", bifrost_settings.channel_prefix, strerror (errno));
+
+	latency_init ();
+	stats = stats_create (bifrost_settings.queue_path);
+	set_batch_size (bifrost_settings.message_batch_size);
+	start_workers ();
+	start_inbox ();
+}
+
 //-------------------------------------------------------------------------------------------------
-// main broker function
+
+/* source counters and channels array are written by main loop thread only,
+	so sources are counted here, while batch is walked anyway
+*/
+static inline void count_source (const data_message_t* msg)
+{
+	channel_info_t* source;
+
+	if (msg->src_id.ip == 0 && (source = find_channel (msg->src_id.id)))
+	{
+		STATS_ADD(source->stats->sent, 1);
+		STATS_ADD(source->stats->sent_bytes, msg->buffer_size);
+	}
+}
+
+static void publish_bus_stats (unsigned int count, unsigned int limit)
+{
+	unsigned long rejected, dropped;
+
+	bifrost_bus_overload_counts (&rejected, &dropped);
+
+	STATS_SET(stats->bus_depth, bifrost_bus_depth ());
+	STATS_ADD(stats->batches, 1);
+	STATS_ADD(stats->batch_messages, count);
+	STATS_ADD(stats->batch_limit, limit ? limit : count);	// unlimited batch is always full
+	STATS_SET(stats->bus_rejected, rejected);
+	STATS_SET(stats->bus_dropped, dropped);
+	STATS_SET(stats->dropped_no_route, __atomic_load_n (&dropped_no_route, __ATOMIC_RELAXED));
+}
+
+// main broker function - executes commands and hands data messages over to routing workers
 void process_bus_messages ()
 {
 	message_t* message = NULL;
-	unsigned int i;
+	message_t* next = NULL;
+	unsigned long long touched = 0;	// bit per shard, BROKER_SHARDS == 64
+	unsigned long long popped_at;
+	unsigned int shard;
+	unsigned int count = 0;
+	unsigned int limit;
+	int adaptive = message_batch_adaptive;
+	struct timespec start, end;
 
-	for (i = 0; i < message_batch_count; i++)
+	if (adaptive)
 	{
-		message = bifrost_pop_message ();
+		__atomic_store_n (&message_batch_count, adaptive_batch_size (), __ATOMIC_RELAXED);
+		clock_gettime (CLOCK_MONOTONIC, &start);
+	}
+
+	// whole batch is detached from bus at once and processed in place
+	limit = message_batch_count;
+	message = bifrost_pop_messages (limit);
+	popped_at = latency_now ();
+
+	for (; message; message = next)
+	{
+		next = message->next;
+		count++;
+
+		if (message->message_type == MESSAGE_DATA)
+		{
+			((data_message_t*)message)->popped_at = popped_at;
+			count_source ((data_message_t*)message);
+		}
+
+		if (message->message_type == MESSAGE_DATA && workers_count)
+		{
+			shard = destination_shard (&((data_message_t*)message)->dest_id);
+			// counted before push: worker may see pending message which is not linked yet, but never the opposite
+			__atomic_add_fetch (&shards[shard].pending, 1, __ATOMIC_RELAXED);
+			mpsc_push (&shards[shard].queues[shard_lane ((data_message_t*)message)], message);
+			touched |= 1ULL << shard;
+			continue;	// released by worker
+		}
+
 		if (message->message_type == MESSAGE_DATA)
 		{
-			route_message (message);
+			if (route_traced ((data_message_t*)message) == 1)
+				continue;	// forwarded - released by transport
 		} else if (message->message_type == MESSAGE_COMMAND)
 		{
-			execute (message);
+			unsigned long long start = latency_now ();
+
+			execute_message ((command_t*)message);
+			trace_event (TRACE_COMMAND, ((command_t*)message)->command_type, 0, start, latency_now ());
 		}
+		bifrost_free_message (message);
+	}
+
+	if (touched)
+		wake_workers (__builtin_popcountll (touched));
+
+	if (announced && announced->len)
+		announce_channels ();
+
+	if (count)
+		trace_event (TRACE_POP, 0, count, popped_at, latency_now ());
+	if (count && stats)
+		publish_bus_stats (count, limit);
+
+	if (adaptive && count)
+	{
+		unsigned long long cost;
+
+		clock_gettime (CLOCK_MONOTONIC, &end);
+		cost = ((end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec) / count;
+		message_cost_ns = message_cost_ns ? (message_cost_ns * 7 + cost) / 8 : cost;
 	}
 }
 
@@ -240,32 +1115,34 @@ void execute_message (command_t* msg)
 
 	case BIFROST_SET_MESSAGE_BATCH_SIZE:
 		if (msg->buffer_size == sizeof(unsigned int))
-		{
-			message_batch_count = *(unsigned int*)(msg->args);
-			syslog (LOG_INFO, "batch size changed to %u", message_batch_count);
-		} else 
-			syslog (LOG_ERROR, "incorrect arguments buffer size: (should be %u, got %u)", sizeof(unsigned int), msg->buffer_size);
+			set_batch_size (*(unsigned int*)(msg->args));
+		else
+			syslog (LOG_ERR, "incorrect arguments buffer size: (should be %zu, got %u)", sizeof(unsigned int), msg->buffer_size);
 		break;
 
 	case BIFROST_REGISTER_UNIT:
 		if (msg->buffer_size >= sizeof(bifrost_register_unit_command_t))
 		{
 			bifrost_register_unit_command_t* cmd = (bifrost_register_unit_command_t*) msg->args;
-			register_unit (cmd->name, cmd->packet_size);
+			register_unit (cmd->name, cmd->packet_size, cmd->channel_mode);
 		}
 		break;
 
+	case BIFROST_REGISTER_UNITS:
+		register_units (msg);
+		break;
+
 	case BIFROST_REGISTER_REMOTE_UNIT:
 		if (msg->buffer_size >= sizeof(bifrost_register_remote_unit_command_t))
 		{
 			bifrost_register_remote_unit_command_t* cmd = (bifrost_register_remote_unit_command_t*) msg->args;
-			register_unit (cmd->name, cmd->ip, cmd->id);
+			register_remote_unit (cmd->name, cmd->ip, cmd->id, cmd->transport, cmd->compress_threshold);
 		}
 		break;
 
 	case BIFROST_UNREGISTER_UNIT:
 		if (msg->buffer_size > 0)
-			unregister_unit (cmd->buf);
+			unregister_unit (msg->args);
 		break;
 
 	default:
@@ -275,39 +1152,191 @@ void execute_message (command_t* msg)
 
 //-------------------------------------------------------------------------------------------------
 
-void route_message (data_message_t* msg)
+// clocks of different cores may disagree by a few ticks
+static inline unsigned long long stage_ticks (unsigned long long from, unsigned long long to)
 {
-#pragma message "not implemented!"
+	return to > from ? to - from : 0;
+}
+
+static inline void record_latency (latency_histogram_t* latency, const data_message_t* msg,
+				   unsigned long long route_at, unsigned long long delivered_at)
+{
+	latency_record (&latency[LATENCY_STAGE_PUSH], stage_ticks (msg->created_at, msg->pushed_at));
+	latency_record (&latency[LATENCY_STAGE_BUS], stage_ticks (msg->pushed_at, msg->popped_at));
+	latency_record (&latency[LATENCY_STAGE_DISPATCH], stage_ticks (msg->popped_at, route_at));
+	latency_record (&latency[LATENCY_STAGE_DELIVER], stage_ticks (route_at, delivered_at));
+	latency_record (&latency[LATENCY_STAGE_TOTAL], stage_ticks (msg->created_at, delivered_at));
+}
+
+/* local delivery: payload is copied once, right into destination channel.
+	Never blocks: message to offline unit, to full ring or to busy slot is dropped and counted.
+	Called by routing worker under channels read lock; channel counters and latency histograms have
+	a single writer, because a destination is routed by one worker at a time.
+	Messages to remote units are handed over as they are to transport the unit was registered with.
+	returns 0 if delivered, 1 if forwarded (message is owned by transport then), negative value otherwise
+*/
+int route_message (data_message_t* msg)
+{
+	channel_info_t* channel = NULL;
+	bifrost_address_record_t* remote;
+	unsigned long long route_at, delivered_at;
+	int rc;
+
+	if (msg->dest_id.ip != 0)
+	{
+		if ((remote = find_remote (msg->dest_id)))
+		{
+			rc = remote->transport == BIFROST_TRANSPORT_UDP ? udp_transport_send (msg) : tcp_transport_send (msg);
+			if (rc == 0)
+				return 1;
+		}
+
+		__atomic_add_fetch (&dropped_no_route, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (!(channel = find_channel (msg->dest_id.id)))
+	{
+		__atomic_add_fetch (&dropped_no_route, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+
+	if (!channel->online || !channel->channel)
+	{
+		STATS_ADD(channel->stats->dropped_offline, 1);
+		return -2;
+	}
+
+	if (msg->buffer_size == 0)
+	{
+		STATS_ADD(channel->stats->dropped_invalid, 1);
+		return -4;
+	}
+
+	route_at = latency_now ();
+	rc = channel_try_write (channel->channel, msg->buf, msg->buffer_size);
+	delivered_at = latency_now ();
+	channel->delivery_ticks += delivered_at - route_at;
+
+	if (rc == -4)
+	{
+		STATS_ADD(channel->stats->dropped_full, 1);
+		return -3;
+	} else if (rc < 0)
+	{
+		STATS_ADD(channel->stats->dropped_invalid, 1);
+		return -4;
+	}
+
+	STATS_ADD(channel->stats->delivered, 1);
+	STATS_ADD(channel->stats->delivered_bytes, msg->buffer_size);
+	trace_event (TRACE_CHANNEL_WRITE, msg->dest_id.id, msg->buffer_size, route_at, delivered_at);
+	record_latency (channel->latency, msg, route_at, delivered_at);
+	return 0;
 }
 
 //-------------------------------------------------------------------------------------------------
-void address_book_record_free(bifrost_address_book_record_t* rec)
+
+static void report_latency (const char* unit, unsigned int stage, const latency_histogram_t* hist,
+			    broker_latency_handler_t handler, void* user_data)
+{
+	broker_latency_t entry;
+
+	if (!(entry.count = latency_count (hist)))
+		return;
+
+	entry.unit = unit;
+	entry.stage = latency_stage_names[stage];
+	entry.p50_ns = latency_percentile_ns (hist, 50.0);
+	entry.p99_ns = latency_percentile_ns (hist, 99.0);
+	entry.p999_ns = latency_percentile_ns (hist, 99.9);
+	handler (&entry, user_data);
+}
+
+void broker_get_latency (broker_latency_handler_t handler, void* user_data)
 {
-	free (rec->name);
-	free (rec);
+	latency_histogram_t* all;	// LATENCY_STAGES + channel wait
+	const latency_histogram_t* wait;
+	channel_info_t* ch;
+	unsigned int idx, stage;
+
+	if (!handler)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return;
+	}
+
+	all = g_new0 (latency_histogram_t, LATENCY_STAGES + 1);
+
+	// histograms are written by workers meanwhile, lock only keeps channels array in place
+	pthread_rwlock_rdlock (&channels_lock);
+	for (idx = 0; channels && idx < channels->len; idx++)
+	{
+		ch = &g_array_index (channels, channel_info_t, idx);
+		for (stage = 0; stage < LATENCY_STAGES; stage++)
+		{
+			report_latency (ch->record->name, stage, &ch->latency[stage], handler, user_data);
+			latency_merge (&all[stage], &ch->latency[stage]);
+		}
+
+		if (ch->channel && (wait = channel_get_wait_histogram (ch->channel)))
+		{
+			report_latency (ch->record->name, LATENCY_STAGES, wait, handler, user_data);
+			latency_merge (&all[LATENCY_STAGES], wait);
+		}
+	}
+	pthread_rwlock_unlock (&channels_lock);
+
+	for (stage = 0; stage <= LATENCY_STAGES; stage++)
+		report_latency ("*", stage, &all[stage], handler, user_data);
+
+	g_free (all);
 }
 
+//-------------------------------------------------------------------------------------------------
+
 void broker_uninit ()
 {
-	int idx;
+	unsigned int idx;
+
+	stop_inbox ();
+	stop_workers ();
 
 	if (channels) {
 		// close all channels and remove them
 		for (idx = 0; idx < channels->len; idx++)
 		{
 			channel_info_t* ch = &g_array_index (channels, channel_info_t, idx);
+			log_delivery_stats (ch);
 			channel_close (ch->channel);
-			free (ch->shm_name);
-			free (ch->sem_name);
+			channel_close (ch->tx);
+			g_free (ch->shm_name);
+			g_free (ch->tx_name);
+			g_free (ch->latency);
+			if (ch->stats_private)
+				g_free (ch->stats);
 		}
-		g_array_free (channels);
+		g_array_free (channels, TRUE);
 		channels = NULL;
 	}
 
+	if (dropped_no_route)
+		syslog (LOG_INFO, "%lu messages had no route", dropped_no_route);
+
+	if (announced) {
+		g_array_free (announced, TRUE);
+		announced = NULL;
+	}
+
+	stats = NULL;	// page outlives broker, see stats_create
+
 	// remove addresses
+	if (remote_routes) {
+		g_hash_table_destroy (remote_routes);
+		remote_routes = NULL;
+	}
 	if (address_book) {
-		g_slist_free_full (address_book, address_book_record_free);
+		g_hash_table_destroy (address_book);
 		address_book = NULL;
 	}
 }
-
@@ -3,9 +3,9 @@
 // address book
 
 // local unit
-//int register_unit (const char* name, unsigned int requested_packet_size);
+//int register_unit (const char* name, unsigned int requested_packet_size, int channel_mode);
 // remote unit (from avahi-browse)
-//int register_unit (const char* name, int ip, int id);
+//int register_remote_unit (const char* name, int ip, int id, int transport, int compress_threshold);
 
 /* local units are only marked as offline (needed for id reacquisition)
    remote units are removed
@@ -13,5 +13,26 @@
 //void unregister_unit (const char* name);
 
 // main functions
+void broker_init ();
 void process_bus_messages ();
+/* batch size used for the last batch - may be read from any thread */
+unsigned int broker_get_batch_size ();
+
+/* latency percentiles of delivered messages, nanoseconds
+	stages: push (create -> push), bus (push -> pop), dispatch (pop -> route), deliver (route -> written
+	into channel), total (create -> written), channel (written -> read by unit, ring channels only).
+	handler is called for every local unit and stage which has samples, then for all units together (unit "*").
+	May be called from any thread
+*/
+typedef struct broker_latency_t {
+	const char* unit;
+	const char* stage;
+	unsigned long long count;
+	unsigned long long p50_ns;
+	unsigned long long p99_ns;
+	unsigned long long p999_ns;
+} broker_latency_t;
+
+typedef void (*broker_latency_handler_t) (const broker_latency_t* latency, void* user_data);
+void broker_get_latency (broker_latency_handler_t handler, void* user_data);
 void broker_uninit ();
@@ -2,11 +2,16 @@
 #include <pthread.h>
 #include <dbus/dbus.h>
 #include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
 #include <glib.h>
 #include <gio/gio.h>
 
 #include "../message.h"
 #include "../settings.h"
+#include "../broker.h"
+#include "../trace.h"
 
 const char *version = "0.1";
 
@@ -17,13 +22,23 @@ const char *server_introspection_xml =
 	"    <annotation name='org.gtk.GDBus.Annotation' value='OnInterface'/>"
 	"    <annotation name='org.gtk.GDBus.Annotation' value='AlsoOnInterface'/>"
 	/* unit registration method
-		in - daemon id, packet size
+		in - daemon id, packet size, channel mode (0 - single slot, 1 - ring; packet size is ring capacity then)
 		out - names of message queue and shared memory
 	*/
 	"    <method name='RegisterUnit'>"
 	"      <annotation name='org.gtk.GDBus.Annotation' value='ChannelRequest'/>"
 	"      <arg type='s' name='id' direction='in'/>"
 	"      <arg type='u' name='packetSize' direction='in'/>"
+	"      <arg type='u' name='channelMode' direction='in'/>"
+	"    </method>"
+	/* batch registration - one call and one broker wakeup for any number of units.
+		Answered when broker has made all channels, D-Bus thread serves other calls meanwhile.
+		in - (name, packet size, channel mode) per unit, as for RegisterUnit
+		out - (name, id, shm path, tx ring path) per unit in request order; id -1 - unit wasn't registered
+	*/
+	"    <method name='RegisterUnits'>"
+	"      <arg type='a(suu)' name='units' direction='in'/>"
+	"      <arg type='a(siss)' name='channels' direction='out'/>"
 	"    </method>"
 	/* unit requests to free allocated channel
 	*/
@@ -37,14 +52,28 @@ const char *server_introspection_xml =
 	"      <annotation name='org.gtk.GDBus.Annotation' value='Onsignal'/>"
 	"    </signal>"
 	/* this signal is emitted when bifrost have created a channel
+		shmName - channel unit reads from, txName - ring unit sends through; empty if there is none
 	*/
 	"    <signal name='ChannelOpen'>"
 	"      <annotation name='org.gtk.GDBus.Annotation' value='Onsignal'/>"
 	"      <arg type='s' name='id' direction='in'/>"
 	"      <arg type='i' name='queueId' direction='in'/>"
 	"      <arg type='s' name='shmName' direction='in'/>"
-	"      <arg type='s' name='semName' direction='in'/>"
+	"      <arg type='s' name='txName' direction='in'/>"
+	"    </signal>"
+	/* coalesced ChannelOpen: all channels made by RegisterUnits calls of one broker batch,
+		(name, id, shm path, tx ring path); units of RegisterUnit are announced by ChannelOpen only
+	*/
+	"    <signal name='ChannelsOpen'>"
+	"      <arg type='a(siss)' name='channels' direction='in'/>"
 	"    </signal>"
+	/* flight recorder: newest bus events of all daemon threads as Chrome trace / Perfetto JSON
+		in - number of events (0 - everything recorded)
+	*/
+	"    <method name='DumpTrace'>"
+	"      <arg type='u' name='maxEvents' direction='in'/>"
+	"      <arg type='s' name='trace' direction='out'/>"
+	"    </method>"
 	// version property
 	"    <property type='s' name='Version' access='read'>"
 	"      <annotation name='org.gtk.GDBus.Annotation' value='OnProperty'>"
@@ -57,6 +86,16 @@ const char *server_introspection_xml =
 	"        <annotation name='org.gtk.GDBus.Annotation' value='OnAnnotation_InterfaceVersion'/>"
 	"      </annotation>"
 	"    </property>"
+	// effective size of the last bus batch (changes on every batch in adaptive mode)
+	"    <property type='u' name='BatchSize' access='read'>"
+	"      <annotation name='org.gtk.GDBus.Annotation' value='OnProperty'/>"
+	"    </property>"
+	/* latency percentiles per unit and stage: unit ('*' - all units), stage, samples, p50, p99, p99.9 in ns
+		stages: push, bus, dispatch, deliver, total (create -> written into channel), channel (wait in ring)
+	*/
+	"    <property type='a(sstttt)' name='Latency' access='read'>"
+	"      <annotation name='org.gtk.GDBus.Annotation' value='OnProperty'/>"
+	"    </property>"
 	"  </interface>"
 	"</node>";
 
@@ -137,16 +176,98 @@ void bifrost_dbus_stop_server ()
 
 GDBusConnection* dbus_connection = NULL;
 
-// 'Shutdown' signal emitter
-/*
-gboolean emit_signal_shutdown (void* arg)
+static GVariant* channels_variant (const bifrost_channel_descriptor_t* channels, unsigned int count)
+{
+	GVariantBuilder builder;
+	unsigned int idx;
+
+	g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(siss)"));
+	for (idx = 0; idx < count; idx++)
+		g_variant_builder_add (&builder, "(siss)", channels[idx].name, channels[idx].id,
+				       channels[idx].shm_name ? channels[idx].shm_name : "",
+				       channels[idx].tx_name ? channels[idx].tx_name : "");
+
+	return g_variant_builder_end (&builder);
+}
+
+/* signals are emitted by broker thread; connection sends them from its own worker,
+	so nobody waits for D-Bus here
+*/
+void bifrost_dbus_emit_signal (signal_type_t signal_type, ...)
+{
+	GDBusConnection* connection = __atomic_load_n (&dbus_connection, __ATOMIC_ACQUIRE);
+	GVariant* parameters = NULL;
+	const char* signal_name = NULL;
+	GError* error = NULL;
+	va_list args;
+
+	if (!connection)	// nobody can hear it yet
+		return;
+
+	va_start (args, signal_type);
+	switch (signal_type)
+	{
+	case BIFROST_SIGNAL_SHUTDOWN:
+		signal_name = "Shutdown";
+		break;
+	case BIFROST_SIGNAL_CHANNEL_REGISTERED:
+	{
+		const char* name = va_arg (args, const char*);
+		int id = va_arg (args, int);
+		const char* shm_name = va_arg (args, const char*);
+		const char* tx_name = va_arg (args, const char*);
+
+		signal_name = "ChannelOpen";
+		parameters = g_variant_new ("(siss)", name, id, shm_name ? shm_name : "", tx_name ? tx_name : "");
+		break;
+	}
+	case BIFROST_SIGNAL_CHANNELS_REGISTERED:
+	{
+		const bifrost_channel_descriptor_t* channels = va_arg (args, const bifrost_channel_descriptor_t*);
+		unsigned int count = va_arg (args, unsigned int);
+
+		if (!channels || !count)
+			break;
+		signal_name = "ChannelsOpen";
+		parameters = g_variant_new ("(@a(siss))", channels_variant (channels, count));
+		break;
+	}
+	}
+	va_end (args);
+
+	if (!signal_name)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return;
+	}
+
+	if (!g_dbus_connection_emit_signal (connection, NULL, DBUS_OBJECT, DBUS_INTERFACE, signal_name, parameters, &error))
+	{
+		syslog (LOG_ERR, "failed to transmit signal %s: %s", signal_name, error->message);
+		g_error_free (error);
+	}
+}
+
+// invocation may be answered from any thread, GDBus sends the reply from its worker
+void bifrost_dbus_return_channels (void* reply, const bifrost_channel_descriptor_t* channels, unsigned int count)
 {
-	if (dbus_connection)
+	GDBusMethodInvocation* invocation = (GDBusMethodInvocation*) reply;
+
+	if (!invocation)
 	{
-		
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return;
 	}
+
+	if (!channels)
+	{
+		g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+						       "Malformed registration request!");
+		return;
+	}
+
+	g_dbus_method_invocation_return_value (invocation, g_variant_new ("(@a(siss))", channels_variant (channels, count)));
 }
-*/
 
 static void on_bus_acquired (GDBusConnection *connection,
                  const gchar     *name,
@@ -176,7 +297,7 @@ static void on_name_acquired (GDBusConnection *connection,
                   gpointer         user_data)
 {
 	syslog (LOG_DEBUG, "acquired name %s", name);
-	dbus_connection = connection;
+	__atomic_store_n (&dbus_connection, connection, __ATOMIC_RELEASE);
 }
 
 static void on_name_lost (GDBusConnection *connection,
@@ -184,7 +305,7 @@ static void on_name_lost (GDBusConnection *connection,
               gpointer         user_data)
 {
 	syslog (LOG_DEBUG, "lost name %s", name);
-	dbus_connection = NULL;
+	__atomic_store_n (&dbus_connection, NULL, __ATOMIC_RELEASE);
   	exit (1);
 }
 
@@ -197,6 +318,8 @@ static void* dbus_worker (void* arg)
 	GError* error = NULL;
 	GMainContext *ctx = NULL;
 
+	trace_thread_name ("d-bus");
+
 	// we must create a separate context and main loop for our worker to process events
 	ctx = g_main_context_new();
 
@@ -286,8 +409,7 @@ static void server_message_handler (GDBusConnection       *connection,
 	{
 		char* name = NULL;
 		unsigned int requested_packet_size = 0;
-		char* shm_name = NULL;
-		char* sem_name = NULL;
+		unsigned int channel_mode = 0;
 		command_t* message = NULL;
 		bifrost_register_unit_command_t* command = NULL;
 		int len;
@@ -295,11 +417,11 @@ static void server_message_handler (GDBusConnection       *connection,
 		// get arguments
 		syslog (LOG_DEBUG, "processing %s call", method_name);
 
-		g_variant_get (parameters, "(&su)", &name, &requested_packet_size);
+		g_variant_get (parameters, "(&suu)", &name, &requested_packet_size, &channel_mode);
 
 		len = sizeof(bifrost_register_unit_command_t) + strlen (name) + 1;
 
-		if (!(message = bifrost_create_message (MESSAGE_COMMAND, len)))
+		if (!(message = (command_t*) bifrost_create_message (MESSAGE_COMMAND, len)))
 		{
 			syslog (LOG_ERR, "Failed to allocate %u bytes for unit [%s] registration", len, sender);
 			// return error
@@ -310,31 +432,128 @@ static void server_message_handler (GDBusConnection       *connection,
 			return;
 		}
 
-		command = message->args;
+		message->command_type = BIFROST_REGISTER_UNIT;
+		command = (bifrost_register_unit_command_t*) message->args;
 		command->packet_size = requested_packet_size;
+		command->channel_mode = channel_mode;
 		strcpy(command->name, name);
 
 		// send command to bus
-		bifrost_push_message (message);
+		bifrost_push_message ((message_t*) message);
 
 		syslog (LOG_DEBUG, "requested unit [%s] registration ", name);
 
 		// response
-		g_dbus_method_invocation_return_value (invocation, g_variant_new ("()");
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("()"));
+
+		return;
+	} else if (g_strcmp0 (method_name, "RegisterUnits") == 0)
+	{
+		GVariant* units = g_variant_get_child_value (parameters, 0);
+		GVariantIter iter;
+		const char* name = NULL;
+		unsigned int requested_packet_size = 0;
+		unsigned int channel_mode = 0;
+		command_t* message = NULL;
+		bifrost_register_units_command_t* command = NULL;
+		bifrost_register_unit_command_t* unit = NULL;
+		char* entry;
+		unsigned int len = sizeof (bifrost_register_units_command_t);
+
+		syslog (LOG_DEBUG, "processing %s call for %zu units", method_name, g_variant_n_children (units));
+
+		// whole batch is a single command, so units don't interleave with other bus traffic
+		g_variant_iter_init (&iter, units);
+		while (g_variant_iter_next (&iter, "(&suu)", &name, &requested_packet_size, &channel_mode))
+			len += BIFROST_REGISTER_UNIT_ENTRY_SIZE(strlen (name));
+
+		if (!(message = (command_t*) bifrost_create_message (MESSAGE_COMMAND, len)))
+		{
+			syslog (LOG_ERR, "Failed to allocate %u bytes for registration of units [%s]", len, sender);
+			g_variant_unref (units);
+			g_dbus_method_invocation_return_error (invocation,
+						      G_DBUS_ERROR,
+						      G_DBUS_ERROR_NO_MEMORY,
+						      "Failed to allocate requested resources!");
+			return;
+		}
 
+		message->command_type = BIFROST_REGISTER_UNITS;
+		command = (bifrost_register_units_command_t*) message->args;
+		command->reply = invocation;
+		command->count = 0;
+		entry = command->units;
+
+		g_variant_iter_init (&iter, units);
+		while (g_variant_iter_next (&iter, "(&suu)", &name, &requested_packet_size, &channel_mode))
+		{
+			unit = (bifrost_register_unit_command_t*) entry;
+			unit->packet_size = requested_packet_size;
+			unit->channel_mode = channel_mode;
+			strcpy (unit->name, name);
+			entry += BIFROST_REGISTER_UNIT_ENTRY_SIZE(strlen (name));
+			command->count++;
+		}
+		g_variant_unref (units);
+
+		// broker answers the call (bifrost_dbus_return_channels)
+		bifrost_push_message ((message_t*) message);
 		return;
 	} else if (g_strcmp0 (method_name, "UnregisterUnit") == 0)
 	{
 		char* id = NULL;
+		command_t* message = NULL;
+		int len;
+
 		syslog (LOG_DEBUG, "processing %s call", method_name);
 		g_variant_get (parameters, "(&s)", &id);
 
-		unregister_unit (id);
+		// address book belongs to broker thread, so request goes through bus as well
+		len = strlen (id) + 1;
+		if (!(message = (command_t*) bifrost_create_message (MESSAGE_COMMAND, len)))
+		{
+			g_dbus_method_invocation_return_error (invocation,
+						      G_DBUS_ERROR,
+						      G_DBUS_ERROR_NO_MEMORY,
+						      "Failed to allocate requested resources!");
+			return;
+		}
+		message->command_type = BIFROST_UNREGISTER_UNIT;
+		memcpy (message->args, id, len);
+		bifrost_push_message ((message_t*) message);
+
 		g_dbus_method_invocation_return_value (invocation, NULL);
+		return;
+	} else if (g_strcmp0 (method_name, "DumpTrace") == 0)
+	{
+		unsigned int max_events = 0;
+		char* trace;
+
+		// recorder is read in place, broker is not involved
+		g_variant_get (parameters, "(u)", &max_events);
+		if (!(trace = trace_dump_json (max_events)))
+		{
+			g_dbus_method_invocation_return_error (invocation,
+						      G_DBUS_ERROR,
+						      G_DBUS_ERROR_NO_MEMORY,
+						      "Failed to dump trace!");
+			return;
+		}
+
+		g_dbus_method_invocation_return_value (invocation, g_variant_new ("(s)", trace));
+		free (trace);
+		return;
 	}
 	syslog (LOG_WARNING, "Unhandled method call: %s", method_name);
 }
 
+static void add_latency (const broker_latency_t* latency, void* user_data)
+{
+	g_variant_builder_add ((GVariantBuilder*) user_data, "(sstttt)", latency->unit, latency->stage,
+			       (guint64) latency->count, (guint64) latency->p50_ns,
+			       (guint64) latency->p99_ns, (guint64) latency->p999_ns);
+}
+
 static GVariant* server_message_get (GDBusConnection  *connection,
                      const gchar      *sender,
                      const gchar      *object_path,
@@ -353,6 +572,16 @@ static GVariant* server_message_get (GDBusConnection  *connection,
 	} else if (g_strcmp0 (property_name, "QueuePath") == 0)
 	{
 		ret = g_variant_new_string (bifrost_settings.queue_path);
+	} else if (g_strcmp0 (property_name, "BatchSize") == 0)
+	{
+		ret = g_variant_new_uint32 (broker_get_batch_size ());
+	} else if (g_strcmp0 (property_name, "Latency") == 0)
+	{
+		GVariantBuilder builder;
+
+		g_variant_builder_init (&builder, G_VARIANT_TYPE ("a(sstttt)"));
+		broker_get_latency (add_latency, &builder);
+		ret = g_variant_builder_end (&builder);
 	}
 
 	return ret;
@@ -29,12 +29,28 @@ void bifrost_dbus_stop_server ();
 
 typedef enum signal_type_t {
 	BIFROST_SIGNAL_SHUTDOWN = 0,
-	BIFROST_SIGNAL_CHANNEL_REGISTERED
+	BIFROST_SIGNAL_CHANNEL_REGISTERED,
+	BIFROST_SIGNAL_CHANNELS_REGISTERED
 } signal_type_t;
 
+// channels of a local unit as units see them
+typedef struct bifrost_channel_descriptor_t {
+	const char* name;
+	int id;			// -1 - unit wasn't registered (it is online already or request is invalid)
+	const char* shm_name;	// channel unit reads from, NULL if there is none
+	const char* tx_name;	// ring unit sends through, NULL if there is none
+} bifrost_channel_descriptor_t;
+
 /* signal arguments:
 		BIFROST_SIGNAL_SHUTDOWN: (none)
-		BIFROST_SIGNAL_CHANNEL_REGISTERED: name, queue id, shm path, sem path
+		BIFROST_SIGNAL_CHANNEL_REGISTERED: name, queue id, shm path, tx ring path (paths may be NULL)
+		BIFROST_SIGNAL_CHANNELS_REGISTERED: const bifrost_channel_descriptor_t*, unsigned int count
+	may be called from any thread; does nothing until daemon owns its bus name
 */
 void bifrost_dbus_emit_signal (signal_type_t signal_type, ...);
 
+/* answer RegisterUnits call - reply is taken from bifrost_register_units_command_t
+	channels NULL - request was malformed, caller gets an error. Every reply must be answered once
+*/
+void bifrost_dbus_return_channels (void* reply, const bifrost_channel_descriptor_t* channels, unsigned int count);
+
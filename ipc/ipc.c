@@ -1,6 +1,6 @@
 #include "ipc.h"
 #include "../settings.h"
-#include "../units.h"
+#include "../latency.h"
 // message queue
 #include <syslog.h>
 #include <string.h>
@@ -9,56 +9,462 @@
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <sys/shm.h>
-#include <sys/sem.h>
 #include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <fcntl.h>
 
 
-#pragma message "Will need to update MAX_SEND_SIZE later"
-#pragma message "unimplemented shared memory"
+//---------------------------------------------------------------------------------------
+// futex primitives. Segment is shared between processes, so private futex ops can't be used
+
+static long futex (uint32_t* word, int op, uint32_t value, const struct timespec* timeout)
+{
+	return syscall (SYS_futex, word, op, value, timeout, NULL, 0);
+}
+
+static void futex_lock (uint32_t* word)
+{
+	uint32_t state = 0;
+
+	if (__atomic_compare_exchange_n (word, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		return;	// fast path
+
+	// contended: mark lock as having waiters and sleep until it is released
+	if (state != 2)
+		state = __atomic_exchange_n (word, 2, __ATOMIC_ACQUIRE);
+	while (state != 0)
+	{
+		futex (word, FUTEX_WAIT, 2, NULL);
+		state = __atomic_exchange_n (word, 2, __ATOMIC_ACQUIRE);
+	}
+}
+
+static int futex_trylock (uint32_t* word)
+{
+	uint32_t state = 0;
+	return __atomic_compare_exchange_n (word, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED) ? 0 : -1;
+}
+
+static void futex_unlock (uint32_t* word)
+{
+	if (__atomic_fetch_sub (word, 1, __ATOMIC_RELEASE) != 1)
+	{
+		// there are waiters
+		__atomic_store_n (word, 0, __ATOMIC_RELEASE);
+		futex (word, FUTEX_WAKE, 1, NULL);
+	}
+}
+
+/* doorbell - sequence word readers sleep on, and counter of sleeping readers, both in shared memory
+	writer side: tell readers new data is published
+*/
+static void doorbell_ring (uint32_t* doorbell, uint32_t* sleepers)
+{
+	// seq_cst pairs with sleepers increment in doorbell_wait: either writer sees a sleeper or sleeper sees new value
+	__atomic_fetch_add (doorbell, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n (sleepers, __ATOMIC_SEQ_CST))
+		futex (doorbell, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+/* reader side: sleep while doorbell equals seen value (timeout_ms < 0 - infinite)
+	returns current doorbell value, it is equal to seen on timeout
+*/
+static uint32_t doorbell_wait (uint32_t* doorbell, uint32_t* sleepers, uint32_t seen, int timeout_ms)
+{
+	struct timespec deadline;
+	uint32_t value = __atomic_load_n (doorbell, __ATOMIC_ACQUIRE);
+
+	if (value != seen || timeout_ms == 0)
+		return value;
+
+	// absolute deadline: wakeup may be meant for a previous ring, then we have to sleep again
+	clock_gettime (CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	__atomic_fetch_add (sleepers, 1, __ATOMIC_SEQ_CST);
+	while (value == seen)
+	{
+		// kernel re-checks doorbell, so a ring between load and sleep is not lost
+		if (syscall (SYS_futex, doorbell, FUTEX_WAIT_BITSET, seen, timeout_ms < 0 ? NULL : &deadline,
+			     NULL, FUTEX_BITSET_MATCH_ANY) == -1)
+		{
+			if (errno == ETIMEDOUT)
+				break;
+			if (errno != EAGAIN && errno != EINTR)
+			{
+				syslog (LOG_ERR, "%s: futex wait fault: %s", __func__, strerror(errno));
+				break;
+			}
+		}
+		value = __atomic_load_n (doorbell, __ATOMIC_ACQUIRE);
+	}
+	__atomic_fetch_sub (sleepers, 1, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n (doorbell, __ATOMIC_ACQUIRE);
+}
+
+//=======================================================================================
+// message queue
 
 int queue_id = -1;
 const char ftok_app_id = 'm';
+const char ftok_staging_id = 's';
+const char ftok_broadcast_id = 'b';
+const char ftok_inbox_id = 'i';
 
 #define MAX_SEND_SIZE 80
 
-struct {
+/* staging area - shared segment for payloads larger than MAX_SEND_SIZE.
+	Payload is copied into a free slot, only a descriptor of it goes through msgsnd;
+	receiver copies payload out of the slot and frees it. Slot generation is bumped on every release,
+	so a stale or duplicated descriptor is detected instead of reading somebody else's data.
+	Slot state keeps generation and claim time in one word, so a slot whose descriptor was never received
+	(receiver is gone, sender died before msgsnd) is taken back once it is older than queue_staging_timeout
+	and the area is full. Its late receiver sees another generation.
+	Segment is initialized by the process that created it; others take geometry from its header.
+	Daemon replaces segment of its crashed predecessor; generations start from a random base,
+	so descriptors of the old segment are stale in the new one.
+*/
+
+#define QUEUE_SIZE_STAGED	0x80000000u	// buffer.size flag: data holds queue_descriptor_t
+
+typedef struct staging_header_t {
+	uint32_t slot_count;
+	uint32_t slot_size;		// payload bytes per slot
+	uint32_t hint;			// where to start looking for a free slot
+} staging_header_t;
+
+typedef struct staging_slot_t {
+	uint64_t state;			// STAGING_STATE (generation, claim time), time 0 - free
+} __attribute__ ((aligned (64))) staging_slot_t;	// payload follows
+
+#define STAGING_STATE(generation, time)	(((uint64_t)(generation) << 32) | (uint32_t)(time))
+#define STAGING_GENERATION(state)	((uint32_t)((state) >> 32))
+#define STAGING_TIME(state)		((uint32_t)(state))
+
+typedef struct queue_descriptor_t {
+	uint32_t offset;		// slot offset inside of staging segment
+	uint32_t length;
+	uint32_t generation;
+} queue_descriptor_t;
+
+static int staging_id = -1;
+static int staging_owner = 0;
+static char* staging = NULL;
+
+#define STAGING_SLOT_STRIDE(hdr) (sizeof (staging_slot_t) + (((hdr)->slot_size + 63) & ~63u))
+#define STAGING_FIRST_SLOT (sizeof (staging_slot_t))	// header takes the first cache line
+
+/* message buffer is allocated on stack of every call, so queue functions may be called
+   from any number of threads at once
+*/
+typedef struct queue_buffer_t {
 	long type;
 	unsigned int size;
 	char data[MAX_SEND_SIZE];
-} buffer;
+} queue_buffer_t;
 
-int  queue_create()
+/* create shared segment next to queue or attach to existing one
+	replace - existing segment is left by a crashed daemon, it is removed (its users keep their mapping)
+	owner is set if segment was created by this call - then caller must initialize it
+*/
+static char* segment_attach (char ftok_id, size_t size, int replace, int* id, int* owner)
+{
+	key_t key = ftok (bifrost_settings.queue_path, ftok_id);
+	void* seg;
+
+	if (replace && (*id = shmget (key, 0, 0)) != -1)
+		shmctl (*id, IPC_RMID, 0);
+
+	*owner = 0;
+	if ((*id = shmget (key, size, IPC_CREAT | IPC_EXCL | 0660)) != -1)
+		*owner = 1;
+	else if (errno != EEXIST || (*id = shmget (key, 0, 0660)) == -1)
+	{
+		syslog (LOG_ERR, "%s: failed to create shared segment '%c': %s", __func__, ftok_id, strerror(errno));
+		return NULL;
+	}
+
+	if ((seg = shmat (*id, 0, 0)) == (void*)-1)
+	{
+		syslog (LOG_ERR, "%s: failed to attach shared segment '%c': %s", __func__, ftok_id, strerror(errno));
+		if (*owner)
+			shmctl (*id, IPC_RMID, 0);
+		*id = -1;
+		return NULL;
+	}
+
+	return seg;
+}
+
+static void segment_detach (char** seg, int* id, int* owner)
+{
+	if (!*seg)	// nothing to do
+		return;
+
+	shmdt (*seg);
+	if (*owner)
+		shmctl (*id, IPC_RMID, 0);
+	*seg = NULL;
+	*id = -1;
+	*owner = 0;
+}
+
+static int staging_create (int replace)
+{
+	staging_header_t* hdr;
+	unsigned int slot_count = bifrost_settings.queue_staging_slots;
+	unsigned int slot_size = bifrost_settings.queue_staging_slot_size;
+	struct timespec now;
+	uint32_t base;
+	unsigned int i;
+	size_t size;
+
+	if (slot_count == 0 || slot_size == 0)	// large messages are disabled
+		return 0;
+
+	size = STAGING_FIRST_SLOT + (size_t) slot_count * (sizeof (staging_slot_t) + ((slot_size + 63) & ~63u));
+	if (!(staging = segment_attach (ftok_staging_id, size, replace, &staging_id, &staging_owner)))
+		return -1;
+
+	hdr = (staging_header_t*) staging;
+	if (staging_owner)
+	{
+		memset (staging, 0, size);
+		hdr->slot_size = slot_size;
+
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		base = (uint32_t) now.tv_nsec ^ ((uint32_t) getpid () << 16);
+		for (i = 0; i < slot_count; i++)
+			((staging_slot_t*) (staging + STAGING_FIRST_SLOT + i * STAGING_SLOT_STRIDE(hdr)))->state = STAGING_STATE(base + i, 0);
+
+		__atomic_store_n (&hdr->slot_count, slot_count, __ATOMIC_RELEASE);
+	}
+
+	syslog (LOG_DEBUG, "staging area: %u slots of %u bytes", hdr->slot_count, hdr->slot_size);
+	return 0;
+}
+
+static staging_slot_t* staging_slot (uint32_t offset)
+{
+	return (staging_slot_t*) (staging + offset);
+}
+
+// claim time, seconds; never 0, which marks a free slot
+static uint32_t staging_time ()
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (uint32_t) now.tv_sec + 1;
+}
+
+/* claim free slot, or the oldest abandoned one if there are none
+	returns its offset or 0 if all slots are busy; *generation is set to the one of descriptor
+*/
+static uint32_t staging_acquire (uint32_t* generation)
+{
+	staging_header_t* hdr = (staging_header_t*) staging;
+	uint32_t count = __atomic_load_n (&hdr->slot_count, __ATOMIC_ACQUIRE);
+	uint32_t start = __atomic_fetch_add (&hdr->hint, 1, __ATOMIC_RELAXED);
+	uint32_t now = staging_time ();
+	uint32_t i, offset, stale = 0;
+	uint64_t state, oldest = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		offset = STAGING_FIRST_SLOT + ((start + i) % count) * STAGING_SLOT_STRIDE(hdr);
+		state = __atomic_load_n (&staging_slot (offset)->state, __ATOMIC_RELAXED);
+		if (STAGING_TIME(state) == 0)
+		{
+			if (__atomic_compare_exchange_n (&staging_slot (offset)->state, &state,
+							 STAGING_STATE(STAGING_GENERATION(state), now), 0,
+							 __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			{
+				*generation = STAGING_GENERATION(state);
+				return offset;
+			}
+		} else if (now - STAGING_TIME(state) > bifrost_settings.queue_staging_timeout
+			   && (!stale || STAGING_TIME(state) < STAGING_TIME(oldest)))
+		{
+			stale = offset;
+			oldest = state;
+		}
+	}
+
+	// new generation makes the abandoned descriptor stale, should it be received after all
+	if (stale && __atomic_compare_exchange_n (&staging_slot (stale)->state, &oldest,
+						  STAGING_STATE(STAGING_GENERATION(oldest) + 1, now), 0,
+						  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+		syslog (LOG_WARNING, "%s: slot abandoned for %u s is taken back", __func__, now - STAGING_TIME(oldest));
+		*generation = STAGING_GENERATION(oldest) + 1;
+		return stale;
+	}
+
+	return 0;
+}
+
+// free slot unless it was taken back meanwhile
+static void staging_release (uint32_t offset, uint32_t generation)
+{
+	staging_slot_t* slot = staging_slot (offset);
+	uint64_t state = __atomic_load_n (&slot->state, __ATOMIC_RELAXED);
+
+	while (STAGING_GENERATION(state) == generation && STAGING_TIME(state) != 0
+		&& !__atomic_compare_exchange_n (&slot->state, &state, STAGING_STATE(generation + 1, 0), 0,
+						 __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+//---------------------------------------------------------------------------------------
+/* broadcast ring - every broadcast is written once into shared ring of fixed-size slots,
+	each unit follows it with its own cursor (disruptor-like). Writers claim sequence numbers
+	with a single atomic and never wait for readers; a reader which was lapped detects it
+	by slot sequence and skips to the oldest message still available.
+	Slot sequence is 2 * (n + 1) when message n is published, odd while it is being written.
+*/
+
+typedef struct broadcast_header_t {
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint64_t head __attribute__ ((aligned (64)));	// next sequence number to claim
+	uint32_t doorbell __attribute__ ((aligned (64)));
+	uint32_t sleepers;
+} __attribute__ ((aligned (64))) broadcast_header_t;
+
+typedef struct broadcast_slot_t {
+	uint64_t sequence;
+	uint32_t size;
+	char data[0];
+} broadcast_slot_t;
+
+static int broadcast_id = -1;
+static int broadcast_owner = 0;
+static char* broadcast = NULL;
+
+#define BROADCAST_SLOT_STRIDE(hdr) ((sizeof (broadcast_slot_t) + (hdr)->slot_size + 63) & ~(size_t)63)
+
+static broadcast_slot_t* broadcast_slot (uint64_t sequence)
+{
+	broadcast_header_t* hdr = (broadcast_header_t*) broadcast;
+	return (broadcast_slot_t*) (broadcast + sizeof (broadcast_header_t)
+					+ (sequence % hdr->slot_count) * BROADCAST_SLOT_STRIDE(hdr));
+}
+
+static int broadcast_create (int replace)
+{
+	broadcast_header_t* hdr;
+	unsigned int slot_count = bifrost_settings.broadcast_slots;
+	unsigned int slot_size = bifrost_settings.broadcast_slot_size;
+	size_t size;
+
+	if (slot_count == 0 || slot_size == 0)	// broadcasts are disabled
+		return -1;
+
+	size = sizeof (broadcast_header_t) + slot_count * ((sizeof (broadcast_slot_t) + slot_size + 63) & ~(size_t)63);
+	if (!(broadcast = segment_attach (ftok_broadcast_id, size, replace, &broadcast_id, &broadcast_owner)))
+		return -1;
+
+	hdr = (broadcast_header_t*) broadcast;
+	if (broadcast_owner)
+	{
+		memset (broadcast, 0, size);
+		hdr->slot_size = slot_size;
+		__atomic_store_n (&hdr->slot_count, slot_count, __ATOMIC_RELEASE);
+	}
+
+	syslog (LOG_DEBUG, "broadcast ring: %u slots of %u bytes", hdr->slot_count, hdr->slot_size);
+	return 0;
+}
+
+//---------------------------------------------------------------------------------------
+
+static int queue_open (int replace)
 {
 	key_t key;
-	key = ftok (settings.queue_path, ftok_app_id);
+	key = ftok (bifrost_settings.queue_path, ftok_app_id);
 
 	if ((queue_id = msgget(key, IPC_CREAT | 0660)) == -1)
 	{
 		syslog (LOG_CRIT, "Failed to create IPC message queue!");
 		return -1;
 	}
+
+	if (staging_create (replace))
+		syslog (LOG_WARNING, "messages larger than %i bytes can't be sent", MAX_SEND_SIZE);
+
+	if (broadcast_create (replace))
+		syslog (LOG_WARNING, "broadcasts are unavailable");
+
 	return 0;
 }
 
+int  queue_create()
+{
+	return queue_open (0);
+}
+
+int  queue_create_owner ()
+{
+	return queue_open (1);
+}
+
 int queue_send_message(long type, char *text, unsigned int size)
 {
+	queue_buffer_t buffer;
+	staging_header_t* hdr = (staging_header_t*) staging;
+	queue_descriptor_t* desc = (queue_descriptor_t*) buffer.data;
+	uint32_t offset = 0;
+	uint32_t generation = 0;
+
 	if (queue_id < 0)
 		return -3;
 
-	if (size > MAX_SEND_SIZE)
+	if (size > MAX_SEND_SIZE && (!staging || size > hdr->slot_size))
 	{
-		syslog (LOG_ERR, "message size is too big: size=%i max=%i", size, MAX_SEND_SIZE);
+		syslog (LOG_ERR, "message size is too big: size=%i max=%i", size, staging ? hdr->slot_size : MAX_SEND_SIZE);
 		return -1;
 	}
 
-	syslog (LOG_DEBUG, "sending message to %i", type);
+	syslog (LOG_DEBUG, "sending message to %li", type);
 	buffer.type = type;
- 	buffer.size = size;
-	memcpy (buffer.data, text, size);
 
-	if ((msgsnd (queue_id, (struct msgbuf *)&buffer, size + sizeof (unsigned int), 0)) == -1)
+	if (size > MAX_SEND_SIZE)
+	{
+		// payload goes through staging area, queue carries descriptor only
+		if (!(offset = staging_acquire (&generation)))
+		{
+			syslog (LOG_ERR, "%s: staging area is full", __func__);
+			return -4;
+		}
+
+		memcpy ((char*)staging_slot (offset) + sizeof (staging_slot_t), text, size);
+		desc->offset = offset;
+		desc->length = size;
+		desc->generation = generation;
+		buffer.size = sizeof (queue_descriptor_t) | QUEUE_SIZE_STAGED;
+	} else
+	{
+		buffer.size = size;
+		memcpy (buffer.data, text, size);
+	}
+
+	if ((msgsnd (queue_id, (struct msgbuf *)&buffer, (buffer.size & ~QUEUE_SIZE_STAGED) + sizeof (unsigned int), 0)) == -1)
 	{
 		syslog (LOG_ERR, "message queue send msg returned: %s", strerror(errno));
+		if (offset)
+			staging_release (offset, generation);
 		return -2;
 	}
 	return 0;
@@ -66,6 +472,13 @@ int queue_send_message(long type, char *text, unsigned int size)
 
 int queue_receive_message(long type, char**text, unsigned int* buffersize)
 {
+	queue_buffer_t buffer;
+	queue_descriptor_t* desc = (queue_descriptor_t*) buffer.data;
+	staging_header_t* hdr = (staging_header_t*) staging;
+	const char* data = buffer.data;
+	unsigned int size;
+	uint64_t state = 0;
+
 	if (queue_id < 0)
 		return -2;
 
@@ -75,28 +488,176 @@ int queue_receive_message(long type, char**text, unsigned int* buffersize)
 		return -1;
 	}
 
-	syslog (LOG_DEBUG, "receiving message to %i", type);
+	syslog (LOG_DEBUG, "receiving message to %li", type);
 	buffer.type = type;
-	msgrcv (queue_id, (struct msgbuf *)&buffer, MAX_SEND_SIZE + sizeof (unsigned int), type, 0);
+	buffer.size = 0;
+	if (msgrcv (queue_id, (struct msgbuf *)&buffer, MAX_SEND_SIZE + sizeof (unsigned int), type, 0) == -1)
+	{
+		if (errno != EINTR)
+			syslog (LOG_ERR, "message queue receive msg returned: %s", strerror(errno));
+		return 0;
+	}
+
+	size = buffer.size;
+	if (size & QUEUE_SIZE_STAGED)
+	{
+		if (!staging || desc->offset < STAGING_FIRST_SLOT || desc->length > hdr->slot_size
+			|| (desc->offset - STAGING_FIRST_SLOT) % STAGING_SLOT_STRIDE(hdr) != 0
+			|| (desc->offset - STAGING_FIRST_SLOT) / STAGING_SLOT_STRIDE(hdr) >= hdr->slot_count
+			|| STAGING_GENERATION(state = __atomic_load_n (&staging_slot (desc->offset)->state, __ATOMIC_ACQUIRE)) != desc->generation
+			|| STAGING_TIME(state) == 0)
+		{
+			syslog (LOG_ERR, "%s: invalid or stale staging descriptor", __func__);
+			return -3;
+		}
+
+		size = desc->length;
+		data = (char*)staging_slot (desc->offset) + sizeof (staging_slot_t);
+	}
 
-	if (buffer.size == 0)	// there is no message
+	if (size == 0)	// there is no message
 	{
 		syslog (LOG_INFO, "received empty message");
 		return 0;
 	}
 
-	if (buffersize < buffer.size || !*text)
+	if (*buffersize < size || !*text)
 	{
 		// reallocate buffer
-		*text = (char*) realloc (*text, buffer.size);
-		buffersize = buffer.size;
+		*text = (char*) realloc (*text, size);
+		*buffersize = size;
+	}
+	memcpy (*text, data, size);
+
+	if (data != buffer.data)
+	{
+		// slot may have been taken back while it was copied (seqlock-like re-check)
+		__atomic_thread_fence (__ATOMIC_ACQUIRE);
+		if (__atomic_load_n (&staging_slot (desc->offset)->state, __ATOMIC_ACQUIRE) != state)
+		{
+			syslog (LOG_ERR, "%s: staging slot was taken back while being read", __func__);
+			return -3;
+		}
+		staging_release (desc->offset, desc->generation);
+	}
+
+	return size;
+}
+
+int queue_broadcast_message (char *text, unsigned int size)
+{
+	broadcast_header_t* hdr = (broadcast_header_t*) broadcast;
+	broadcast_slot_t* slot;
+	uint64_t sequence;
+
+	if (!broadcast)
+		return -3;
+
+	if (!text || size == 0 || size > hdr->slot_size)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments: size=%u max=%u", __func__, size, hdr->slot_size);
+		return -1;
+	}
+
+	sequence = __atomic_fetch_add (&hdr->head, 1, __ATOMIC_RELAXED);
+	slot = broadcast_slot (sequence);
+
+	// readers compare sequence before and after copying, so they notice if slot was rewritten meanwhile
+	__atomic_store_n (&slot->sequence, 2 * sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence (__ATOMIC_RELEASE);
+	slot->size = size;
+	memcpy (slot->data, text, size);
+	__atomic_store_n (&slot->sequence, 2 * (sequence + 1), __ATOMIC_RELEASE);
+
+	doorbell_ring (&hdr->doorbell, &hdr->sleepers);
+	return 0;
+}
+
+int broadcast_cursor_init (broadcast_cursor_t* cursor)
+{
+	broadcast_header_t* hdr = (broadcast_header_t*) broadcast;
+
+	if (!cursor || !broadcast)
+		return -1;
+
+	// new reader gets only broadcasts sent after it has joined
+	cursor->position = __atomic_load_n (&hdr->head, __ATOMIC_ACQUIRE);
+	cursor->lost = 0;
+	cursor->doorbell_seen = __atomic_load_n (&hdr->doorbell, __ATOMIC_ACQUIRE);
+	return 0;
+}
+
+int queue_receive_broadcast (broadcast_cursor_t* cursor, char** text, unsigned int* buffersize, int timeout_ms)
+{
+	broadcast_header_t* hdr = (broadcast_header_t*) broadcast;
+	broadcast_slot_t* slot;
+	uint64_t expected, sequence, head, oldest;
+	unsigned int size;
+
+	if (!broadcast)
+		return -2;
+
+	if (!cursor || !text || !buffersize)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	for (;;)
+	{
+		slot = broadcast_slot (cursor->position);
+		expected = 2 * (cursor->position + 1);
+		sequence = __atomic_load_n (&slot->sequence, __ATOMIC_ACQUIRE);
+
+		if (sequence < expected)
+		{
+			// not published yet
+			if (timeout_ms == 0)
+				return 0;
+			head = doorbell_wait (&hdr->doorbell, &hdr->sleepers, cursor->doorbell_seen, timeout_ms);
+			if (head == cursor->doorbell_seen)
+				return 0;	// timeout
+			cursor->doorbell_seen = head;
+			continue;
+		}
+
+		if (sequence == expected)
+		{
+			size = slot->size;
+			if (size > hdr->slot_size)
+				size = hdr->slot_size;	// torn read, will be detected below
+
+			if (*buffersize < size || !*text)
+			{
+				*text = (char*) realloc (*text, size);
+				*buffersize = size;
+			}
+			memcpy (*text, slot->data, size);
+
+			__atomic_thread_fence (__ATOMIC_ACQUIRE);
+			if (__atomic_load_n (&slot->sequence, __ATOMIC_RELAXED) == expected)
+			{
+				cursor->position++;
+				return size;
+			}
+		}
+
+		// lapped by writer: skip to the oldest message which is still in ring
+		head = __atomic_load_n (&hdr->head, __ATOMIC_ACQUIRE);
+		oldest = head > hdr->slot_count ? head - hdr->slot_count + 1 : 0;
+		if (oldest <= cursor->position)
+			oldest = cursor->position + 1;
+		cursor->lost += oldest - cursor->position;
+		cursor->position = oldest;
+		return -4;
 	}
-	memcpy (*text, buffer.data, buffer.size);
-	return buffer.size;
 }
 
 void queue_destroy()
 {
+	segment_detach (&staging, &staging_id, &staging_owner);
+	segment_detach (&broadcast, &broadcast_id, &broadcast_owner);
+
 	if (queue_id < 0)	// nothing to do
 		return;
 
@@ -104,104 +665,288 @@ void queue_destroy()
 	queue_id = -1;
 }
 
-struct callback_info_t {
-	char *text;
-	unsigned int size;
-};
+//=======================================================================================
+/* inbox - doorbell of daemon thread which collects data messages from unit tx rings.
+	Unlike channel doorbell it is shared by all units, so producers don't touch it unless
+	the reader sleeps: the reader announces itself in sleepers and re-checks rings before sleeping,
+	producers check sleepers after publishing. One of them always sees the other.
+*/
+
+typedef struct inbox_header_t {
+	uint32_t doorbell __attribute__ ((aligned (64)));
+	uint32_t sleepers;
+} __attribute__ ((aligned (64))) inbox_header_t;
 
-static void
-foreach_callback (GQuark key_id,
-		gpointer data,
-		gpointer user_data)
+static int inbox_id = -1;
+static int inbox_owner = 0;
+static inbox_header_t* inbox = NULL;
+
+int inbox_create ()
 {
-	const channel_info_t* ch = (const channel_info_t*) data;
-	unsigned int size = (unsigned int)user_data;
-	
-	if (ch->online == 0)
-		return;
+	key_t key = ftok (bifrost_settings.queue_path, ftok_inbox_id);
+	int id;
+	void* seg;
 
-	buffer.type = ch->queue_id;
-	if ((msgsnd (queue_id, (struct msgbuf *)&buffer, size, 0)) == -1)
+	if (inbox)	// already created
+		return 0;
+
+	if (key == -1)
 	{
-		syslog (LOG_ERR, "message queue send msg returned: %s", strerror(errno));
+		syslog (LOG_ERR, "%s: no key for inbox ('%s')", __func__, bifrost_settings.queue_path);
+		return -1;
+	}
+
+	// doorbell of a crashed daemon is dropped: units attached to it must attach again
+	if ((id = shmget (key, 0, 0)) != -1)
+		shmctl (id, IPC_RMID, 0);
+
+	if ((inbox_id = shmget (key, sizeof (inbox_header_t), IPC_CREAT | IPC_EXCL | 0660)) == -1
+		|| (seg = shmat (inbox_id, 0, 0)) == (void*)-1)
+	{
+		syslog (LOG_ERR, "%s: failed to create inbox: %s", __func__, strerror(errno));
+		if (inbox_id != -1)
+			shmctl (inbox_id, IPC_RMID, 0);
+		inbox_id = -1;
+		return -1;
 	}
+
+	inbox = (inbox_header_t*) seg;
+	inbox_owner = 1;
+	memset (inbox, 0, sizeof (inbox_header_t));
+	return 0;
 }
 
-void queue_broadcast_message (char *text, unsigned int size)
+int inbox_attach ()
 {
-	GData* units = NULL;
-	struct callback_info_t cbdata;
-	if (queue_id < 0)
-		return;
+	key_t key = ftok (bifrost_settings.queue_path, ftok_inbox_id);
+	int id;
+	void* seg;
+
+	if (inbox_owner)	// daemon has its own
+		return 0;
+
+	id = key == -1 ? -1 : shmget (key, 0, 0);
+	if (inbox && id == inbox_id)	// already attached
+		return 0;
 
-	if (size + sizeof(unsigned int) > MAX_SEND_SIZE)
+	if (id == -1)
+		return -2;
+
+	if ((seg = shmat (id, 0, 0)) == (void*)-1)
 	{
-		syslog (LOG_ERR, "queue_broadcast_message: message size is too big: size=%i max=%i", size, MAX_SEND_SIZE);
+		syslog (LOG_ERR, "%s: failed to attach inbox: %s", __func__, strerror(errno));
+		return -2;
+	}
+
+	/* restarted daemon has replaced the doorbell. The old one stays mapped: senders may hold it
+		right now and there is no cheap way to know when they are done, a page per restart is kept instead
+	*/
+	inbox_id = id;
+	__atomic_store_n (&inbox, (inbox_header_t*) seg, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void inbox_destroy ()
+{
+	inbox_header_t* seg;
+
+	if (!inbox)	// nothing to do
+		return;
+
+	seg = inbox;
+	__atomic_store_n (&inbox, NULL, __ATOMIC_RELEASE);
+	shmdt (seg);
+	if (inbox_owner)
+		shmctl (inbox_id, IPC_RMID, 0);
+	inbox_id = -1;
+	inbox_owner = 0;
+}
+
+void inbox_notify ()
+{
+	// unit may attach again while other threads send
+	inbox_header_t* doorbell = __atomic_load_n (&inbox, __ATOMIC_ACQUIRE);
+
+	if (!doorbell)
 		return;
+
+	// orders record publishing before sleepers check, pairs with inbox_prepare_sleep
+	__atomic_thread_fence (__ATOMIC_SEQ_CST);
+	if (__atomic_load_n (&doorbell->sleepers, __ATOMIC_RELAXED))
+	{
+		__atomic_fetch_add (&doorbell->doorbell, 1, __ATOMIC_RELEASE);
+		futex (&doorbell->doorbell, FUTEX_WAKE, INT_MAX, NULL);
 	}
+}
+
+unsigned int inbox_prepare_sleep ()
+{
+	unsigned int seen;
+
+	if (!inbox)
+		return 0;
+
+	seen = __atomic_load_n (&inbox->doorbell, __ATOMIC_ACQUIRE);
+	__atomic_fetch_add (&inbox->sleepers, 1, __ATOMIC_SEQ_CST);
+	return seen;
+}
 
-	units = get_units();
+int inbox_wait (unsigned int seen, int timeout_ms)
+{
+	struct timespec timeout;
+
+	if (!inbox)
+		return -2;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
 
-	syslog (LOG_DEBUG, "broadcasting messages...");
- 	*(unsigned int*)buffer.data = size;
-	memcpy (buffer.data + sizeof(unsigned int), text, size);
+	// kernel re-checks doorbell, so a ring after prepare is not lost; spurious wakeups are fine for caller
+	if (futex (&inbox->doorbell, FUTEX_WAIT, seen, timeout_ms < 0 ? NULL : &timeout) == -1 && errno == ETIMEDOUT)
+		return 0;
+
+	return 1;
+}
 
-	g_datalist_foreach (&units, foreach_callback, size + sizeof(unsigned int));
+void inbox_finish_sleep ()
+{
+	if (inbox)
+		__atomic_fetch_sub (&inbox->sleepers, 1, __ATOMIC_RELAXED);
 }
 
 //=======================================================================================
-/*	Channel is ipc composed from shared memory and semaphore, guarding it
+/*	Channel is ipc composed from shared memory segment with futex-based lock and doorbell inside of it.
+	Shared segment starts with a header describing its layout, data area follows it.
+	Uncontended lock/unlock and doorbell ring are plain atomics; futex syscalls are made only
+	when somebody really has to sleep or to be woken up.
+	CHANNEL_MODE_SLOT: data area holds one payload, its size is kept in header.
+	CHANNEL_MODE_RING: data area is a single-producer/single-consumer ring of variable-length records.
+		Record is [unsigned int size][reserved][uint64_t stamp][payload] aligned to CHANNEL_RECORD_ALIGN. If a record does not fit
+		into the rest of the ring, CHANNEL_RECORD_WRAP marker is written and the record starts from the beginning.
+		Cursors are free-running byte counters, each on its own cache line, so producer and consumer
+		never write the same line. Ring operations don't take the lock.
+		Stamp is latency_now () at commit; consumer puts the time record waited in ring
+		into wait histogram in header, so the producer process can see how long its readers lag.
+		Stamp is kept whole: readers which lag for seconds are exactly what the histogram is for.
 */
 
+#define CHANNEL_CACHE_LINE	64
+#define CHANNEL_RECORD_ALIGN	8
+#define CHANNEL_RECORD_WRAP	0xFFFFFFFFu
+#define CHANNEL_RECORD_STAMP	8		// offset of stamp in record, aligned for 64-bit access
+#define CHANNEL_RECORD_HEADER	(CHANNEL_RECORD_STAMP + sizeof (uint64_t))
+#define CHANNEL_RECORD_SIZE(size) \
+	(((size) + CHANNEL_RECORD_HEADER + CHANNEL_RECORD_ALIGN - 1) & ~(CHANNEL_RECORD_ALIGN - 1))
+
+typedef struct channel_header_t
+{
+	unsigned int mode;		// channel_mode_t
+	unsigned int capacity;		// data area size
+	unsigned int data_size;		// CHANNEL_MODE_SLOT: size of data written into segment
+	uint32_t lock;			// futex: 0 - unlocked, 1 - locked, 2 - locked and someone waits
+
+	// doorbell: incremented on each publish, readers sleep on it
+	uint32_t doorbell __attribute__ ((aligned (CHANNEL_CACHE_LINE)));
+	uint32_t sleepers;		// number of readers sleeping on doorbell
+
+	// CHANNEL_MODE_RING cursors
+	uint64_t head __attribute__ ((aligned (CHANNEL_CACHE_LINE)));	// written by producer only
+	uint64_t tail __attribute__ ((aligned (CHANNEL_CACHE_LINE)));	// written by consumer only
+
+	// CHANNEL_MODE_RING: commit to read time of records, written by consumer only
+	latency_histogram_t wait __attribute__ ((aligned (CHANNEL_CACHE_LINE)));
+} __attribute__ ((aligned (CHANNEL_CACHE_LINE))) channel_header_t;
+
 typedef struct channel_t
 {
 	int shm;	// shared memory descriptor
 	char* segment;  // shared memory segment pointer
-	int size;	// segment size (without reserved)
-	int sem;	// semaphore descriptor
-	int owner;	// semaphore ownership flag
+	int size;	// data area size (without header)
+	int owner;	// layout ownership flag
+	int mode;	// channel_mode_t
+	uint32_t doorbell_seen;	// last doorbell value seen by channel_wait
+
+	// zero-copy loans, local to process
+	unsigned int write_loan;	// size of space loaned to writer, 0 - no active loan
+	unsigned int read_loan;		// size of record loaned to reader
+	int read_loan_active;
+
+	channel_header_t* header;
+	char* data;	// data area pointer
+
+	// ring state, local to process
+	uint64_t head;		// producer: next write position
+	uint64_t tail;		// consumer: next read position
+	uint64_t cached_head;	// consumer: last seen producer cursor
+	uint64_t cached_tail;	// producer: last seen consumer cursor
+	int broken;		// consumer: producer has published an inconsistent record, nothing is read anymore
 } channel_t;
 
-channel_t* channel_open (char* shm_path, char* sem_path, int required_size, int owner)
+static unsigned int round_up_pow2 (unsigned int value)
+{
+	unsigned int result = CHANNEL_CACHE_LINE;
+
+	while (result < value)
+		result <<= 1;
+
+	return result;
+}
+
+//---------------------------------------------------------------------------------------
+
+channel_t* channel_open (char* shm_path, int required_size, int mode, int owner)
 {
 	channel_t* chan = NULL;
+	struct shmid_ds info;
 	key_t key;
 	void* seg = NULL;
+	int fd;
 
-	// in some linux systems this union is undefined due POSIX.1 requirements
-#ifdef _SEM_SEMUN_UNDEFINED
-	union semun {
-		int val;                /* value for SETVAL */
-		struct semid_ds *buf;   /* buffer for IPC_STAT & IPC_SET */
-		ushort *array;          /* array for GETALL & SETALL */
-		struct seminfo *__buf;  /* buffer for IPC_INFO */
-		void *__pad;
-        };		
-#endif
-
-	union semun semopts;
-
-	syslog (LOG_DEBUG, "creating a channel ('%s', '%s')...", shm_path, sem_path);
+	syslog (LOG_DEBUG, "creating a channel ('%s')...", shm_path);
 
 	if (shm_path == NULL || strlen(shm_path) == 0
-		 || sem_path == NULL || strlen(sem_path) == 0
-		 || required_size <= 0)
+		 || required_size < 0 || (required_size == 0 && owner)
+		 || (mode != CHANNEL_MODE_SLOT && mode != CHANNEL_MODE_RING))
 	{
 		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
 		return NULL;
 	}
 
+	// ring positions are masked, so its size must be a power of two
+	if (mode == CHANNEL_MODE_RING && required_size)
+		required_size = round_up_pow2 (required_size);
+
 	chan = (channel_t*) malloc (sizeof(channel_t));
+	memset (chan, 0, sizeof(channel_t));
 	chan->shm = -1;
 	chan->segment = NULL;
-	chan->sem = -1;
 	chan->owner = owner;
+	chan->mode = mode;
+
+	// key is taken from the path, so owner makes sure it exists
+	if (owner && (fd = open (shm_path, O_CREAT | O_RDONLY, 0644)) != -1)
+		close (fd);
+	if ((key = ftok(shm_path, ftok_app_id)) == -1)
+	{
+		syslog (LOG_ERR, "%s: no key for '%s': %s", __func__, shm_path, strerror(errno));
+		free (chan);
+		return NULL;
+	}
 
-	// create shared memory object
-	key = ftok(shm_path, ftok_app_id);
-	if ((chan->shm = shmget(key, required_size + sizeof(unsigned int), IPC_CREAT | 0660)) == -1)
+	/* create shared memory object; others only attach to it.
+		segment left by previous owner may be smaller than requested - it is replaced then
+	*/
+	if (owner)
 	{
-		syslog (LOG_ERR, "%s: failed to create shm object at '%s'!", __func__, shm_path);
+		chan->shm = shmget(key, required_size + sizeof(channel_header_t), IPC_CREAT | 0660);
+		if (chan->shm == -1 && errno == EINVAL && shmctl (shmget (key, 0, 0), IPC_RMID, 0) == 0)
+			chan->shm = shmget(key, required_size + sizeof(channel_header_t), IPC_CREAT | 0660);
+	} else
+		chan->shm = shmget(key, 0, 0);
+
+	if (chan->shm == -1)
+	{
+		syslog (LOG_ERR, "%s: failed to %s shm object at '%s'!", __func__, owner ? "create" : "open", shm_path);
 		free (chan);
 		return NULL;
 	}
@@ -210,30 +955,43 @@ channel_t* channel_open (char* shm_path, char* sem_path, int required_size, int
 	if ((seg = shmat(chan->shm, 0, 0)) == (void*)-1)
 	{
 		syslog (LOG_ERR, "%s: failed to attach shm object to process", __func__);
-		shmctl (chan->shm, IPC_RMID, 0);	// mark for deletion
+		if (owner)
+			shmctl (chan->shm, IPC_RMID, 0);	// mark for deletion
 		free (chan);
 		return NULL;
 	} else chan->segment = seg;
-	chan->size = required_size;
+	chan->header = (channel_header_t*) chan->segment;
+	chan->data = chan->segment + sizeof(channel_header_t);
 
-	// create shared semaphore
-	key = ftok(sem_path, ftok_app_id);
-	// semget allocates a set of semaphores.
-	// Unfortunately, there is no way to resize this set, so there will be many sets :(
-	if ((chan->sem = semget(key, 1, IPC_CREAT | 0660)) == -1)
+	if (owner)
 	{
-		syslog (LOG_ERR, "%s: failed to create semaphore at '%s'!", __func__, sem_path);
-		shmdt (chan->segment);
-		shmctl (chan->shm, IPC_RMID, 0);	// mark for deletion
-		free (chan);
+		memset (chan->header, 0, sizeof(channel_header_t));
+		chan->header->mode = mode;
+		chan->header->capacity = required_size;
+	} else
+	{
+		// required_size 0 - geometry is taken from the segment
+		if (!required_size)
+			required_size = chan->header->capacity;
+
+		if (chan->header->mode != (unsigned int)mode || chan->header->capacity != (unsigned int)required_size
+			|| shmctl (chan->shm, IPC_STAT, &info) == -1 || info.shm_segsz < required_size + sizeof(channel_header_t))
+		{
+			syslog (LOG_ERR, "%s: channel '%s' layout mismatch (mode %u, capacity %u)", __func__, shm_path,
+					 chan->header->mode, chan->header->capacity);
+			shmdt (chan->segment);
+			free (chan);
+			return NULL;
+		}
 	}
-	// sem initialization
-	semopts.val = 1; // initial value and maximum of resource
-	semctl (chan->sem, 0, SETVAL, semopts);
+	chan->size = required_size;
 
-	*(unsigned int*)(chan->segment) = 0;	// data size
+	// continue from the current cursors
+	chan->head = chan->cached_head = __atomic_load_n (&chan->header->head, __ATOMIC_ACQUIRE);
+	chan->tail = chan->cached_tail = __atomic_load_n (&chan->header->tail, __ATOMIC_ACQUIRE);
+	chan->doorbell_seen = __atomic_load_n (&chan->header->doorbell, __ATOMIC_ACQUIRE);
 
-	syslog (LOG_DEBUG, "channel ('%s', '%s') created", shm_path, sem_path);
+	syslog (LOG_DEBUG, "channel ('%s') created", shm_path);
 	return chan;
 }
 
@@ -242,18 +1000,138 @@ void channel_close 	(channel_t* chan)
 	if (!chan) return; // nothing to do
 
 	shmdt (chan->segment);	//detach shared segment
-	shmctl (chan->shm, IPC_RMID, 0);	// mark shared object for deletion
 	if (chan->owner)
-		semctl (chan->sem, IPC_RMID, 0); // remove sem from kernel - only owner must do that
+		shmctl (chan->shm, IPC_RMID, 0);	// mark shared object for deletion
 	free (chan);
 }
 
-// semaphore operations
-struct sembuf sem_lock={ 0, -1, 0 };
-struct sembuf sem_unlock={ 0, 1, IPC_NOWAIT };
+//---------------------------------------------------------------------------------------
+// ring operations
+
+unsigned int channel_get_max_record_size (channel_t* chan)
+{
+	if (!chan)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return 0;
+	}
+
+	// a record never takes more than a half of ring, so it always fits after a wrap
+	return chan->mode == CHANNEL_MODE_RING ? chan->size / 2 - CHANNEL_RECORD_HEADER : (unsigned int) chan->size;
+}
+
+/* producer: reserve space for a record
+	returns pointer to record payload or NULL if there is not enough free space
+*/
+static char* ring_reserve (channel_t* chan, unsigned int size)
+{
+	unsigned int record = CHANNEL_RECORD_SIZE(size);
+	unsigned int offset = chan->head & (chan->size - 1);
+	unsigned int contiguous = chan->size - offset;
+	unsigned int required = (record <= contiguous) ? record : contiguous + record;
+
+	if (chan->head + required - chan->cached_tail > (uint64_t) chan->size)
+	{
+		chan->cached_tail = __atomic_load_n (&chan->header->tail, __ATOMIC_ACQUIRE);
+		if (chan->head + required - chan->cached_tail > (uint64_t) chan->size)
+			return NULL;	// ring is full
+	}
+
+	if (record > contiguous)
+	{
+		*(unsigned int*)(chan->data + offset) = CHANNEL_RECORD_WRAP;
+		chan->head += contiguous;
+		offset = 0;
+	}
+
+	return chan->data + offset + CHANNEL_RECORD_HEADER;
+}
+
+// producer: publish record reserved by ring_reserve
+static void ring_commit (channel_t* chan, unsigned int size)
+{
+	char* record = chan->data + (chan->head & (chan->size - 1));
+
+	*(uint64_t*)(record + CHANNEL_RECORD_STAMP) = latency_now ();
+	*(unsigned int*)record = size;
+	chan->head += CHANNEL_RECORD_SIZE(size);
+	__atomic_store_n (&chan->header->head, chan->head, __ATOMIC_RELEASE);
+	doorbell_ring (&chan->header->doorbell, &chan->header->sleepers);
+}
+
+/* consumer: get next record without releasing it
+	now - latency_now () of the read, record wait is accounted by it
+	Producer may live in another process, so its cursor and record headers are checked
+	before anything is read: a broken ring is never read again (chan->broken).
+	returns pointer to record payload or NULL if ring is empty or broken
+*/
+static const char* ring_peek (channel_t* chan, unsigned int* size, unsigned long long now)
+{
+	unsigned int offset;
+	unsigned int record_size;
+	uint64_t stamp;
+
+	if (chan->broken)
+		return NULL;
+
+	for (;;)
+	{
+		if (chan->tail == chan->cached_head)
+		{
+			chan->cached_head = __atomic_load_n (&chan->header->head, __ATOMIC_ACQUIRE);
+			if (chan->tail == chan->cached_head)
+				return NULL;	// ring is empty
+			if (chan->cached_head - chan->tail > (uint64_t) chan->size)
+				goto broken;
+		}
+
+		offset = chan->tail & (chan->size - 1);
+		record_size = *(unsigned int*)(chan->data + offset);
+		if (record_size != CHANNEL_RECORD_WRAP)
+			break;
+
+		if (chan->size - offset > chan->cached_head - chan->tail)
+			goto broken;
+		chan->tail += chan->size - offset;	// skip unused end of ring
+	}
+
+	// record must lie within the ring and within what producer has published
+	if (record_size > channel_get_max_record_size (chan)
+		|| CHANNEL_RECORD_SIZE(record_size) > (unsigned int) chan->size - offset
+		|| CHANNEL_RECORD_SIZE(record_size) > chan->cached_head - chan->tail)
+		goto broken;
+
+	// producer may run on a core which TSC is a bit ahead
+	stamp = *(uint64_t*)(chan->data + offset + CHANNEL_RECORD_STAMP);
+	latency_record (&chan->header->wait, now > stamp ? now - stamp : 0);
+
+	*size = record_size;
+	return chan->data + offset + CHANNEL_RECORD_HEADER;
+
+broken:
+	syslog (LOG_ERR, "%s: inconsistent record at %llu (head %llu), ring is not read anymore", __func__,
+		(unsigned long long) chan->tail, (unsigned long long) chan->cached_head);
+	chan->broken = 1;
+	return NULL;
+}
+
+// consumer: skip record returned by ring_peek. Space is given back to producer by ring_release
+static void ring_consume (channel_t* chan, unsigned int size)
+{
+	chan->tail += CHANNEL_RECORD_SIZE(size);
+}
+
+static void ring_release (channel_t* chan)
+{
+	__atomic_store_n (&chan->header->tail, chan->tail, __ATOMIC_RELEASE);
+}
+
+//---------------------------------------------------------------------------------------
 
 int channel_write	(channel_t* chan, const char* buffer, unsigned int size)
 {
+	char* record = NULL;
+
 	// checks
 	if (!chan || !buffer || size == 0)
 	{
@@ -261,72 +1139,252 @@ int channel_write	(channel_t* chan, const char* buffer, unsigned int size)
 		return -1;
 	}
 	
-	if (size > chan->size)
+	if (size > channel_get_max_record_size (chan))
 	{
 		syslog (LOG_ERR, "%s: attempted to write more than allocated!", __func__);
 		return -2;
 	}
 
-	// sem lock
-	if (semop(chan->sem, &sem_lock, 1) == -1)
+	if (chan->mode == CHANNEL_MODE_RING)
 	{
-		syslog (LOG_ERR, "%s: sem lock operation fault: %s", __func__, strerror(errno));
-		return -3;
+		// never waits for consumer
+		if (!(record = ring_reserve (chan, size)))
+			return -4;
+
+		memcpy (record, buffer, size);
+		ring_commit (chan, size);
+		return size;
 	}
 
 	// write into shm
-	memcpy (chan->segment + sizeof (unsigned int), buffer, size);
-	*(unsigned int*)(chan->segment) = size;
+	futex_lock (&chan->header->lock);
+	memcpy (chan->data, buffer, size);
+	chan->header->data_size = size;
+	futex_unlock (&chan->header->lock);
+
+	doorbell_ring (&chan->header->doorbell, &chan->header->sleepers);
+
+	return size;
+}
 
-	// sem unlock
-	if (semop(chan->sem, &sem_unlock, 1) == -1)
+int channel_try_write	(channel_t* chan, const char* buffer, unsigned int size)
+{
+	if (!chan || !buffer || size == 0)
 	{
-		syslog (LOG_ERR, "%s: sem unlock operation fault: %s", __func__, strerror(errno));
-		return -3;
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
 	}
 
+	if (size > channel_get_max_record_size (chan))
+		return -2;
+
+	// ring write never waits anyway
+	if (chan->mode == CHANNEL_MODE_RING)
+		return channel_write (chan, buffer, size);
+
+	if (futex_trylock (&chan->header->lock))
+		return -4;	// slot is being read or written right now
+
+	memcpy (chan->data, buffer, size);
+	chan->header->data_size = size;
+	futex_unlock (&chan->header->lock);
+
+	doorbell_ring (&chan->header->doorbell, &chan->header->sleepers);
+
 	return size;
 }
 
 int channel_read 	(channel_t* chan, char** buffer, unsigned int* size)
 {
 	unsigned int datasize = 0;
+	const char* record = NULL;
+
 	// checks
 	if (!chan || !buffer || !size)
 	{
 		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
 		return -1;
 	}
-	
-	datasize = *(unsigned int*) (chan->segment);
 
-	if (datasize == 0)
-		return 0;
-
-	if (datasize > *size || !*buffer)
+	if (chan->mode == CHANNEL_MODE_RING)
 	{
+		if (!(record = ring_peek (chan, &datasize, latency_now ())))
+			return chan->broken ? -3 : 0;
+
+		if (datasize > *size || !*buffer)
+		{
+			*buffer = (char*)realloc(*buffer, datasize);
+			*size = datasize;
+		}
+
+		memcpy (*buffer, record, datasize);
+		ring_consume (chan, datasize);
+		ring_release (chan);
+		return datasize;
+	}
+	
+	futex_lock (&chan->header->lock);
+	while ((datasize = chan->header->data_size) > *size || !*buffer)
+	{
+		if (datasize == 0)
+			break;
+
+		// don't keep writer waiting while buffer is reallocated
+		futex_unlock (&chan->header->lock);
 		*buffer = (char*)realloc(*buffer, datasize);
 		*size = datasize;
+		futex_lock (&chan->header->lock);
 	}
 
-	// sem lock
-	if (semop(chan->sem, &sem_lock, 1) == -1)
+	// read from shm
+	if (datasize > 0)
+		memcpy (*buffer, chan->data, datasize);
+	futex_unlock (&chan->header->lock);
+
+	return datasize;
+}
+
+//---------------------------------------------------------------------------------------
+// zero-copy access
+
+char* channel_write_loan	(channel_t* chan, unsigned int size)
+{
+	char* ptr = NULL;
+
+	if (!chan || size == 0 || chan->write_loan)
 	{
-		syslog (LOG_ERR, "%s: sem lock operation fault: %s", __func__, strerror(errno));
-		return -3;
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return NULL;
 	}
 
-	// read from shm
-	memcpy (*buffer, chan->segment + sizeof (unsigned int), datasize);
+	if (size > channel_get_max_record_size (chan))
+	{
+		syslog (LOG_ERR, "%s: attempted to loan more than allocated!", __func__);
+		return NULL;
+	}
 
-	// sem unlock
-	if (semop(chan->sem, &sem_unlock, 1) == -1)
+	if (chan->mode == CHANNEL_MODE_RING)
 	{
-		syslog (LOG_ERR, "%s: sem unlock operation fault: %s", __func__, strerror(errno));
-		return -3;
+		if (!(ptr = ring_reserve (chan, size)))
+			return NULL;	// ring is full
+	} else
+	{
+		// slot stays locked until commit, so readers never see partially written data
+		futex_lock (&chan->header->lock);
+		ptr = chan->data;
 	}
 
-	return datasize;
+	chan->write_loan = size;
+	return ptr;
+}
+
+int channel_write_commit	(channel_t* chan, unsigned int size)
+{
+	if (!chan || !chan->write_loan || size > chan->write_loan)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	chan->write_loan = 0;
+
+	if (chan->mode == CHANNEL_MODE_RING)
+	{
+		if (size > 0)
+			ring_commit (chan, size);
+		return size;
+	}
+
+	// previous payload may be overwritten by the loan holder already - cancelled slot is empty
+	chan->header->data_size = size;
+	futex_unlock (&chan->header->lock);
+
+	if (size > 0)
+		doorbell_ring (&chan->header->doorbell, &chan->header->sleepers);
+
+	return size;
+}
+
+const char* channel_read_loan	(channel_t* chan, unsigned int* size)
+{
+	const char* ptr = NULL;
+
+	if (!chan || !size || chan->read_loan_active)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return NULL;
+	}
+
+	if (chan->mode == CHANNEL_MODE_RING)
+	{
+		if (!(ptr = ring_peek (chan, size, latency_now ())))
+			return NULL;	// ring is empty
+	} else
+	{
+		// writers wait until view is released
+		futex_lock (&chan->header->lock);
+		if ((*size = chan->header->data_size) == 0)
+		{
+			futex_unlock (&chan->header->lock);
+			return NULL;
+		}
+		ptr = chan->data;
+	}
+
+	chan->read_loan = *size;
+	chan->read_loan_active = 1;
+	return ptr;
+}
+
+int channel_read_release	(channel_t* chan)
+{
+	if (!chan || !chan->read_loan_active)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	chan->read_loan_active = 0;
+
+	if (chan->mode == CHANNEL_MODE_RING)
+	{
+		ring_consume (chan, chan->read_loan);
+		ring_release (chan);
+	} else
+		futex_unlock (&chan->header->lock);
+
+	return 0;
+}
+
+//---------------------------------------------------------------------------------------
+
+int channel_drain	(channel_t* chan, channel_record_handler_t handler, void* user_data, unsigned int max_count)
+{
+	const char* record = NULL;
+	unsigned int size = 0;
+	unsigned int count = 0;
+	unsigned long long now;
+
+	if (!chan || !handler || chan->mode != CHANNEL_MODE_RING)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	// whole batch is read at once - handler time is not a wait in ring
+	now = latency_now ();
+	while ((max_count == 0 || count < max_count) && (record = ring_peek (chan, &size, now)))
+	{
+		handler (record, size, user_data);
+		ring_consume (chan, size);
+		count++;
+	}
+
+	// all processed records are given back to producer at once
+	if (count > 0)
+		ring_release (chan);
+
+	return chan->broken ? -3 : (int) count;
 }
 
 // obtain/release lock
@@ -338,14 +1396,19 @@ int channel_lock	(struct channel_t* chan)
 		return -1;
 	}
 
-	// sem lock
-	if (semop(chan->sem, &sem_lock, 1) == -1)
+	futex_lock (&chan->header->lock);
+	return 0;
+}
+
+int channel_trylock	(struct channel_t* chan)
+{
+	if (!chan)
 	{
-		syslog (LOG_ERR, "%s: sem lock operation fault: %s", __func__, strerror(errno));
-		return -3;
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
 	}
 
-	return 0;
+	return futex_trylock (&chan->header->lock) ? -4 : 0;
 }
 
 int channel_unlock	(struct channel_t* chan)
@@ -356,14 +1419,26 @@ int channel_unlock	(struct channel_t* chan)
 		return -1;
 	}
 
-	// sem lock
-	if (semop(chan->sem, &sem_unlock, 1) == -1)
+	futex_unlock (&chan->header->lock);
+	return 0;
+}
+
+int channel_wait	(struct channel_t* chan, int timeout_ms)
+{
+	uint32_t doorbell;
+
+	if (!chan)
 	{
-		syslog (LOG_ERR, "%s: sem lock operation fault: %s", __func__, strerror(errno));
-		return -3;
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
 	}
 
-	return 0;
+	doorbell = doorbell_wait (&chan->header->doorbell, &chan->header->sleepers, chan->doorbell_seen, timeout_ms);
+	if (doorbell == chan->doorbell_seen)
+		return 0;	// timeout
+
+	chan->doorbell_seen = doorbell;
+	return 1;
 }
 
 // get pointer to data block
@@ -375,7 +1450,7 @@ char* channel_get_dataptr (struct channel_t* chan)
 		return NULL;
 	}
 
-	return chan->segment ? chan->segment + sizeof(unsigned int) : NULL;
+	return chan->data;
 }
 
 unsigned int channel_get_capacity (struct channel_t* chan)
@@ -395,12 +1470,31 @@ unsigned int channel_get_data_size (struct channel_t* chan)
 		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
 		return -1;
 	}
-	return *(unsigned int*)(chan->segment);
+
+	if (chan->mode == CHANNEL_MODE_RING)	// bytes not consumed yet
+		return __atomic_load_n (&chan->header->head, __ATOMIC_ACQUIRE)
+			- __atomic_load_n (&chan->header->tail, __ATOMIC_ACQUIRE);
+
+	return chan->header->data_size;
 }
 
-void  channel_set_data_size (struct channel_t* chan, unsigned int size)
+const struct latency_histogram_t* channel_get_wait_histogram (struct channel_t* chan)
 {
-	if (!chan) syslog (LOG_ERR, "%s: invalid arguments!", __func__);
-	else *(unsigned int*)(chan->segment) = size;
+	if (!chan)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return NULL;
+	}
+
+	return chan->mode == CHANNEL_MODE_RING ? &chan->header->wait : NULL;
 }
 
+void  channel_set_data_size (struct channel_t* chan, unsigned int size)
+{
+	if (!chan || chan->mode != CHANNEL_MODE_SLOT) syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+	else
+	{
+		chan->header->data_size = size;
+		doorbell_ring (&chan->header->doorbell, &chan->header->sleepers);
+	}
+}
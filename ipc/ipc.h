@@ -4,56 +4,172 @@
 // message queue
 
 /* creates queue
+	also creates (or attaches to) shared staging area for large messages,
+	its geometry is defined by the process which created it
    returns: 0 = all ok, -1 = failure
 */
 int  queue_create();
 
+// daemon: the same, but staging area and broadcast ring of a crashed daemon are replaced
+int  queue_create_owner ();
+
 /* sends message
 	input: id, buffer, data size
+	small messages are copied into queue; larger ones are placed into shared staging area
+	and only their descriptor (offset, length, generation) goes through queue
 	returns: 0 - all ok
-		 -1 - message is too large
+		 -1 - message is too large (larger than staging slot)
 		 -2 - send fail
 		 -3 - no queue
+		 -4 - staging area is full
 */
 int  queue_send_message(long type, char *text, unsigned int size);
 
 /* receive message
 	input: id, pointer to buffer, pointer to buffersize
 	if buffer is lesser that required, it will be reallocated! Caller is responsible for the memory
+	staged messages are copied directly from shared staging area, their slot is freed afterwards
 	returns: bytes read
 		-1 -- invalid arguments
 		-2 -- no queue
+		-3 -- invalid or stale staging descriptor (slot was abandoned for longer than queue_staging_timeout)
 */
 int  queue_receive_message(long type, char**text, unsigned int* buffersize);
 void queue_destroy();
 
-void queue_broadcast_message (char *text, unsigned int size);
+/* broadcast ring
+	broadcast is written once into shared ring next to queue, every unit follows it with its own cursor.
+	Writer never waits for readers: a reader which falls behind by more than ring size loses messages.
+*/
+typedef struct broadcast_cursor_t {
+	unsigned long long position;	// sequence number of next broadcast to read
+	unsigned long long lost;	// broadcasts overwritten before this reader got them
+	unsigned int doorbell_seen;
+} broadcast_cursor_t;
+
+/* write broadcast into ring
+	returns: 0 - all ok
+		-1 - invalid arguments or message is larger than ring slot
+		-3 - no broadcast ring
+*/
+int  queue_broadcast_message (char *text, unsigned int size);
+
+// start following broadcasts from the current moment
+int  broadcast_cursor_init (broadcast_cursor_t* cursor);
 
-// channel - shared memory + semaphore
+/* read next broadcast (timeout_ms: 0 - don't wait, < 0 - wait forever)
+	buffer is reallocated if needed, as in queue_receive_message
+	returns: bytes read, 0 on timeout
+		-1 -- invalid arguments
+		-2 -- no broadcast ring
+		-4 -- reader was lapped; cursor is moved to the oldest available broadcast, cursor->lost is updated
+*/
+int  queue_receive_broadcast (broadcast_cursor_t* cursor, char** text, unsigned int* buffersize, int timeout_ms);
+
+/* inbox - shared doorbell of daemon thread which moves data messages from unit tx rings into bus
+	Daemon creates it next to queue (stale one of a crashed daemon is replaced), units attach to it.
+	Producer publishes into its ring, then calls inbox_notify - a fence and a load unless daemon sleeps.
+	Reader: seen = inbox_prepare_sleep (), re-check rings, inbox_wait (seen, timeout) if they are empty,
+	inbox_finish_sleep () in any case. Unit attaches again after the daemon is restarted: stale doorbell stays mapped, senders may still hold it.
+   returns: 0 - all ok, -1 - failure, -2 - no inbox (daemon isn't running)
+*/
+int  inbox_create ();
+int  inbox_attach ();
+void inbox_destroy ();	// daemon removes inbox, units just detach
+void inbox_notify ();
+unsigned int inbox_prepare_sleep ();
+// returns 1 if woken up (may be spurious), 0 on timeout
+int  inbox_wait (unsigned int seen, int timeout_ms);
+void inbox_finish_sleep ();
+
+// channel - shared memory with futex lock and doorbell inside
 
 struct channel_t;
 
-/* create or open an existing channel. Requires two paths of shared objects (shm, sem) and size of shared block
-	owner flag determines who will release a sem object from kernel (it cannot be marked for deletion as shm for some reason)
-	allocated shared segment size will always be required_size + sizeof(unsigned int).
-	sizeof(unsigned int) is reserved for a size of data written into segment
+typedef enum channel_mode_t {
+	CHANNEL_MODE_SLOT = 0,	// single slot: each write replaces previous data
+	CHANNEL_MODE_RING	// single-producer/single-consumer ring of variable-length records
+} channel_mode_t;
+
+/* create or open an existing channel. Requires path of shared object and size of shared block
+	owner flag determines who initializes channel layout (and creates path, key is made from it);
+	others must open channel with the same size and mode, or with size 0 to take it from the channel.
+	Only owner removes shared segment on close.
+	allocated shared segment always starts with a layout header (cache line aligned), data area follows it.
+	CHANNEL_MODE_RING: required_size is ring capacity, it is rounded up to a power of two.
+		Single record can't be larger than channel_get_max_record_size.
 */
-struct channel_t* channel_open (char* shm_path, char* sem_path, int required_size, int owner);
+struct channel_t* channel_open (char* shm_path, int required_size, int mode, int owner);
 void channel_close 	(struct channel_t* channel);
 
-// simple I/O operations
+/* simple I/O operations
+	CHANNEL_MODE_SLOT: write replaces data in slot, read copies it
+	CHANNEL_MODE_RING: write appends a record without waiting for consumer (-4 if ring is full),
+		read takes the oldest record (0 if ring is empty, -3 if ring is broken - see channel_drain)
+*/
 int channel_read 	(struct channel_t* channel, char** buffer, unsigned int* size);
 int channel_write	(struct channel_t* channel, const char* buffer, unsigned int size);
+/* never blocks: CHANNEL_MODE_SLOT returns -4 instead of waiting for lock, -2 if data doesn't fit
+	(without logging - it is meant for hot paths)
+*/
+int channel_try_write	(struct channel_t* channel, const char* buffer, unsigned int size);
+
+/* CHANNEL_MODE_RING: batch read
+	handler is called in place for each available record (up to max_count, 0 - all of them),
+	then the whole batch is released to producer at once.
+	returns number of processed records, -1 on invalid arguments,
+		-3 if producer has published an inconsistent record (ring is not read anymore)
+*/
+typedef void (*channel_record_handler_t) (const char* data, unsigned int size, void* user_data);
+int channel_drain	(struct channel_t* channel, channel_record_handler_t handler, void* user_data, unsigned int max_count);
+
+/* zero-copy access
+	writer: channel_write_loan returns pointer to size bytes inside of shared segment, caller fills them
+		and publishes with channel_write_commit (size <= loaned size, 0 - cancel the loan).
+		CHANNEL_MODE_SLOT: channel is locked from loan to commit, so readers never see partial data.
+			Loan may already have overwritten the previous payload, so cancel empties the slot.
+		CHANNEL_MODE_RING: NULL if ring is full, nothing is visible to consumer until commit.
+	reader: channel_read_loan returns read-only view of slot data or of the oldest record (NULL if there is nothing),
+		it stays valid until channel_read_release.
+		CHANNEL_MODE_SLOT: channel is locked until release - writer will wait, so keep views short.
+		CHANNEL_MODE_RING: record is given back to producer on release.
+	Only one loan of each kind may be active per channel handle.
+*/
+char* channel_write_loan	(struct channel_t* channel, unsigned int size);
+int channel_write_commit	(struct channel_t* channel, unsigned int size);
+const char* channel_read_loan	(struct channel_t* channel, unsigned int* size);
+int channel_read_release	(struct channel_t* channel);
+
+// maximum payload size of single write
+unsigned int channel_get_max_record_size (struct channel_t* channel);
 
 // if someone will need to perform low-level ops...
 
-// obtain/release lock
+/* obtain/release lock
+	CHANNEL_MODE_SLOT only. Uncontended lock/unlock doesn't enter the kernel.
+	channel_trylock returns -4 if lock is taken by someone else
+*/
 int channel_lock	(struct channel_t* channel);
+int channel_trylock	(struct channel_t* channel);
 int channel_unlock	(struct channel_t* channel);
 
-// get pointer to data block
+/* reader: sleep until writer publishes new data (timeout_ms < 0 - infinite)
+	returns 1 if something was published since previous wakeup, 0 on timeout, negative on error.
+	Writer rings doorbell on every write/commit; it makes a syscall only if somebody sleeps.
+*/
+int channel_wait	(struct channel_t* channel, int timeout_ms);
+
+/* get pointer to data block
+	data size: CHANNEL_MODE_SLOT - size of data in slot, CHANNEL_MODE_RING - bytes not consumed yet.
+	channel_set_data_size is for CHANNEL_MODE_SLOT only, it rings doorbell
+*/
 char* channel_get_dataptr (struct channel_t* channel);
 unsigned int channel_get_capacity (struct channel_t* channel);
 unsigned int channel_get_data_size (struct channel_t* channel);
 void  channel_set_data_size (struct channel_t* channel, unsigned int size);
 
+/* CHANNEL_MODE_RING: histogram of time records waited in ring until consumer read them (see latency.h),
+	kept in shared header and filled by consumer. NULL for CHANNEL_MODE_SLOT
+*/
+struct latency_histogram_t;
+const struct latency_histogram_t* channel_get_wait_histogram (struct channel_t* channel);
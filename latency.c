@@ -0,0 +1,100 @@
+#include "latency.h"
+#include <string.h>
+
+/* ticks rate is measured once against CLOCK_MONOTONIC over LATENCY_CALIBRATION_NS,
+	which gives a few ppm precision; clock reading in the loop is the only cost
+*/
+#define LATENCY_CALIBRATION_NS	10000000ULL
+
+static double ticks_per_ns = 1.0;	// ticks are nanoseconds already unless TSC is used
+static int calibrated = 0;
+
+static unsigned long long monotonic_ns ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void latency_init ()
+{
+#if defined (__x86_64__) || defined (__i386__)
+	unsigned long long start_ns, start_ticks, ns, ticks;
+
+	if (calibrated)
+		return;
+
+	start_ns = monotonic_ns ();
+	start_ticks = latency_now ();
+	do {
+		ns = monotonic_ns ();
+		ticks = latency_now ();
+	} while (ns - start_ns < LATENCY_CALIBRATION_NS);
+
+	ticks_per_ns = (double)(ticks - start_ticks) / (ns - start_ns);
+#endif
+	calibrated = 1;
+}
+
+unsigned long long latency_to_ns (unsigned long long ticks)
+{
+	return ticks / ticks_per_ns;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+// highest value of bucket - percentiles are reported as upper bounds
+static unsigned long long bucket_to_ticks (unsigned int bucket)
+{
+	unsigned int exponent = (bucket >> LATENCY_SUB_BUCKETS_LOG) + LATENCY_SUB_BUCKETS_LOG - 1;
+	unsigned int mantissa = bucket & ((1 << LATENCY_SUB_BUCKETS_LOG) - 1);
+
+	if (bucket < (1 << LATENCY_SUB_BUCKETS_LOG))
+		return bucket;
+
+	return (((unsigned long long)((1 << LATENCY_SUB_BUCKETS_LOG) + mantissa + 1)) << (exponent - LATENCY_SUB_BUCKETS_LOG)) - 1;
+}
+
+void latency_merge (latency_histogram_t* dst, const latency_histogram_t* src)
+{
+	unsigned int idx;
+
+	for (idx = 0; idx < LATENCY_BUCKETS; idx++)
+		dst->counts[idx] += __atomic_load_n (&src->counts[idx], __ATOMIC_RELAXED);
+}
+
+unsigned long long latency_count (const latency_histogram_t* hist)
+{
+	unsigned long long total = 0;
+	unsigned int idx;
+
+	for (idx = 0; idx < LATENCY_BUCKETS; idx++)
+		total += __atomic_load_n (&hist->counts[idx], __ATOMIC_RELAXED);
+
+	return total;
+}
+
+unsigned long long latency_percentile_ns (const latency_histogram_t* hist, double percentile)
+{
+	latency_histogram_t snapshot;
+	unsigned long long total, rank, seen = 0;
+	unsigned int idx;
+
+	// writer keeps going meanwhile - count and walk must see the same numbers
+	memset (&snapshot, 0, sizeof (snapshot));
+	latency_merge (&snapshot, hist);
+
+	if (!(total = latency_count (&snapshot)))
+		return 0;
+
+	rank = (unsigned long long)(total * percentile / 100.0);
+	for (idx = 0; idx < LATENCY_BUCKETS; idx++)
+	{
+		seen += snapshot.counts[idx];
+		if (seen > rank)
+			break;
+	}
+
+	return latency_to_ns (bucket_to_ticks (idx < LATENCY_BUCKETS ? idx : LATENCY_BUCKETS - 1));
+}
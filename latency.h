@@ -0,0 +1,71 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <time.h>
+
+/* Message latency tracking.
+	Timestamps are raw ticks: TSC on x86 (a few ns to read, no vDSO call), CLOCK_MONOTONIC nanoseconds
+	elsewhere. Ticks are comparable between processes of one host, so a stamp taken by daemon may be
+	checked by unit. They are converted to nanoseconds only when histograms are reported.
+	Histogram is log-linear (HDR-like): LATENCY_SUB_BUCKETS per power of two, about 12% resolution,
+	values up to 2^LATENCY_MAX_LOG ticks; recording is one bit scan and one increment.
+	Histogram has a single writer; readers may take a snapshot at any time (counters are loaded relaxed).
+*/
+
+#define LATENCY_SUB_BUCKETS_LOG	3
+#define LATENCY_MAX_LOG		40	// larger values go to the last bucket
+#define LATENCY_BUCKETS		((LATENCY_MAX_LOG - LATENCY_SUB_BUCKETS_LOG + 1) << LATENCY_SUB_BUCKETS_LOG)
+
+typedef struct latency_histogram_t {
+	unsigned long long counts[LATENCY_BUCKETS];
+} latency_histogram_t;
+
+static inline unsigned long long latency_now ()
+{
+#if defined (__x86_64__) || defined (__i386__)
+	return __builtin_ia32_rdtsc ();
+#else
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static inline unsigned int latency_bucket (unsigned long long ticks)
+{
+	unsigned int exponent;
+
+	if (ticks < (1ULL << LATENCY_SUB_BUCKETS_LOG))
+		return ticks;
+
+	exponent = 63 - __builtin_clzll (ticks);
+	if (exponent >= LATENCY_MAX_LOG)
+		return LATENCY_BUCKETS - 1;
+
+	return ((exponent - LATENCY_SUB_BUCKETS_LOG + 1) << LATENCY_SUB_BUCKETS_LOG)
+		+ ((ticks >> (exponent - LATENCY_SUB_BUCKETS_LOG)) & ((1 << LATENCY_SUB_BUCKETS_LOG) - 1));
+}
+
+// single writer: plain increment, relaxed only to keep concurrent snapshots well-defined
+static inline void latency_record (latency_histogram_t* hist, unsigned long long ticks)
+{
+	unsigned long long* counter = &hist->counts[latency_bucket (ticks)];
+
+	__atomic_store_n (counter, __atomic_load_n (counter, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/* measure ticks rate (takes about 10 ms, done once per process).
+	Must be called before latency_to_ns; recording needs no initialization
+*/
+void latency_init ();
+// nanoseconds in given number of ticks
+unsigned long long latency_to_ns (unsigned long long ticks);
+
+// dst += snapshot of src
+void latency_merge (latency_histogram_t* dst, const latency_histogram_t* src);
+unsigned long long latency_count (const latency_histogram_t* hist);
+// percentile (0..100) in nanoseconds, 0 if histogram is empty
+unsigned long long latency_percentile_ns (const latency_histogram_t* hist, double percentile);
+
+#endif
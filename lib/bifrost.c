@@ -0,0 +1,330 @@
+#include "bifrost.h"
+#include "../ipc/ipc.h"
+#include "../ipc/dbus.h"
+#include "../settings.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <gio/gio.h>
+
+struct bifrost_unit_t {
+	char* name;
+	bifrost_address_t address;
+	struct channel_t* rx;		// daemon -> unit
+	struct channel_t* tx;		// unit -> daemon, records are bifrost_tx_header_t + payload
+	int read_loan;			// bifrost_read view is active
+	GDBusConnection* bus;		// set if unit was registered by bifrost_unit_open
+};
+
+static pthread_once_t library_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void library_init ()
+{
+	const char* queue_path = getenv ("BIFROST_QUEUE_PATH");
+
+	settings_init ();
+	if (queue_path && *queue_path)
+		bifrost_settings.queue_path = (char*) queue_path;
+
+	// daemon may come up later - its inbox polls tx rings then
+	pthread_mutex_lock (&inbox_lock);
+	if (inbox_attach ())
+		syslog (LOG_WARNING, "bifrost: no inbox at '%s', messages will be picked up with a delay", bifrost_settings.queue_path);
+	pthread_mutex_unlock (&inbox_lock);
+}
+
+//=================================================================================================
+
+bifrost_unit_t* bifrost_unit_attach (const char* name, int id, const char* rx_path, const char* tx_path)
+{
+	bifrost_unit_t* unit;
+
+	if (!name)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return NULL;
+	}
+
+	pthread_once (&library_once, library_init);
+
+	unit = g_new0 (bifrost_unit_t, 1);
+	unit->name = g_strdup (name);
+	unit->address.ip = 0;
+	unit->address.id = id;
+
+	// geometry is defined by daemon, it is taken from channels themselves
+	if ((rx_path && *rx_path && !(unit->rx = channel_open ((char*) rx_path, 0, CHANNEL_MODE_RING, 0)))
+		|| (tx_path && *tx_path && !(unit->tx = channel_open ((char*) tx_path, 0, CHANNEL_MODE_RING, 0))))
+	{
+		syslog (LOG_ERR, "%s: failed to open channels of unit [%s]", __func__, name);
+		bifrost_unit_close (unit);
+		return NULL;
+	}
+
+	return unit;
+}
+
+/* one RegisterUnits call for all units: daemon answers with their channels when it has made them,
+	so nothing else is waited for
+*/
+int bifrost_units_open (const char* const* names, const unsigned int* rx_capacities, unsigned int count,
+			int timeout_ms, bifrost_unit_t** units)
+{
+	GDBusConnection* bus;
+	GVariantBuilder request;
+	GVariantIter* channels = NULL;
+	GVariant* reply;
+	GVariant* unregistered;
+	GError* error = NULL;
+	const char* name;
+	const char* rx_path;
+	const char* tx_path;
+	unsigned int idx;
+	int id, opened = 0;
+
+	if (!names || !rx_capacities || !units || !count)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	memset (units, 0, count * sizeof (bifrost_unit_t*));
+
+	if (!(bus = g_bus_get_sync (G_BUS_TYPE_SESSION, NULL, &error)))
+	{
+		syslog (LOG_ERR, "%s: no D-Bus session bus: %s", __func__, error->message);
+		g_error_free (error);
+		return -1;
+	}
+
+	g_variant_builder_init (&request, G_VARIANT_TYPE ("a(suu)"));
+	for (idx = 0; idx < count; idx++)
+		g_variant_builder_add (&request, "(suu)", names[idx] ? names[idx] : "", rx_capacities[idx], CHANNEL_MODE_RING);
+
+	reply = g_dbus_connection_call_sync (bus, DBUS_NAME, DBUS_OBJECT, DBUS_INTERFACE, "RegisterUnits",
+					     g_variant_new ("(a(suu))", &request), G_VARIANT_TYPE ("(a(siss))"),
+					     G_DBUS_CALL_FLAGS_NONE, timeout_ms, NULL, &error);
+	if (!reply)
+	{
+		syslog (LOG_ERR, "%s: registration of %u units failed: %s", __func__, count, error->message);
+		g_error_free (error);
+		g_object_unref (bus);
+		return -1;
+	}
+
+	// daemon which has answered may be a restarted one with a new inbox
+	pthread_once (&library_once, library_init);
+	pthread_mutex_lock (&inbox_lock);
+	inbox_attach ();
+	pthread_mutex_unlock (&inbox_lock);
+
+	// channels come in request order
+	g_variant_get (reply, "(a(siss))", &channels);
+	for (idx = 0; idx < count && g_variant_iter_next (channels, "(&si&s&s)", &name, &id, &rx_path, &tx_path); idx++)
+	{
+		if (id < 0)
+		{
+			syslog (LOG_WARNING, "%s: unit [%s] is online already", __func__, name);
+			continue;
+		}
+
+		if (!(units[idx] = bifrost_unit_attach (name, id, rx_path, tx_path)))
+		{
+			// name isn't left taken by a unit nobody has mapped
+			if ((unregistered = g_dbus_connection_call_sync (bus, DBUS_NAME, DBUS_OBJECT, DBUS_INTERFACE, "UnregisterUnit",
+									 g_variant_new ("(s)", name), NULL, G_DBUS_CALL_FLAGS_NONE,
+									 timeout_ms, NULL, NULL)))
+				g_variant_unref (unregistered);
+			continue;
+		}
+
+		units[idx]->bus = g_object_ref (bus);
+		opened++;
+	}
+	g_variant_iter_free (channels);
+	g_variant_unref (reply);
+	g_object_unref (bus);
+
+	return opened;
+}
+
+bifrost_unit_t* bifrost_unit_open (const char* name, unsigned int rx_capacity, int timeout_ms)
+{
+	bifrost_unit_t* unit = NULL;
+
+	if (!name || !*name)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return NULL;
+	}
+
+	bifrost_units_open (&name, &rx_capacity, 1, timeout_ms, &unit);
+	return unit;
+}
+
+void bifrost_unit_close (bifrost_unit_t* unit)
+{
+	GVariant* reply;
+
+	if (!unit)	// nothing to do
+		return;
+
+	if (unit->read_loan)
+		channel_read_release (unit->rx);
+
+	// daemon removes channels on unregistration, so they are detached first
+	channel_close (unit->rx);
+	channel_close (unit->tx);
+
+	if (unit->bus)
+	{
+		if ((reply = g_dbus_connection_call_sync (unit->bus, DBUS_NAME, DBUS_OBJECT, DBUS_INTERFACE, "UnregisterUnit",
+							  g_variant_new ("(s)", unit->name), NULL, G_DBUS_CALL_FLAGS_NONE,
+							  -1, NULL, NULL)))
+			g_variant_unref (reply);
+		g_object_unref (unit->bus);
+	}
+
+	g_free (unit->name);
+	g_free (unit);
+}
+
+bifrost_address_t bifrost_unit_address (const bifrost_unit_t* unit)
+{
+	bifrost_address_t none = { 0, 0 };
+
+	return unit ? unit->address : none;
+}
+
+//=================================================================================================
+// sending
+
+unsigned int bifrost_max_message_size (bifrost_unit_t* unit)
+{
+	if (!unit || !unit->tx)
+		return 0;
+
+	return channel_get_max_record_size (unit->tx) - sizeof (bifrost_tx_header_t);
+}
+
+void* bifrost_send_loan (bifrost_unit_t* unit, bifrost_address_t dest, unsigned int size, unsigned int priority)
+{
+	bifrost_tx_header_t* header;
+
+	// header is added to size, so a huge one must not wrap around into a small loan
+	if (!unit || !unit->tx || priority >= BIFROST_PRIORITY_COMMAND || size > bifrost_max_message_size (unit))
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return NULL;
+	}
+
+	if (!(header = (bifrost_tx_header_t*) channel_write_loan (unit->tx, sizeof (bifrost_tx_header_t) + size)))
+		return NULL;
+
+	header->dest_id = dest;
+	header->priority = priority;
+	header->reserved = 0;
+	return header + 1;
+}
+
+int bifrost_send_commit (bifrost_unit_t* unit, unsigned int size, int flags)
+{
+	if (!unit || !unit->tx || size > bifrost_max_message_size (unit))
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	// zero size cancels the loan, header alone is never published
+	if (channel_write_commit (unit->tx, size ? sizeof (bifrost_tx_header_t) + size : 0) < 0)
+		return -1;
+
+	if (size && !(flags & BIFROST_SEND_MORE))
+		inbox_notify ();
+	return 0;
+}
+
+int bifrost_send (bifrost_unit_t* unit, bifrost_address_t dest, const void* data, unsigned int size,
+		  unsigned int priority, int flags)
+{
+	void* buffer;
+
+	if (!unit || !data || !size || priority >= BIFROST_PRIORITY_COMMAND)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	if (!unit->tx)
+		return -2;
+
+	if (size > bifrost_max_message_size (unit))
+		return -1;
+
+	if (!(buffer = bifrost_send_loan (unit, dest, size, priority)))
+		return -4;
+
+	memcpy (buffer, data, size);
+	return bifrost_send_commit (unit, size, flags);
+}
+
+void bifrost_flush (bifrost_unit_t* unit)
+{
+	if (unit && unit->tx)
+		inbox_notify ();
+}
+
+//=================================================================================================
+// receiving
+
+int bifrost_receive (bifrost_unit_t* unit, bifrost_message_handler_t handler, void* user_data, unsigned int max_count)
+{
+	if (!unit || !handler)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	if (!unit->rx)
+		return -2;
+
+	if (unit->read_loan)
+	{
+		channel_read_release (unit->rx);
+		unit->read_loan = 0;
+	}
+
+	return channel_drain (unit->rx, (channel_record_handler_t) handler, user_data, max_count);
+}
+
+const char* bifrost_read (bifrost_unit_t* unit, unsigned int* size)
+{
+	const char* data;
+
+	if (!unit || !size || !unit->rx)
+		return NULL;
+
+	// previous view goes back to daemon
+	if (unit->read_loan)
+	{
+		channel_read_release (unit->rx);
+		unit->read_loan = 0;
+	}
+
+	if ((data = channel_read_loan (unit->rx, size)))
+		unit->read_loan = 1;
+	return data;
+}
+
+int bifrost_wait (bifrost_unit_t* unit, int timeout_ms)
+{
+	if (!unit)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	return unit->rx ? channel_wait (unit->rx, timeout_ms) : -2;
+}
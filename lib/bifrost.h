@@ -0,0 +1,96 @@
+#ifndef LIBBIFROST_H
+#define LIBBIFROST_H
+
+/* libbifrost - unit side of bifrost
+	D-Bus is used only to register unit; data goes through shared memory afterwards:
+	unit sends into its tx ring (daemon moves records into bus), receives from its rx ring in place.
+	Neither side makes a syscall per message: the daemon is woken up through the shared inbox doorbell only
+	when it sleeps, and the unit is woken up by the rx ring doorbell only when it waits in bifrost_wait.
+	Buffers are never allocated on the data path - records are written and read right inside of rings.
+
+	One thread may send and one thread may receive through a unit at the same time.
+	Queue path of daemon is taken from BIFROST_QUEUE_PATH environment variable (daemon default otherwise).
+*/
+
+#include "../message.h"
+
+// library is built with hidden visibility, only these functions are exported
+#define BIFROST_API	__attribute__ ((visibility ("default")))
+
+typedef struct bifrost_unit_t bifrost_unit_t;
+
+/* register unit on D-Bus session bus and map its channels
+	rx_capacity - ring capacity for incoming messages, bytes (0 - unit only sends)
+	timeout_ms - limit for registration, < 0 - D-Bus default
+	returns NULL on failure or timeout (name which is online already is never given out again)
+*/
+BIFROST_API bifrost_unit_t* bifrost_unit_open (const char* name, unsigned int rx_capacity, int timeout_ms);
+
+/* the same for many units at once - a single D-Bus round trip, e.g. for a process which hosts a fleet of them
+	units[idx] is NULL for units which weren't opened
+	returns number of opened units, -1 on failure
+*/
+BIFROST_API int bifrost_units_open (const char* const* names, const unsigned int* rx_capacities, unsigned int count,
+				    int timeout_ms, bifrost_unit_t** units);
+
+/* map channels of a unit registered by somebody else (e.g. from its ChannelsOpen announcement)
+	rx_path, tx_path - channel paths from daemon, NULL or empty if unit has no such channel
+	D-Bus isn't touched, unit isn't unregistered on close
+*/
+BIFROST_API bifrost_unit_t* bifrost_unit_attach (const char* name, int id, const char* rx_path, const char* tx_path);
+
+// unmap channels; unit opened by bifrost_unit_open is unregistered
+BIFROST_API void bifrost_unit_close (bifrost_unit_t* unit);
+
+BIFROST_API bifrost_address_t bifrost_unit_address (const bifrost_unit_t* unit);
+
+//-------------------------------------------------------------------------------------------------
+// sending
+
+/* flags: more messages follow - daemon isn't woken up for this one, bifrost_flush or
+	the next send without the flag do it. Daemon picks records up on its own a bit later anyway.
+*/
+#define BIFROST_SEND_MORE	0x1
+
+/* copy message into tx ring
+	priority - message_priority_t below BIFROST_PRIORITY_COMMAND
+	returns: 0 - all ok
+		-1 - invalid arguments (empty message) or message is larger than bifrost_max_message_size
+		-2 - unit can't send (daemon gave it no tx ring)
+		-4 - ring is full: daemon or bus is behind, try again later
+*/
+BIFROST_API int bifrost_send (bifrost_unit_t* unit, bifrost_address_t dest, const void* data, unsigned int size,
+			      unsigned int priority, int flags);
+
+/* zero-copy send: loan size bytes of ring, fill them, then commit (size <= loaned size, 0 - cancel)
+	returns NULL if ring is full or arguments are invalid (size > bifrost_max_message_size too); only one loan may be active
+*/
+BIFROST_API void* bifrost_send_loan (bifrost_unit_t* unit, bifrost_address_t dest, unsigned int size, unsigned int priority);
+BIFROST_API int bifrost_send_commit (bifrost_unit_t* unit, unsigned int size, int flags);
+
+// wake daemon up for messages sent with BIFROST_SEND_MORE
+BIFROST_API void bifrost_flush (bifrost_unit_t* unit);
+
+BIFROST_API unsigned int bifrost_max_message_size (bifrost_unit_t* unit);
+
+//-------------------------------------------------------------------------------------------------
+// receiving
+
+/* handler gets messages in place, they are given back to daemon after the batch
+	max_count - messages per call, 0 - all available
+	returns number of messages, -1 on invalid arguments, -2 if unit has no rx ring, -3 if rx ring is broken
+*/
+typedef void (*bifrost_message_handler_t) (const char* data, unsigned int size, void* user_data);
+BIFROST_API int bifrost_receive (bifrost_unit_t* unit, bifrost_message_handler_t handler, void* user_data, unsigned int max_count);
+
+/* view of the next message, valid until the next bifrost_read, bifrost_receive or close
+	returns NULL if there is nothing to read
+*/
+BIFROST_API const char* bifrost_read (bifrost_unit_t* unit, unsigned int* size);
+
+/* sleep until daemon delivers something (timeout_ms < 0 - infinite)
+	returns 1 if there may be new messages, 0 on timeout, negative on error
+*/
+BIFROST_API int bifrost_wait (bifrost_unit_t* unit, int timeout_ms);
+
+#endif
@@ -0,0 +1,232 @@
+#include "loop.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#define LOOP_MAX_EVENTS		32
+
+typedef struct loop_watch_t {
+	int fd;
+	int is_timer;
+	loop_callback_t callback;
+	void* user_data;
+	struct loop_watch_t* next;
+} loop_watch_t;
+
+static int epoll_fd = -1;
+
+// watches are few (bus, signals, timers, a socket per transport) - plain list is enough
+static loop_watch_t* watches = NULL;
+
+//=================================================================================================
+
+static loop_watch_t* find_watch (int fd)
+{
+	loop_watch_t* watch;
+
+	for (watch = watches; watch; watch = watch->next)
+		if (watch->fd == fd)
+			return watch;
+
+	return NULL;
+}
+
+static int add_watch (int fd, uint32_t events, int is_timer, loop_callback_t callback, void* user_data)
+{
+	struct epoll_event event = { 0 };
+	loop_watch_t* watch;
+
+	if (epoll_fd < 0 || fd < 0 || !callback)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	watch = malloc (sizeof (loop_watch_t));
+	if (!watch)
+	{
+		syslog (LOG_ERR, "%s: out of memory!", __func__);
+		return -2;
+	}
+
+	watch->fd = fd;
+	watch->is_timer = is_timer;
+	watch->callback = callback;
+	watch->user_data = user_data;
+
+	event.events = events;
+	event.data.ptr = watch;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event))
+	{
+		syslog (LOG_ERR, "%s: epoll_ctl failed for fd %d: %m", __func__, fd);
+		free (watch);
+		return -3;
+	}
+
+	watch->next = watches;
+	watches = watch;
+
+	return 0;
+}
+
+static void remove_watch (loop_watch_t* watch)
+{
+	loop_watch_t** link;
+
+	for (link = &watches; *link; link = &(*link)->next)
+	{
+		if (*link == watch)
+		{
+			*link = watch->next;
+			break;
+		}
+	}
+
+	epoll_ctl (epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+	if (watch->is_timer)
+		close (watch->fd);
+	free (watch);
+}
+
+// timer expiration counter must be read, otherwise timerfd stays readable
+static void timer_expired (loop_watch_t* watch, uint32_t events)
+{
+	uint64_t expirations;
+
+	if (read (watch->fd, &expirations, sizeof (expirations)) != sizeof (expirations))
+		return;
+
+	watch->callback (watch->fd, events, watch->user_data);
+}
+
+//=================================================================================================
+
+int loop_init ()
+{
+	epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+	{
+		syslog (LOG_CRIT, "%s: failed to create epoll instance: %m", __func__);
+		return -1;
+	}
+
+	return 0;
+}
+
+void loop_uninit ()
+{
+	while (watches)
+		remove_watch (watches);
+
+	if (epoll_fd >= 0)
+	{
+		close (epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+int loop_add_fd (int fd, uint32_t events, loop_callback_t callback, void* user_data)
+{
+	return add_watch (fd, events, 0, callback, user_data);
+}
+
+int loop_modify_fd (int fd, uint32_t events)
+{
+	struct epoll_event event = { 0 };
+	loop_watch_t* watch = find_watch (fd);
+
+	if (!watch)
+	{
+		syslog (LOG_ERR, "%s: fd %d is not watched", __func__, fd);
+		return -1;
+	}
+
+	event.events = events;
+	event.data.ptr = watch;
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_MOD, fd, &event))
+	{
+		syslog (LOG_ERR, "%s: epoll_ctl failed for fd %d: %m", __func__, fd);
+		return -2;
+	}
+
+	return 0;
+}
+
+void loop_remove_fd (int fd)
+{
+	loop_watch_t* watch = find_watch (fd);
+
+	if (watch)
+		remove_watch (watch);
+}
+
+int loop_add_timer (unsigned int interval_ms, loop_callback_t callback, void* user_data)
+{
+	struct itimerspec spec;
+	int fd;
+
+	if (interval_ms == 0)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return -1;
+	}
+
+	fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0)
+	{
+		syslog (LOG_ERR, "%s: failed to create timer: %m", __func__);
+		return -2;
+	}
+
+	spec.it_interval.tv_sec = interval_ms / 1000;
+	spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+	spec.it_value = spec.it_interval;
+
+	if (timerfd_settime (fd, 0, &spec, NULL) || add_watch (fd, EPOLLIN, 1, callback, user_data))
+	{
+		syslog (LOG_ERR, "%s: failed to start timer", __func__);
+		close (fd);
+		return -3;
+	}
+
+	return fd;
+}
+
+void loop_remove_timer (int timer_fd)
+{
+	loop_remove_fd (timer_fd);
+}
+
+int loop_run_once (int timeout_ms)
+{
+	struct epoll_event events[LOOP_MAX_EVENTS];
+	loop_watch_t* watch;
+	int count, i;
+
+	count = epoll_wait (epoll_fd, events, LOOP_MAX_EVENTS, timeout_ms);
+	if (count < 0)
+	{
+		if (errno == EINTR)
+			return 0;
+
+		syslog (LOG_ERR, "%s: epoll_wait failed: %m", __func__);
+		return -1;
+	}
+
+	/* callbacks must not remove watches other than their own:
+		events of a removed watch may still be pending in this batch
+	*/
+	for (i = 0; i < count; i++)
+	{
+		watch = (loop_watch_t*) events[i].data.ptr;
+
+		if (watch->is_timer)
+			timer_expired (watch, events[i].events);
+		else
+			watch->callback (watch->fd, events[i].events, watch->user_data);
+	}
+
+	return count;
+}
@@ -0,0 +1,35 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+
+/* Daemon event loop - epoll over any number of file descriptors.
+	Everything the broker thread waits for (bus wakeups, signals, timers, sockets) is a descriptor,
+	so a single epoll_wait is the only place the broker sleeps.
+	Not thread safe: all calls must be made from the loop thread.
+*/
+
+/* events is epoll mask of ready events (EPOLLIN, EPOLLHUP, ...) */
+typedef void (*loop_callback_t) (int fd, uint32_t events, void* user_data);
+
+int  loop_init ();
+void loop_uninit ();
+
+/* watch fd for events (EPOLLIN, EPOLLOUT, ...). fd is not owned by loop */
+int  loop_add_fd (int fd, uint32_t events, loop_callback_t callback, void* user_data);
+int  loop_modify_fd (int fd, uint32_t events);
+void loop_remove_fd (int fd);
+
+/* periodic timer (timerfd) - callback is called every interval_ms after expiration counter
+	is read. Returns timer fd, which is owned by loop: use loop_remove_timer to stop it
+*/
+int  loop_add_timer (unsigned int interval_ms, loop_callback_t callback, void* user_data);
+void loop_remove_timer (int timer_fd);
+
+/* wait for events at most timeout_ms (-1 - infinitely, 0 - don't sleep) and dispatch them.
+	Returns number of dispatched events, negative on error
+*/
+int  loop_run_once (int timeout_ms);
+
+#endif
@@ -1,39 +1,194 @@
 #include "message.h"
-#include "syslog.h"
+#include "pool.h"
+#include "broker.h"
+#include "loop.h"
+#include "settings.h"
+#include "stats.h"
+#include "trace.h"
+#include "ipc/ipc.h"
+#include "ipc/dbus.h"
+#include "net/net.h"
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+
+static int running = 1;
+
+//=================================================================================================
+// loop callbacks
+
+// producers kicked the bus - counter is only reset, messages are taken in main_loop
+static void on_bus_wakeup (int fd, uint32_t events, void* user_data)
+{
+	uint64_t value;
+
+	(void) events;
+	(void) user_data;
+
+	if (read (fd, &value, sizeof (value)) != sizeof (value))
+		syslog (LOG_WARNING, "%s: spurious bus wakeup", __func__);
+}
+
+static void on_signal (int fd, uint32_t events, void* user_data)
+{
+	struct signalfd_siginfo info;
+
+	(void) events;
+	(void) user_data;
+
+	if (read (fd, &info, sizeof (info)) != sizeof (info))
+		return;
+
+	syslog (LOG_INFO, "signal %u received, shutting down", info.ssi_signo);
+	running = 0;
+}
 
 //=================================================================================================
 
-/*
-void main_loop ()
+/* command line overrides settings, so several daemons may run side by side (e.g. on loopback) */
+static int parse_options (int argc, char** argv)
 {
-	receive_from_network ();
-	read_channels ();
-	process_bus_messages ();
+	int opt;
+
+	while ((opt = getopt (argc, argv, "q:c:a:l:p:L:z:h")) != -1)
+	{
+		switch (opt)
+		{
+		case 'q': bifrost_settings.queue_path = optarg; break;
+		case 'c': bifrost_settings.channel_prefix = optarg; break;
+		case 'a': bifrost_settings.net_listen_address = optarg; break;
+		case 'l': bifrost_settings.net_listen_port = atoi (optarg); break;
+		case 'p': bifrost_settings.net_peer_port = atoi (optarg); break;
+		case 'L': bifrost_settings.net_udp_loss_percent = atoi (optarg); break;
+		case 'z': bifrost_settings.net_compress_threshold = atoi (optarg); break;
+		default:
+			fprintf (stderr, "usage: %s [-q queue path] [-c channel prefix] [-a listen address] [-l listen port] [-p peer port] [-L udp loss percent] [-z compress threshold]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	return 0;
 }
+
+/* broker thread: bus messages are processed batch by batch, between batches other event sources
+	are polled without sleeping. Thread sleeps in epoll only when bus is empty - then the first
+	producer pushing a message writes to bus eventfd.
+	Channel doorbells are futexes and can't be polled here - they are waited by units themselves.
 */
+static void main_loop ()
+{
+	trace_thread_name ("main loop");
+
+	while (running)
+	{
+		process_bus_messages ();
+
+		if (loop_run_once (bifrost_bus_prepare_sleep () ? -1 : 0) < 0)
+			running = 0;
+
+		bifrost_bus_finish_sleep ();
+	}
+}
 
 int main (int argc, char**argv)
 {
-	message_t* msg;
+	sigset_t signals;
+	int bus_fd = -1;
+	int signal_fd = -1;
+	int rc = 1;
 
-	openlog("libdn-ipc", LOG_CONS|LOG_PERROR, LOG_USER);	
+	openlog("libdn-ipc", LOG_CONS|LOG_PERROR, LOG_USER);
 //	setlogmask (LOG_UPTO(LOG_DEBUG));
 
-	msg = bifrost_create_message (MESSAGE_COMMAND, 0);
-	bifrost_push_message (msg);
+	settings_init ();
+	if (parse_options (argc, argv))
+		goto exit_settings;
+	bifrost_bus_configure (bifrost_settings.bus_capacity, bifrost_settings.bus_high_watermark,
+			       bifrost_settings.bus_low_watermark, bifrost_settings.bus_producer_credits,
+			       bifrost_settings.bus_overload_policy);
 
-	msg = bifrost_create_message (MESSAGE_DATA, 10);
-	bifrost_push_message (msg);
+	// signals are delivered through signalfd, so they must be blocked before any thread is created
+	sigemptyset (&signals);
+	sigaddset (&signals, SIGINT);
+	sigaddset (&signals, SIGTERM);
+	sigprocmask (SIG_BLOCK, &signals, NULL);
 
-	syslog (LOG_INFO, "next error message is test, not an error");
-	msg = bifrost_create_message (MESSAGE_EVENT, 0);
+	if (loop_init ())
+		goto exit_settings;
 
-	bifrost_clear_bus ();
+	bus_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	signal_fd = signalfd (-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (bus_fd < 0 || signal_fd < 0)
+	{
+		syslog (LOG_CRIT, "failed to create event descriptors: %m");
+		goto exit_loop;
+	}
 
-/*
-	broker_uninit();
-*/
+	if (loop_add_fd (bus_fd, EPOLLIN, on_bus_wakeup, NULL) || loop_add_fd (signal_fd, EPOLLIN, on_signal, NULL))
+		goto exit_loop;
+	bifrost_bus_set_notify_fd (bus_fd);
+
+	if (queue_create_owner ())
+	{
+		syslog (LOG_CRIT, "failed to create message queue");
+		goto exit_loop;
+	}
+
+	// transports and broker count into it until they are gone
+	stats_create (bifrost_settings.queue_path);
+
+	if (tcp_transport_init ())
+	{
+		syslog (LOG_CRIT, "failed to start tcp transport");
+		goto exit_queue;
+	}
+
+	if (udp_transport_init ())
+	{
+		syslog (LOG_CRIT, "failed to start udp transport");
+		goto exit_tcp;
+	}
+
+	broker_init ();
+
+	if (bifrost_dbus_start_server ())
+	{
+		syslog (LOG_CRIT, "failed to start d-bus server");
+		goto exit_broker;
+	}
+
+	main_loop ();
+	rc = 0;
+
+	bifrost_dbus_stop_server ();
+
+exit_broker:
+	broker_uninit ();
+	udp_transport_uninit ();
+
+exit_tcp:
+	tcp_transport_uninit ();
+
+exit_queue:
+	stats_destroy ();
+	queue_destroy ();
+
+exit_loop:
+	bifrost_bus_set_notify_fd (-1);
+	loop_uninit ();
+	if (bus_fd >= 0) close (bus_fd);
+	if (signal_fd >= 0) close (signal_fd);
+
+exit_settings:
+	bifrost_clear_bus ();
+	pool_destroy ();
+	settings_free ();
 
 	closelog ();
-	return 0;
+	return rc;
 }
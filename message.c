@@ -1,85 +1,389 @@
 #include "message.h"
-#include <pthread.h>
+#include "mpsc.h"
+#include "pool.h"
+#include "latency.h"
+#include "trace.h"
 #include <syslog.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
-/* bus is a simple fifo */
+/* bus is a set of lock-free MPSC fifos (see mpsc.h), one lane per priority: producers never wait
+	for each other or for the broker, broker is the only consumer.
+	Lanes are drained by strict priority; a lower lane which was passed over BUS_STARVATION_LIMIT
+	batches in a row is served first in the next batch, so bulk data can't starve completely.
+*/
+#define BUS_STARVATION_LIMIT	8
 
-message_t* head = NULL;
-message_t* tail = NULL;
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static mpsc_queue_t bus[BIFROST_PRIORITY_LANES] = {
+	MPSC_QUEUE_INITIALIZER(bus[BIFROST_PRIORITY_BULK]),
+	MPSC_QUEUE_INITIALIZER(bus[BIFROST_PRIORITY_HIGH]),
+	MPSC_QUEUE_INITIALIZER(bus[BIFROST_PRIORITY_COMMAND])
+};
+static unsigned int lane_starvation[BIFROST_PRIORITY_LANES];	// consumer side only
+
+/* bus limits
+	data message takes capacity and credit of its source on push and gives them back when it is freed.
+	Counters are touched only when limits are configured.
+*/
+#define BUS_CREDIT_SLOTS	256	// sources are hashed into credit counters
+
+typedef struct bus_limits_t {
+	unsigned int capacity;		// 0 - unbounded
+	unsigned int high_watermark;
+	unsigned int low_watermark;
+	unsigned int producer_credits;	// 0 - unlimited
+	bus_overload_policy_t policy;
+} bus_limits_t;
+
+static bus_limits_t bus_limits = { 0, 0, 0, 0, BUS_OVERLOAD_BLOCK };
+
+static unsigned int bus_used __attribute__ ((aligned (64))) = 0;	// admitted data messages not freed yet
+static int bus_overloaded = 0;		// set above high watermark, cleared at low watermark
+static unsigned int bus_drop_debt = 0;	// BUS_OVERLOAD_DROP_OLDEST: messages broker has to drop
+static unsigned int producer_used[BUS_CREDIT_SLOTS];
+
+// blocked producers sleep on space_sequence, which is bumped when space is freed and somebody waits
+static unsigned int space_sequence __attribute__ ((aligned (64))) = 0;
+static unsigned int space_waiters = 0;
+
+static unsigned long rejected_count = 0;
+static unsigned long dropped_count = 0;
+
+/* consumer wakeup: producers write to notify_fd (eventfd) only when consumer has announced
+   it is going to sleep, so a busy bus costs one extra load per push
+*/
+static int notify_fd = -1;
+static int consumer_sleeping = 0;
 
 message_t* bifrost_create_message (message_type_t type, unsigned int datasize)
 {
 	message_t* msg = NULL;
-	int sz = 0;
+	unsigned int header_size = 0;
 
-	if (type == MESSAGE_DATA)		sz = sizeof (data_message_t) + datasize;
-	else if (type == MESSAGE_COMMAND)	sz = sizeof (command_t) + datasize;
+	if (type == MESSAGE_DATA)		header_size = sizeof (data_message_t);
+	else if (type == MESSAGE_COMMAND)	header_size = sizeof (command_t);
 	else {
 		syslog (LOG_ERR, "%s unimplemented message type requested", __func__);
 		return NULL;
 	}
 
-	msg = malloc (sz);
-	memset (msg, 0, sz);
+	if (!(msg = pool_alloc (header_size + datasize)))
+		return NULL;
+
+	// payload is filled by creator, so only header is cleared
+	memset (msg, 0, header_size);
 	
 	msg->message_type = type;
-	msg->message_size = sz;
-	if (type == MESSAGE_DATA || type == MESSAGE_COMMAND)
+	msg->message_size = header_size + datasize;
+	if (type == MESSAGE_DATA)
+	{
 		((data_message_t*)msg)->buffer_size = datasize;
+		((data_message_t*)msg)->created_at = latency_now ();
+	} else if (type == MESSAGE_COMMAND)
+		((command_t*)msg)->buffer_size = datasize;
 
 	return msg;
 }
 
-void bifrost_push_message (message_t* msg)
+static inline unsigned int credit_slot (const bifrost_address_t* src)
+{
+	return ((unsigned int)src->id ^ ((unsigned int)src->ip * 2654435761u)) % BUS_CREDIT_SLOTS;
+}
+
+// reserve capacity and credit for data message: 0 - admitted, -2 - bus overloaded, -3 - no credits
+static int bus_admit (data_message_t* msg)
+{
+	unsigned int slot = credit_slot (&msg->src_id);
+	unsigned int used;
+
+	if (bus_limits.producer_credits
+		&& __atomic_add_fetch (&producer_used[slot], 1, __ATOMIC_RELAXED) > bus_limits.producer_credits)
+	{
+		__atomic_sub_fetch (&producer_used[slot], 1, __ATOMIC_RELAXED);
+		return -3;
+	}
+
+	if (bus_limits.capacity)
+	{
+		used = __atomic_add_fetch (&bus_used, 1, __ATOMIC_SEQ_CST);
+
+		if (used > bus_limits.high_watermark && !__atomic_load_n (&bus_overloaded, __ATOMIC_RELAXED))
+		{
+			__atomic_store_n (&bus_overloaded, 1, __ATOMIC_SEQ_CST);
+			syslog (LOG_WARNING, "bus is overloaded: %u messages in flight", used);
+		}
+
+		if (used > bus_limits.capacity
+			|| (bus_limits.policy != BUS_OVERLOAD_DROP_OLDEST && __atomic_load_n (&bus_overloaded, __ATOMIC_SEQ_CST)))
+		{
+			__atomic_sub_fetch (&bus_used, 1, __ATOMIC_SEQ_CST);
+			if (bus_limits.producer_credits)
+				__atomic_sub_fetch (&producer_used[slot], 1, __ATOMIC_RELAXED);
+			return -2;
+		}
+
+		// message is in, the oldest one goes away instead
+		if (bus_limits.policy == BUS_OVERLOAD_DROP_OLDEST && used > bus_limits.high_watermark)
+			__atomic_add_fetch (&bus_drop_debt, 1, __ATOMIC_RELAXED);
+	}
+
+	msg->message_flags |= MESSAGE_FLAG_ADMITTED;
+	return 0;
+}
+
+static void bus_release (data_message_t* msg)
+{
+	unsigned int used;
+
+	if (bus_limits.producer_credits)
+		__atomic_sub_fetch (&producer_used[credit_slot (&msg->src_id)], 1, __ATOMIC_SEQ_CST);
+
+	if (bus_limits.capacity)
+	{
+		used = __atomic_sub_fetch (&bus_used, 1, __ATOMIC_SEQ_CST);
+		if (used <= bus_limits.low_watermark && __atomic_load_n (&bus_overloaded, __ATOMIC_RELAXED)
+			&& __atomic_exchange_n (&bus_overloaded, 0, __ATOMIC_SEQ_CST))
+			syslog (LOG_INFO, "bus overload is over");
+	}
+
+	// either blocked producer is seen here or it sees released space in its second attempt
+	if (__atomic_load_n (&space_waiters, __ATOMIC_SEQ_CST))
+	{
+		__atomic_add_fetch (&space_sequence, 1, __ATOMIC_SEQ_CST);
+		syscall (SYS_futex, &space_sequence, FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+	}
+}
+
+void bifrost_free_message (message_t* msg)
 {
 	if (!msg) return;	// nothing to do
 
-	pthread_mutex_lock (&mutex);	
-	if (head == NULL)
+	if (msg->message_flags & MESSAGE_FLAG_ADMITTED)
+		bus_release ((data_message_t*)msg);
+
+	pool_free (msg, msg->message_size);
+}
+
+void bifrost_bus_configure (unsigned int capacity, unsigned int high_watermark, unsigned int low_watermark,
+			    unsigned int producer_credits, bus_overload_policy_t policy)
+{
+	if (capacity && (high_watermark == 0 || high_watermark > capacity))
+		high_watermark = capacity;
+	if (low_watermark > high_watermark)
+		low_watermark = high_watermark;
+
+	bus_limits.capacity = capacity;
+	bus_limits.high_watermark = high_watermark;
+	bus_limits.low_watermark = low_watermark;
+	bus_limits.producer_credits = producer_credits;
+	bus_limits.policy = policy;
+}
+
+static inline unsigned int message_lane (message_t* msg)
+{
+	unsigned int priority;
+
+	if (msg->message_type != MESSAGE_DATA)
+		return BIFROST_PRIORITY_COMMAND;
+
+	// data may never overtake commands
+	priority = ((data_message_t*)msg)->priority;
+	return priority < BIFROST_PRIORITY_COMMAND ? priority : BIFROST_PRIORITY_HIGH;
+}
+
+static int push_message (message_t* msg, int may_block)
+{
+	unsigned int sequence;
+	int rc;
+
+	if (!msg) return -1;
+
+	if (msg->message_type == MESSAGE_DATA && (bus_limits.capacity || bus_limits.producer_credits))
 	{
-		head = msg;
-		tail = msg;
+		while ((rc = bus_admit ((data_message_t*)msg)))
+		{
+			if (!may_block || bus_limits.policy != BUS_OVERLOAD_BLOCK)
+			{
+				__atomic_add_fetch (&rejected_count, 1, __ATOMIC_RELAXED);
+				return rc;
+			}
+
+			// sequence is taken before the second attempt, so release between them makes futex return at once
+			sequence = __atomic_load_n (&space_sequence, __ATOMIC_SEQ_CST);
+			__atomic_add_fetch (&space_waiters, 1, __ATOMIC_SEQ_CST);
+			if (!(rc = bus_admit ((data_message_t*)msg)))
+			{
+				__atomic_sub_fetch (&space_waiters, 1, __ATOMIC_RELAXED);
+				break;
+			}
+			syscall (SYS_futex, &space_sequence, FUTEX_WAIT_PRIVATE, sequence, NULL, NULL, 0);
+			__atomic_sub_fetch (&space_waiters, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	// message may be gone right after push
+	if (msg->message_type == MESSAGE_DATA)
+	{
+		data_message_t* data = (data_message_t*)msg;
+
+		data->pushed_at = latency_now ();
+		trace_event (TRACE_PUSH, data->src_id.id, data->buffer_size, data->pushed_at, 0);
 	} else
+		trace_instant (TRACE_PUSH, ((command_t*)msg)->command_type, ((command_t*)msg)->buffer_size);
+
+	// push is sequentially consistent - pairs with consumer_sleeping handshake in bifrost_bus_prepare_sleep
+	mpsc_push (&bus[message_lane (msg)], msg);
+
+	if (__atomic_load_n (&consumer_sleeping, __ATOMIC_SEQ_CST)
+		&& __atomic_exchange_n (&consumer_sleeping, 0, __ATOMIC_SEQ_CST) && notify_fd >= 0)
 	{
-		tail->next = msg;
-		tail = msg;
+		uint64_t one = 1;
+		if (write (notify_fd, &one, sizeof (one)) != sizeof (one))
+			syslog (LOG_ERR, "%s: failed to wake up bus consumer", __func__);
+	}
+
+	return 0;
+}
+
+int bifrost_push_message (message_t* msg)
+{
+	return push_message (msg, 1);
+}
+
+int bifrost_try_push_message (message_t* msg)
+{
+	return push_message (msg, 0);
+}
+
+// BUS_OVERLOAD_DROP_OLDEST: drop as many of the oldest data messages as producers asked for
+static void bus_pay_drop_debt ()
+{
+	unsigned int debt = __atomic_exchange_n (&bus_drop_debt, 0, __ATOMIC_RELAXED);
+	message_t* msg;
+
+	// messages already handed over to routing workers can't be dropped - debt is forgiven then
+	while (debt && ((msg = mpsc_pop (&bus[BIFROST_PRIORITY_BULK])) || (msg = mpsc_pop (&bus[BIFROST_PRIORITY_HIGH]))))
+	{
+		bifrost_free_message (msg);
+		dropped_count++;
+		debt--;
 	}
-	pthread_mutex_unlock (&mutex);
 }
 
 message_t* bifrost_pop_message ()
 {
 	message_t* msg = NULL;
+	int lane;
 
-	pthread_mutex_lock (&mutex);	
-	if (head != NULL)
+	for (lane = BIFROST_PRIORITY_LANES - 1; lane >= 0 && !msg; lane--)
+		msg = mpsc_pop (&bus[lane]);
+
+	return msg;
+}
+
+message_t* bifrost_pop_messages (unsigned int max_count)
+{
+	unsigned int order[BIFROST_PRIORITY_LANES + 1];
+	unsigned int taken[BIFROST_PRIORITY_LANES] = { 0 };
+	unsigned int lanes = 0;
+	unsigned int count = 0;
+	unsigned int idx, lane, n;
+	message_t* first = NULL;
+	message_t* last = NULL;
+	message_t* chain;
+
+	if (__atomic_load_n (&bus_drop_debt, __ATOMIC_RELAXED))
+		bus_pay_drop_debt ();
+
+	// the most starved lane goes first, then all lanes from the top
+	for (lane = 0; lane < BIFROST_PRIORITY_LANES; lane++)
 	{
-		msg = head;
-		head = head->next;
-		if (head == NULL)
-			tail = NULL;
+		if (lane_starvation[lane] >= BUS_STARVATION_LIMIT && (!lanes || lane_starvation[lane] > lane_starvation[order[0]]))
+		{
+			order[0] = lane;
+			lanes = 1;
+		}
 	}
-	pthread_mutex_unlock (&mutex);
+	for (lane = BIFROST_PRIORITY_LANES; lane-- > 0; )
+		order[lanes++] = lane;
 
-	return msg;
+	for (idx = 0; idx < lanes && (max_count == 0 || count < max_count); idx++)
+	{
+		lane = order[idx];
+		if (!(chain = mpsc_pop_chain (&bus[lane], max_count ? max_count - count : 0)))
+			continue;
+
+		if (last)
+			last->next = chain;
+		else
+			first = chain;
+
+		for (n = 1, last = chain; last->next; last = last->next)
+			n++;
+		taken[lane] += n;
+		count += n;
+	}
+
+	// with limited batch lower lanes may be left behind
+	for (lane = 0; lane < BIFROST_PRIORITY_LANES; lane++)
+	{
+		if (taken[lane] || mpsc_is_empty (&bus[lane]))
+			lane_starvation[lane] = 0;
+		else
+			lane_starvation[lane]++;
+	}
+
+	return first;
 }
 
-void bifrost_clear_bus ()
+unsigned int bifrost_bus_depth ()
 {
-	message_t* msg;
+	return mpsc_size (&bus[BIFROST_PRIORITY_COMMAND]) + mpsc_size (&bus[BIFROST_PRIORITY_HIGH])
+		+ mpsc_size (&bus[BIFROST_PRIORITY_BULK]);
+}
+
+void bifrost_bus_overload_counts (unsigned long* rejected, unsigned long* dropped)
+{
+	*rejected = __atomic_load_n (&rejected_count, __ATOMIC_RELAXED);
+	*dropped = dropped_count;
+}
 
-	pthread_mutex_lock (&mutex);
+void bifrost_bus_set_notify_fd (int fd)
+{
+	notify_fd = fd;
+}
+
+int bifrost_bus_prepare_sleep ()
+{
+	__atomic_store_n (&consumer_sleeping, 1, __ATOMIC_SEQ_CST);
 
-	for (; head; head = msg) {
-		msg = head->next;
-		free (head);
+	// either we see the new head here, or producer sees consumer_sleeping and kicks notify_fd
+	if (!mpsc_is_empty (&bus[BIFROST_PRIORITY_COMMAND]) || !mpsc_is_empty (&bus[BIFROST_PRIORITY_HIGH])
+		|| !mpsc_is_empty (&bus[BIFROST_PRIORITY_BULK]))
+	{
+		__atomic_store_n (&consumer_sleeping, 0, __ATOMIC_RELAXED);
+		return 0;
 	}
 
-	tail = NULL;
+	return 1;
+}
 
-	pthread_mutex_unlock (&mutex);
+void bifrost_bus_finish_sleep ()
+{
+	__atomic_store_n (&consumer_sleeping, 0, __ATOMIC_RELAXED);
 }
 
+void bifrost_clear_bus ()
+{
+	message_t* msg;
+
+	while ((msg = bifrost_pop_message ()))
+		bifrost_free_message (msg);
+
+	if (rejected_count || dropped_count)
+		syslog (LOG_INFO, "bus overload: %lu messages rejected, %lu dropped", rejected_count, dropped_count);
+}
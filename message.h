@@ -1,3 +1,6 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
 /* Basic message declarations. Messages can be chained similar to lists in linux kernel.
 */
 
@@ -13,24 +16,90 @@ typedef enum {
 	MESSAGE_COMMAND		// command to bifrost
 } message_type_t;
 
+/* bus priority lanes, higher lane is drained first
+	commands always go to the top lane; data messages choose their lane by priority field
+*/
+typedef enum message_priority_t {
+	BIFROST_PRIORITY_BULK = 0,	// default for data
+	BIFROST_PRIORITY_HIGH,		// latency-critical data
+	BIFROST_PRIORITY_COMMAND	// control plane
+} message_priority_t;
+
+#define BIFROST_PRIORITY_LANES	3
+
+// message_flags
+#define MESSAGE_FLAG_ADMITTED	0x1	// data message holds bus capacity and producer credit until it's freed
+#define MESSAGE_FLAG_COMPRESSED	0x2	// payload is compressed for remote link (net/compress.c)
+
 // base message
 typedef struct message_t {
 	message_type_t message_type;
 	unsigned int message_size;
+	unsigned int message_flags;
 	struct message_t* next;
 } message_t;
 
+/* bus overload policies - what happens to a data message pushed above high watermark
+	or by a producer which is out of credits
+*/
+typedef enum bus_overload_policy_t {
+	BUS_OVERLOAD_BLOCK = 0,		// producer waits until bus drains to low watermark
+	BUS_OVERLOAD_REJECT,		// push fails until bus drains to low watermark
+	BUS_OVERLOAD_DROP_OLDEST	// push succeeds, broker drops the oldest data message instead
+} bus_overload_policy_t;
+
 
 /* create message of desired type
 	datasize is required size for a message buffer and for command arguments buffer.
 	Others just ignore it.
+	Message is taken from slab pool; only header is zeroed, buffer contents are undefined.
 */
 message_t* bifrost_create_message (message_type_t type, unsigned int datasize);
-/* push message to bus */
-void bifrost_push_message (message_t* msg);
-/* pop message from bus */
+/* return message to slab pool. Message must be already popped from bus.
+	Bus capacity and producer credit taken by the message are given back here, so messages
+	held by the broker after pop still count against limits.
+*/
+void bifrost_free_message (message_t* msg);
+/* bus limits, must be set before the first push
+	capacity - hard limit of data messages in flight (0 - unbounded); overload starts above high watermark
+	and ends at low watermark. producer_credits - data messages one source address may have in flight
+	(0 - unlimited). Commands are never limited.
+*/
+void bifrost_bus_configure (unsigned int capacity, unsigned int high_watermark, unsigned int low_watermark,
+			    unsigned int producer_credits, bus_overload_policy_t policy);
+/* push message to bus, may be called from any thread
+	lock-free unless policy is BUS_OVERLOAD_BLOCK and bus is overloaded - then producer sleeps.
+	returns 0 on success; -1 invalid message, -2 bus is overloaded, -3 producer is out of credits.
+	Message is not consumed on error.
+*/
+int bifrost_push_message (message_t* msg);
+/* the same, but never blocks: overload is reported as with BUS_OVERLOAD_REJECT */
+int bifrost_try_push_message (message_t* msg);
+/* pop message from the highest non-empty lane
+	bus has a single consumer (broker): pop must never be called from several threads at once.
+	NULL is returned if bus is empty or if the only pushed message is not linked by its producer yet.
+*/
 message_t* bifrost_pop_message ();
-/* clear bus */
+/* pop chain of up to max_count messages (0 - all available) from bus
+	messages are linked through next field, last one has next == NULL. Returns NULL if bus is empty.
+	Lanes follow in priority order; a lane skipped for too many batches in a row comes first.
+	Consumer side, same rules as for bifrost_pop_message.
+*/
+message_t* bifrost_pop_messages (unsigned int max_count);
+/* number of messages waiting on bus, consumer side. Pushes in progress may be counted already */
+unsigned int bifrost_bus_depth ();
+/* overload counters since start: data messages refused to producers and queued ones dropped, consumer side */
+void bifrost_bus_overload_counts (unsigned long* rejected, unsigned long* dropped);
+/* consumer wakeup
+	fd is an eventfd (or pipe) consumer sleeps on; producers write into it only after
+	bifrost_bus_prepare_sleep returned 1 and until the first push after that.
+	bifrost_bus_prepare_sleep returns 0 if bus is not empty - consumer must not sleep then.
+	bifrost_bus_finish_sleep must be called after consumer woke up by any reason.
+*/
+void bifrost_bus_set_notify_fd (int fd);
+int  bifrost_bus_prepare_sleep ();
+void bifrost_bus_finish_sleep ();
+/* clear bus - consumer side, same rules as for bifrost_pop_message */
 void bifrost_clear_bus ();
 
 //=================================================================================================
@@ -40,30 +109,47 @@ typedef struct data_message_t {
 	// common header
 	message_type_t message_type;
 	unsigned int message_size;
+	unsigned int message_flags;
 	message_t*	next;
 
-	bifrost_address_t src_id;
+	bifrost_address_t src_id;		// producer credits are accounted by source
 	bifrost_address_t dest_id;
+	unsigned int priority;		// message_priority_t, below BIFROST_PRIORITY_COMMAND
 	unsigned int buffer_size;
+	// latency.h ticks, stamped on the way through daemon; route and deliver are taken by broker
+	unsigned long long created_at;
+	unsigned long long pushed_at;
+	unsigned long long popped_at;
 	char 	buf[0];		// actually, this buffer will be buffer_size length
 } data_message_t;
 
+/* record of unit tx ring (unit -> daemon, see broker.c inbox): header, then payload
+	source is the unit owning the ring, daemon fills it in
+*/
+typedef struct bifrost_tx_header_t {
+	bifrost_address_t dest_id;
+	unsigned int priority;		// message_priority_t, below BIFROST_PRIORITY_COMMAND
+	unsigned int reserved;
+} bifrost_tx_header_t;
+
 //----------------------------------------------------------------------------------------------------
 
 // command message
 typedef enum command_type_t {
 	BIFROST_CONNECT = 1,
 	BIFROST_DISCONNECT,
-	BIFROST_SET_MESSAGE_BATCH_SIZE,
+	BIFROST_SET_MESSAGE_BATCH_SIZE,		// unsigned int: size, 0 - all, BIFROST_BATCH_SIZE_ADAPTIVE
 	BIFROST_REGISTER_UNIT,
 	BIFROST_REGISTER_REMOTE_UNIT,
-	BIFROST_UNREGISTER_UNIT
+	BIFROST_UNREGISTER_UNIT,
+	BIFROST_REGISTER_UNITS			// bifrost_register_units_command_t
 } command_type_t;
 
 typedef struct command_t {
 	// common header
 	message_type_t message_type;
 	unsigned int message_size;
+	unsigned int message_flags;
 	message_t*	next;
 
 	command_type_t command_type;
@@ -76,13 +162,34 @@ typedef struct command_t {
 
 typedef struct bifrost_register_unit_command_t {
 	int packet_size;	// shared memory size request
+	int channel_mode;	// channel_mode_t - single slot or ring
 	char name[0];		// unit name
-} bifrost_register_remote_unit_command_t;
+} bifrost_register_unit_command_t;
+
+/* batch of local units: count entries of bifrost_register_unit_command_t (name included),
+	each takes BIFROST_REGISTER_UNIT_ENTRY_SIZE bytes. Broker answers the caller when all of them are done
+*/
+typedef struct bifrost_register_units_command_t {
+	void* reply;		// D-Bus call to answer, see bifrost_dbus_return_channels
+	unsigned int count;
+	char units[0];
+} bifrost_register_units_command_t;
+
+#define BIFROST_REGISTER_UNIT_ENTRY_SIZE(name_length) \
+	((sizeof (bifrost_register_unit_command_t) + (name_length) + 1 + 3) & ~3u)
+
+// how messages reach remote unit
+typedef enum bifrost_transport_t {
+	BIFROST_TRANSPORT_TCP = 0,	// ordered stream per peer
+	BIFROST_TRANSPORT_UDP		// datagrams, lost ones are retransmitted without holding back the rest
+} bifrost_transport_t;
 
 typedef struct bifrost_register_remote_unit_command_t {
 	int ip;
 	int id;
+	int transport;		// bifrost_transport_t
+	int compress_threshold;	// payloads to the peer from this size are compressed: 0 - daemon default, negative - never
 	char name[0];
-} bifrost_register_unit_command_t;
-
+} bifrost_register_remote_unit_command_t;
 
+#endif
@@ -0,0 +1,111 @@
+#include "mpsc.h"
+#include <stddef.h>
+
+void mpsc_init (mpsc_queue_t* queue)
+{
+	queue->stub.next = NULL;
+	queue->head = &queue->stub;
+	queue->tail = &queue->stub;
+	queue->pushed = 0;
+	queue->popped = 0;
+}
+
+static inline void mpsc_link (mpsc_queue_t* queue, message_t* msg)
+{
+	message_t* prev;
+
+	__atomic_store_n (&msg->next, NULL, __ATOMIC_RELAXED);
+	prev = __atomic_exchange_n (&queue->head, msg, __ATOMIC_SEQ_CST);
+	// between exchange and this store the chain is broken - consumer will see it as empty
+	__atomic_store_n (&prev->next, msg, __ATOMIC_RELEASE);
+}
+
+void mpsc_push (mpsc_queue_t* queue, message_t* msg)
+{
+	__atomic_add_fetch (&queue->pushed, 1, __ATOMIC_RELAXED);
+	mpsc_link (queue, msg);
+}
+
+message_t* mpsc_pop (mpsc_queue_t* queue)
+{
+	message_t* msg = queue->tail;
+	message_t* next = __atomic_load_n (&msg->next, __ATOMIC_ACQUIRE);
+
+	if (msg == &queue->stub)
+	{
+		if (next == NULL)	// queue is empty
+			return NULL;
+
+		// skip stub
+		queue->tail = next;
+		msg = next;
+		next = __atomic_load_n (&msg->next, __ATOMIC_ACQUIRE);
+	}
+
+	if (next == NULL)
+	{
+		// msg is the last one: it may be taken only after stub is linked behind it
+		if (msg != __atomic_load_n (&queue->head, __ATOMIC_ACQUIRE))
+			return NULL;	// some producer is pushing right now, message will be available soon
+
+		mpsc_link (queue, &queue->stub);
+		next = __atomic_load_n (&msg->next, __ATOMIC_ACQUIRE);
+		if (next == NULL)
+			return NULL;	// the same as above
+	}
+
+	queue->tail = next;
+	queue->popped++;
+	msg->next = NULL;	// msg is not reachable for producers anymore
+
+	return msg;
+}
+
+message_t* mpsc_pop_chain (mpsc_queue_t* queue, unsigned int max_count)
+{
+	message_t* first;
+	message_t* last;
+	message_t* msg;
+	message_t* next;
+	unsigned int count = 1;
+
+	// first message follows all the rules of a single pop
+	if (!(first = mpsc_pop (queue)))
+		return NULL;
+	last = first;
+
+	/* the rest are already chained by producers, so the chain is detached by walking it and moving tail once.
+	   Message is taken only if it has a successor - producers will never touch it again.
+	   Walk stops at stub or at the last message, single pop will take care of them.
+	*/
+	msg = queue->tail;
+	while ((max_count == 0 || count < max_count) && msg != &queue->stub)
+	{
+		if (!(next = __atomic_load_n (&msg->next, __ATOMIC_ACQUIRE)))
+			break;
+
+		last->next = msg;
+		last = msg;
+		msg = next;
+		count++;
+	}
+	queue->tail = msg;
+	queue->popped += count - 1;	// first one is counted by mpsc_pop
+	last->next = NULL;
+
+	if ((max_count == 0 || count < max_count) && (msg = mpsc_pop (queue)))
+		last->next = msg;
+
+	return first;
+}
+
+int mpsc_is_empty (mpsc_queue_t* queue)
+{
+	// tail may point to a message left by pop_chain - it's still in the queue
+	return queue->tail == &queue->stub && __atomic_load_n (&queue->head, __ATOMIC_SEQ_CST) == &queue->stub;
+}
+
+unsigned long mpsc_size (mpsc_queue_t* queue)
+{
+	return __atomic_load_n (&queue->pushed, __ATOMIC_RELAXED) - queue->popped;
+}
@@ -0,0 +1,43 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include "message.h"
+
+/* Lock-free intrusive MPSC fifo of messages (D. Vyukov's algorithm).
+	Producers only exchange the head pointer and link the previous message, so they never wait for each other
+	or for the consumer. Only one thread at a time may consume: it walks the chain from the tail.
+	Stub message is always kept in the chain, so the chain is never empty and push never touches the tail.
+	Consumer role may be handed over between threads, provided the handover itself is synchronized
+	(e.g. by acquire/release of an ownership flag).
+*/
+
+typedef struct mpsc_queue_t {
+	message_t* head __attribute__ ((aligned (64)));	// last pushed message - producers side
+	unsigned long pushed;				// on producers' line, which is bounced by push anyway
+	message_t* tail __attribute__ ((aligned (64)));	// next message to pop - consumer side
+	unsigned long popped;
+	message_t  stub;
+} mpsc_queue_t;
+
+#define MPSC_QUEUE_INITIALIZER(queue) { .head = &(queue).stub, .tail = &(queue).stub }
+
+void mpsc_init (mpsc_queue_t* queue);
+
+/* push message - may be called from any thread.
+	Exchange is sequentially consistent, so producer may check consumer sleep flag right after it
+*/
+void mpsc_push (mpsc_queue_t* queue, message_t* msg);
+
+/* consumer side
+	pop returns NULL if queue is empty or if the only pushed message is not linked by its producer yet.
+	pop_chain detaches up to max_count messages (0 - all available) linked through next field,
+	last one has next == NULL.
+	is_empty is exact for consumer: if it returns 1, every completed push will be seen by the next pop.
+	size is number of pushed but not popped messages; it may include pushes which are not completed yet.
+*/
+message_t* mpsc_pop (mpsc_queue_t* queue);
+message_t* mpsc_pop_chain (mpsc_queue_t* queue, unsigned int max_count);
+int mpsc_is_empty (mpsc_queue_t* queue);
+unsigned long mpsc_size (mpsc_queue_t* queue);
+
+#endif
@@ -0,0 +1,324 @@
+#include "net.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+/* LZ4 block format, greedy single-probe matcher - fast rather than tight.
+	Block is a chain of sequences: token (literals count << 4 | match length - 4), literals count
+	extension bytes, literals, match offset (2 bytes, little endian), match length extension bytes.
+	Counts of 15 and more continue in bytes of 255 up to the first smaller byte.
+	The last sequence has literals only; the last 5 bytes are always literals and the last match
+	starts at least 12 bytes before the end.
+	Compressed payload is prefixed with original size (4 bytes, network order).
+*/
+
+#define LZ_HASH_BITS		12
+#define LZ_MIN_MATCH		4
+#define LZ_LAST_LITERALS	5
+#define LZ_MATCH_LIMIT		12
+#define LZ_MAX_OFFSET		65535
+#define LZ_MIN_INPUT		32		// nothing to gain below it
+
+// per-thread compressor state: routing workers compress in parallel
+typedef struct compress_state_t {
+	uint32_t table[1 << LZ_HASH_BITS];	// last position of every 4-byte hash
+	unsigned int capacity;
+	unsigned char* buffer;			// compressed output before it replaces payload
+} compress_state_t;
+
+static __thread compress_state_t* state = NULL;
+
+static pthread_key_t state_key;
+static pthread_once_t state_key_once = PTHREAD_ONCE_INIT;
+
+//=================================================================================================
+
+static void state_release (void* arg)
+{
+	compress_state_t* st = (compress_state_t*) arg;
+
+	free (st->buffer);
+	free (st);
+}
+
+static void state_key_create ()
+{
+	pthread_key_create (&state_key, state_release);
+}
+
+static compress_state_t* get_state (unsigned int capacity)
+{
+	unsigned char* buffer;
+
+	if (!state)
+	{
+		if (!(state = calloc (1, sizeof (compress_state_t))))
+			return NULL;
+
+		// freed on thread exit
+		pthread_once (&state_key_once, state_key_create);
+		pthread_setspecific (state_key, state);
+	}
+
+	if (state->capacity < capacity)
+	{
+		if (!(buffer = realloc (state->buffer, capacity)))
+			return NULL;
+		state->buffer = buffer;
+		state->capacity = capacity;
+	}
+
+	return state;
+}
+
+static inline uint32_t read32 (const unsigned char* p)
+{
+	uint32_t v;
+
+	memcpy (&v, p, sizeof (v));
+	return v;
+}
+
+static inline unsigned int lz_hash (uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+// count of 15 and more continues in extension bytes; returns new output position, 0 - no room
+static inline unsigned int put_length (unsigned char* dst, unsigned int op, unsigned int cap, unsigned int len)
+{
+	for (; len >= 255; len -= 255)
+	{
+		if (op >= cap)
+			return 0;
+		dst[op++] = 255;
+	}
+	if (op >= cap)
+		return 0;
+	dst[op++] = len;
+
+	return op;
+}
+
+/* returns compressed size, 0 if it doesn't fit into cap */
+static unsigned int lz_compress (const unsigned char* src, unsigned int size, unsigned char* dst, unsigned int cap, uint32_t* table)
+{
+	unsigned int ip = 0;
+	unsigned int anchor = 0;
+	unsigned int op = 0;
+	unsigned int ref, literals, match, h;
+	unsigned char* token;
+
+	memset (table, 0, sizeof (uint32_t) << LZ_HASH_BITS);
+
+	while (size > LZ_MATCH_LIMIT && ip < size - LZ_MATCH_LIMIT)
+	{
+		h = lz_hash (read32 (src + ip));
+		ref = table[h];
+		table[h] = ip;
+
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32 (src + ref) != read32 (src + ip))
+		{
+			// skip faster through data which doesn't compress
+			ip += 1 + ((ip - anchor) >> 6);
+			continue;
+		}
+
+		for (match = LZ_MIN_MATCH; ip + match < size - LZ_LAST_LITERALS && src[ref + match] == src[ip + match]; match++);
+		literals = ip - anchor;
+
+		// token, literals, offset; extension bytes are checked as they are written
+		if (op + 1 + literals + 2 > cap)
+			return 0;
+		token = dst + op++;
+		*token = (literals < 15 ? literals : 15) << 4;
+		if (literals >= 15 && !(op = put_length (dst, op, cap, literals - 15)))
+			return 0;
+		if (op + literals + 2 > cap)
+			return 0;
+		memcpy (dst + op, src + anchor, literals);
+		op += literals;
+
+		dst[op++] = (ip - ref) & 0xff;
+		dst[op++] = (ip - ref) >> 8;
+
+		*token |= match - LZ_MIN_MATCH < 15 ? match - LZ_MIN_MATCH : 15;
+		if (match - LZ_MIN_MATCH >= 15 && !(op = put_length (dst, op, cap, match - LZ_MIN_MATCH - 15)))
+			return 0;
+
+		ip += match;
+		anchor = ip;
+	}
+
+	// last literals
+	literals = size - anchor;
+	if (op + 1 + literals > cap)
+		return 0;
+	token = dst + op++;
+	*token = (literals < 15 ? literals : 15) << 4;
+	if (literals >= 15 && !(op = put_length (dst, op, cap, literals - 15)))
+		return 0;
+	if (op + literals > cap)
+		return 0;
+	memcpy (dst + op, src + anchor, literals);
+
+	return op + literals;
+}
+
+/* returns decompressed size, negative value if block is broken */
+static int lz_decompress (const unsigned char* src, unsigned int size, unsigned char* dst, unsigned int cap)
+{
+	unsigned int ip = 0;
+	unsigned int op = 0;
+	unsigned int literals, match, offset;
+	unsigned char token, b;
+
+	while (ip < size)
+	{
+		token = src[ip++];
+
+		literals = token >> 4;
+		if (literals == 15)
+		{
+			do {
+				if (ip >= size)
+					return -1;
+				b = src[ip++];
+				literals += b;
+			} while (b == 255);
+		}
+		if (literals > size - ip || literals > cap - op)
+			return -2;
+		memcpy (dst + op, src + ip, literals);
+		ip += literals;
+		op += literals;
+
+		if (ip == size)
+			break;		// last sequence
+
+		if (size - ip < 2)
+			return -3;
+		offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -4;
+
+		match = token & 15;
+		if (match == 15)
+		{
+			do {
+				if (ip >= size)
+					return -5;
+				b = src[ip++];
+				match += b;
+			} while (b == 255);
+		}
+		match += LZ_MIN_MATCH;
+		if (match > cap - op)
+			return -6;
+
+		// source and destination may overlap - repeating pattern
+		if (offset >= match)
+		{
+			memcpy (dst + op, dst + op - offset, match);
+			op += match;
+		} else
+		{
+			for (; match; match--, op++)
+				dst[op] = dst[op - offset];
+		}
+	}
+
+	return op;
+}
+
+//=================================================================================================
+
+int net_compress_message (data_message_t* msg, unsigned int threshold, bifrost_peer_stats_t* stats)
+{
+	compress_state_t* st;
+	struct timespec start, end;
+	unsigned int size = msg->buffer_size;
+	unsigned int packed = 0;
+	uint32_t original;
+
+	if (!threshold || size < threshold || size < LZ_MIN_INPUT)
+		return 0;
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	// output must be smaller than input with its size prefix, otherwise it's not worth it
+	if ((st = get_state (size)))
+		packed = lz_compress ((unsigned char*)msg->buf, size, st->buffer, size - sizeof (original) - 1, st->table);
+
+	if (packed)
+	{
+		original = htonl (size);
+		memcpy (msg->buf, &original, sizeof (original));
+		memcpy (msg->buf + sizeof (original), st->buffer, packed);
+		msg->buffer_size = sizeof (original) + packed;
+		msg->message_flags |= MESSAGE_FLAG_COMPRESSED;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	// peer is shared by routing workers
+	__atomic_add_fetch (packed ? &stats->compressed : &stats->incompressible, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&stats->compress_in_bytes, size, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&stats->compress_out_bytes, msg->buffer_size, __ATOMIC_RELAXED);
+	__atomic_add_fetch (&stats->compress_ns, (end.tv_sec - start.tv_sec) * 1000000000ULL + end.tv_nsec - start.tv_nsec, __ATOMIC_RELAXED);
+
+	return packed ? 1 : 0;
+}
+
+data_message_t* net_decompress_message (data_message_t* msg)
+{
+	data_message_t* out;
+	uint32_t original;
+
+	if (msg->buffer_size < sizeof (original))
+		goto broken;
+
+	memcpy (&original, msg->buf, sizeof (original));
+	original = ntohl (original);
+	if (original > NET_MAX_PAYLOAD)
+		goto broken;
+
+	if (!(out = (data_message_t*) bifrost_create_message (MESSAGE_DATA, original)))
+		goto broken;
+
+	out->src_id = msg->src_id;
+	out->dest_id = msg->dest_id;
+	out->priority = msg->priority;
+
+	if (lz_decompress ((unsigned char*)msg->buf + sizeof (original), msg->buffer_size - sizeof (original),
+			   (unsigned char*)out->buf, original) != (int)original)
+	{
+		bifrost_free_message ((message_t*)out);
+		goto broken;
+	}
+
+	bifrost_free_message ((message_t*)msg);
+	return out;
+
+broken:
+	bifrost_free_message ((message_t*)msg);
+	return NULL;
+}
+
+void net_log_compress_stats (const char* transport, const bifrost_peer_stats_t* stats)
+{
+	unsigned long long frames = stats->compressed + stats->incompressible;
+	unsigned long long in = stats->compress_in_bytes;
+	unsigned long long out = stats->compress_out_bytes;
+
+	if (!frames)
+		return;
+
+	syslog (LOG_INFO, "%s: peer %s: compressed %llu of %llu frames, %llu -> %llu bytes (ratio %.2f), %llu ns avg",
+		transport, inet_ntoa ((struct in_addr){ .s_addr = stats->ip }), (unsigned long long) stats->compressed, frames,
+		in, out, out ? (double)in / out : 0.0, (unsigned long long) stats->compress_ns / frames);
+}
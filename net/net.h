@@ -0,0 +1,157 @@
+#ifndef NET_H
+#define NET_H
+
+#include "../message.h"
+#include "../mpsc.h"
+#include "../stats.h"
+#include "../loop.h"
+#include <stdint.h>
+#include <arpa/inet.h>
+
+/* Remote forwarding - data messages to units of other nodes (dest_id.ip != 0).
+	Peer is a node address (IPv4, network byte order, the same as bifrost_address_t::ip).
+	Transports run in main loop thread; routing workers only hand messages over to them.
+*/
+
+/* frame on the wire, followed by size bytes of payload. All fields are in network byte order */
+typedef struct net_frame_header_t {
+	uint32_t size;		// payload size
+	uint16_t flags;		// NET_FRAME_* bits
+	uint16_t priority;	// message_priority_t
+	int32_t src_id;		// unit id at sending node
+	int32_t dest_id;	// unit id at receiving node
+} __attribute__ ((packed)) net_frame_header_t;
+
+#define NET_MAX_PAYLOAD		(1024 * 1024)
+
+#define NET_FRAME_COMPRESSED	0x1	// payload is original size (4 bytes, network order) and LZ4 block
+
+// priority of a received frame: out of range values go to bulk lane, as for units (broker inbox)
+static inline unsigned int net_frame_priority (const net_frame_header_t* header)
+{
+	unsigned int priority = ntohs (header->priority);
+
+	return priority < BIFROST_PRIORITY_COMMAND ? priority : BIFROST_PRIORITY_BULK;
+}
+
+//=================================================================================================
+// known peers (net/peer.c)
+
+/* allow frames from node ip - main loop thread, when a remote unit of it is registered.
+	Transports drop everything which comes from other addresses.
+	returns 0 on success, -1 if there are too many peers
+*/
+int  net_allow_peer (int ip);
+// any thread
+int  net_peer_allowed (int ip);
+
+//=================================================================================================
+// payload compression (net/compress.c), LZ4 block format
+
+/* compress payload in place if it's at least threshold bytes (0 - never) and gets smaller;
+	sets MESSAGE_FLAG_COMPRESSED then. Any thread, compression counters of peer stats are added to.
+	returns 1 if payload was compressed
+*/
+int  net_compress_message (data_message_t* msg, unsigned int threshold, bifrost_peer_stats_t* stats);
+/* restore payload of a received NET_FRAME_COMPRESSED frame; msg is freed in any case.
+	returns new message, NULL if payload is broken
+*/
+data_message_t* net_decompress_message (data_message_t* msg);
+void net_log_compress_stats (const char* transport, const bifrost_peer_stats_t* stats);
+
+//=================================================================================================
+/* transport peers (net/peer.c) - what routing workers share with main loop.
+	Transport peer structure starts with net_peer_t. Table is appended by main loop thread only,
+	workers look peers up without locks, push messages into their queues and wake main loop up
+	through wakeup_fd - only the first message after a flush does it.
+*/
+
+#define NET_MAX_PEERS		64		// per transport
+
+typedef struct net_peer_t {
+	mpsc_queue_t queue;		// messages to send: routing workers push, main loop pops
+	int scheduled;			// peer got messages since its last flush
+
+	int ip;
+	unsigned int compress_threshold;
+	bifrost_peer_stats_t* stats;	// slot of statistics page, or own_stats if page is full
+	bifrost_peer_stats_t own_stats;
+} net_peer_t;
+
+typedef struct net_peer_table_t {
+	const char* name;		// transport name for logs
+	int transport;			// bifrost_transport_t
+	int wakeup_fd;			// eventfd: flush is requested
+	int flush_requested;
+	unsigned int count;
+	net_peer_t* peers[NET_MAX_PEERS];
+} net_peer_table_t;
+
+#define NET_PEER_TABLE_INITIALIZER(name, transport) { name, transport, -1, 0, 0, { NULL } }
+
+/* create wakeup eventfd, on_flush_request is called by main loop when it fires
+	(it reads the event with net_peers_wakeup_read)
+*/
+int  net_peers_open (net_peer_table_t* table, loop_callback_t on_flush_request);
+/* free peers with their queued messages (counted as dropped) - transport has released its part of them */
+void net_peers_close (net_peer_table_t* table);
+
+/* new peer is size bytes (cache line aligned, zeroed), created is set to 1 then;
+	known peer gets the new threshold, created is 0
+	returns NULL if there are too many peers or memory is exhausted
+*/
+net_peer_t* net_peers_add (net_peer_table_t* table, int ip, unsigned int size, unsigned int compress_threshold,
+			   int* created);
+// any thread
+net_peer_t* net_peers_find (net_peer_table_t* table, int ip);
+// transport send: compress message and queue it to peer dest_id.ip (see tcp_transport_send)
+int  net_peers_send (net_peer_table_t* table, data_message_t* msg);
+
+// returns 0 if flush request was read from wakeup_fd
+int  net_peers_wakeup_read (int fd);
+/* clear flush request before peers are scanned: request which comes during the scan wakes main loop once more
+	returns number of peers to scan
+*/
+unsigned int net_peers_flush_begin (net_peer_table_t* table);
+// returns 1 (and clears the mark) if peer got messages since its last flush
+int  net_peer_unschedule (net_peer_t* peer);
+// free chain of messages which never left, they are counted as dropped; returns their number
+unsigned int net_peer_drop (net_peer_t* peer, message_t* chain);
+
+//=================================================================================================
+// TCP transport (net/tcp.c): persistent connection per peer, frames are batched with writev
+
+/* start listening on bifrost_settings.net_listen_address:net_listen_port (port 0 - don't accept connections)
+	connections from nodes which weren't allowed by net_allow_peer are closed at once
+*/
+int  tcp_transport_init ();
+/* close all connections; queued messages are freed */
+void tcp_transport_uninit ();
+/* make peer known to transport - broker thread. Connection is opened on the first message.
+	compress_threshold - see net_compress_message; peer which is known already gets the new threshold
+*/
+int  tcp_transport_add_peer (int ip, unsigned int compress_threshold);
+/* queue message to peer dest_id.ip - may be called from any thread.
+	returns 0 if message is taken (it will be freed by transport), negative value if peer is unknown
+*/
+int  tcp_transport_send (data_message_t* msg);
+
+//=================================================================================================
+/* UDP transport (net/udp.c): datagram per frame, numbered per peer. Receiver acknowledges the
+	received prefix and reports gaps (NACK), sender retransmits only lost frames from a bounded window.
+	Delivery is reliable but not ordered: a lost frame doesn't hold back the frames behind it.
+	Frame payload is limited by datagram size (about 64K), larger messages are dropped.
+*/
+
+int  udp_transport_init ();
+/* messages in send windows and queues are freed */
+void udp_transport_uninit ();
+/* socket is bound to bifrost_settings.net_listen_address:net_listen_port (the same as TCP uses)
+	with the first peer; fails if there is no listen port - peers acknowledge frames to it.
+	Datagrams from nodes which weren't added here are dropped
+*/
+int  udp_transport_add_peer (int ip, unsigned int compress_threshold);
+/* the same contract as tcp_transport_send */
+int  udp_transport_send (data_message_t* msg);
+
+#endif
@@ -0,0 +1,196 @@
+#include "net.h"
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+/* Nodes remote units were registered for. Nothing is accepted from other addresses: frames carry
+	unit ids only, so any host which may talk to the port could deliver to any local unit otherwise.
+	Table is only appended, by main loop thread; transports look addresses up without locks.
+*/
+
+#define NET_MAX_KNOWN_PEERS	128		// TCP and UDP peers together
+
+static int known_peers[NET_MAX_KNOWN_PEERS];
+static unsigned int known_peers_count = 0;
+
+//=================================================================================================
+
+int net_allow_peer (int ip)
+{
+	if (net_peer_allowed (ip))
+		return 0;
+
+	if (known_peers_count >= NET_MAX_KNOWN_PEERS)
+	{
+		syslog (LOG_ERR, "%s: too many peers", __func__);
+		return -1;
+	}
+
+	known_peers[known_peers_count] = ip;
+	__atomic_store_n (&known_peers_count, known_peers_count + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+int net_peer_allowed (int ip)
+{
+	unsigned int count = __atomic_load_n (&known_peers_count, __ATOMIC_ACQUIRE);
+	unsigned int idx;
+
+	for (idx = 0; idx < count; idx++)
+		if (known_peers[idx] == ip)
+			return 1;
+
+	return 0;
+}
+
+//=================================================================================================
+// transport peers
+
+int net_peers_open (net_peer_table_t* table, loop_callback_t on_flush_request)
+{
+	if ((table->wakeup_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+		|| loop_add_fd (table->wakeup_fd, EPOLLIN, on_flush_request, NULL))
+	{
+		syslog (LOG_ERR, "%s: failed to set up %s wakeup: %m", __func__, table->name);
+		if (table->wakeup_fd >= 0)
+			close (table->wakeup_fd);
+		table->wakeup_fd = -1;
+		return -1;
+	}
+
+	return 0;
+}
+
+void net_peers_close (net_peer_table_t* table)
+{
+	net_peer_t* peer;
+	unsigned int idx;
+
+	for (idx = 0; idx < table->count; idx++)
+	{
+		peer = table->peers[idx];
+		net_peer_drop (peer, mpsc_pop_chain (&peer->queue, 0));
+		net_log_compress_stats (table->name, peer->stats);
+		free (peer);
+	}
+	table->count = 0;
+
+	if (table->wakeup_fd >= 0)
+	{
+		loop_remove_fd (table->wakeup_fd);
+		close (table->wakeup_fd);
+		table->wakeup_fd = -1;
+	}
+	table->flush_requested = 0;
+}
+
+net_peer_t* net_peers_add (net_peer_table_t* table, int ip, unsigned int size, unsigned int compress_threshold,
+			   int* created)
+{
+	net_peer_t* peer;
+
+	*created = 0;
+	if ((peer = net_peers_find (table, ip)))
+	{
+		__atomic_store_n (&peer->compress_threshold, compress_threshold, __ATOMIC_RELAXED);
+		return peer;
+	}
+
+	if (table->count >= NET_MAX_PEERS)
+	{
+		syslog (LOG_ERR, "%s: too many %s peers", __func__, table->name);
+		return NULL;
+	}
+
+	// queue cursors are cache line aligned
+	if (!(peer = aligned_alloc (64, (size + 63) & ~63UL)))
+	{
+		syslog (LOG_ERR, "%s: out of memory!", __func__);
+		return NULL;
+	}
+	memset (peer, 0, size);
+	mpsc_init (&peer->queue);
+	peer->ip = ip;
+	peer->compress_threshold = compress_threshold;
+	if (!(peer->stats = stats_add_peer (ip, table->transport)))
+		peer->stats = &peer->own_stats;
+
+	table->peers[table->count] = peer;
+	__atomic_store_n (&table->count, table->count + 1, __ATOMIC_RELEASE);
+
+	*created = 1;
+	return peer;
+}
+
+net_peer_t* net_peers_find (net_peer_table_t* table, int ip)
+{
+	unsigned int count = __atomic_load_n (&table->count, __ATOMIC_ACQUIRE);
+	unsigned int idx;
+
+	for (idx = 0; idx < count; idx++)
+		if (table->peers[idx]->ip == ip)
+			return table->peers[idx];
+
+	return NULL;
+}
+
+int net_peers_send (net_peer_table_t* table, data_message_t* msg)
+{
+	net_peer_t* peer;
+	uint64_t one = 1;
+
+	if (!(peer = net_peers_find (table, msg->dest_id.ip)))
+		return -1;
+
+	// compressed by sending worker, so compression scales with routing
+	net_compress_message (msg, __atomic_load_n (&peer->compress_threshold, __ATOMIC_RELAXED), peer->stats);
+
+	mpsc_push (&peer->queue, (message_t*)msg);
+
+	// only the first message after a flush wakes main loop up
+	if (!__atomic_load_n (&peer->scheduled, __ATOMIC_SEQ_CST) && !__atomic_exchange_n (&peer->scheduled, 1, __ATOMIC_SEQ_CST)
+		&& !__atomic_exchange_n (&table->flush_requested, 1, __ATOMIC_SEQ_CST))
+	{
+		if (write (table->wakeup_fd, &one, sizeof (one)) != sizeof (one))
+			syslog (LOG_ERR, "%s: failed to request %s flush", __func__, table->name);
+	}
+
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+int net_peers_wakeup_read (int fd)
+{
+	uint64_t value;
+
+	return read (fd, &value, sizeof (value)) == sizeof (value) ? 0 : -1;
+}
+
+unsigned int net_peers_flush_begin (net_peer_table_t* table)
+{
+	__atomic_store_n (&table->flush_requested, 0, __ATOMIC_SEQ_CST);
+	return __atomic_load_n (&table->count, __ATOMIC_ACQUIRE);
+}
+
+int net_peer_unschedule (net_peer_t* peer)
+{
+	return __atomic_exchange_n (&peer->scheduled, 0, __ATOMIC_SEQ_CST);
+}
+
+unsigned int net_peer_drop (net_peer_t* peer, message_t* chain)
+{
+	message_t* next;
+	unsigned int count = 0;
+
+	for (; chain; chain = next, count++)
+	{
+		next = chain->next;
+		bifrost_free_message (chain);
+	}
+
+	STATS_ADD(peer->stats->dropped, count);
+	return count;
+}
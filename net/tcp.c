@@ -0,0 +1,658 @@
+#define _GNU_SOURCE		// accept4
+#include "net.h"
+#include "../settings.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+
+/* Every node opens one outgoing connection per peer and only writes into it; frames from peers come
+	through connections accepted on the listening socket. Routing workers push messages into peer queues
+	and request a flush; main loop flushes after coalescing delay, so messages which arrive meanwhile
+	go to the same writev.
+*/
+
+#define TCP_BATCH		512		// frames per writev - two iovecs each, within IOV_MAX
+#define TCP_READ_BUFFER		(64 * 1024)
+#define TCP_RECONNECT_MS	1000
+#define TCP_HOUSEKEEPING_MS	10
+
+typedef struct tcp_peer_t {
+	net_peer_t base;
+
+	int fd;				// outgoing connection, -1 - not connected
+	int connected;			// 0 while non-blocking connect is in progress
+	int want_write;			// EPOLLOUT is watched
+	struct timespec retry_at;	// no reconnects until then
+
+	// batch which is being written
+	message_t* batch;
+	unsigned int batch_frames;
+	unsigned long long batch_bytes;
+	unsigned int iov_first;
+	unsigned int iov_count;
+	net_frame_header_t headers[TCP_BATCH];
+	struct iovec iov[TCP_BATCH * 2];
+
+	unsigned long writes;
+} tcp_peer_t;
+
+// accepted connection - frames from peer
+typedef struct tcp_connection_t {
+	int fd;
+	int ip;
+	char* buffer;			// received bytes which are not parsed yet
+	unsigned int buffered;
+	data_message_t* current;	// message which payload is being received
+	unsigned int payload_got;
+	int compressed;			// current frame is NET_FRAME_COMPRESSED
+	data_message_t* pending;	// complete message rejected by bus - reading is paused until it's pushed
+	struct tcp_connection_t* next;
+} tcp_connection_t;
+
+static net_peer_table_t peers = NET_PEER_TABLE_INITIALIZER ("tcp", BIFROST_TRANSPORT_TCP);
+
+static tcp_connection_t* connections = NULL;
+
+static int listen_fd = -1;
+static int coalesce_fd = -1;		// timerfd: coalescing delay
+static int housekeeping_fd = -1;
+static int coalesce_armed = 0;
+
+//=================================================================================================
+
+static int time_passed (const struct timespec* moment)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return now.tv_sec > moment->tv_sec || (now.tv_sec == moment->tv_sec && now.tv_nsec >= moment->tv_nsec);
+}
+
+//-------------------------------------------------------------------------------------------------
+// outgoing side
+
+static void peer_drop_queued (tcp_peer_t* peer)
+{
+	net_peer_drop (&peer->base, mpsc_pop_chain (&peer->base.queue, 0));
+}
+
+static void peer_fail (tcp_peer_t* peer, const char* reason)
+{
+	struct in_addr addr = { .s_addr = peer->base.ip };
+
+	syslog (LOG_WARNING, "tcp: connection to %s failed: %s", inet_ntoa (addr), reason);
+
+	if (peer->fd >= 0)
+	{
+		loop_remove_fd (peer->fd);
+		close (peer->fd);
+		peer->fd = -1;
+	}
+	peer->connected = 0;
+	peer->want_write = 0;
+
+	// unsent part of batch is lost with connection; frames written before it may have come or not
+	net_peer_drop (&peer->base, peer->batch);
+	peer->batch = NULL;
+	peer_drop_queued (peer);
+
+	clock_gettime (CLOCK_MONOTONIC, &peer->retry_at);
+	peer->retry_at.tv_sec += TCP_RECONNECT_MS / 1000;
+	peer->retry_at.tv_nsec += (TCP_RECONNECT_MS % 1000) * 1000000L;
+	if (peer->retry_at.tv_nsec >= 1000000000L)
+	{
+		peer->retry_at.tv_sec++;
+		peer->retry_at.tv_nsec -= 1000000000L;
+	}
+}
+
+static void peer_flush (tcp_peer_t* peer);
+
+static void on_peer_event (int fd, uint32_t events, void* user_data)
+{
+	tcp_peer_t* peer = (tcp_peer_t*) user_data;
+	char buf[64];
+	ssize_t n;
+	int error = 0;
+	socklen_t len = sizeof (error);
+
+	if (events & (EPOLLERR | EPOLLHUP))
+	{
+		getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len);
+		peer_fail (peer, error ? strerror (error) : "connection closed");
+		return;
+	}
+
+	// peers never write into our outgoing connection: readable means closed
+	if (events & EPOLLIN)
+	{
+		n = recv (fd, buf, sizeof (buf), 0);
+		if (n == 0 || (n < 0 && errno != EAGAIN))
+		{
+			peer_fail (peer, n == 0 ? "connection closed" : strerror (errno));
+			return;
+		}
+	}
+
+	if (events & EPOLLOUT)
+	{
+		if (!peer->connected)
+		{
+			if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len) || error)
+			{
+				peer_fail (peer, strerror (error));
+				return;
+			}
+			peer->connected = 1;
+			syslog (LOG_INFO, "tcp: connected to peer %s", inet_ntoa ((struct in_addr){ .s_addr = peer->base.ip }));
+		}
+		peer_flush (peer);
+	}
+}
+
+static int peer_connect (tcp_peer_t* peer)
+{
+	struct sockaddr_in addr;
+	int one = 1;
+	int rc;
+
+	peer->fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (peer->fd < 0)
+		return -1;
+
+	// batching is done here, don't let Nagle delay it once more
+	setsockopt (peer->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (bifrost_settings.net_peer_port);
+	addr.sin_addr.s_addr = peer->base.ip;
+
+	rc = connect (peer->fd, (struct sockaddr*)&addr, sizeof (addr));
+	if (rc && errno != EINPROGRESS)
+		return -2;
+
+	peer->connected = (rc == 0);
+	peer->want_write = !peer->connected;
+	if (loop_add_fd (peer->fd, EPOLLIN | (peer->want_write ? EPOLLOUT : 0), on_peer_event, peer))
+		return -3;
+
+	return 0;
+}
+
+/* take next batch from peer queue and lay it out as header/payload iovecs
+	message which receiver would take for a broken stream is dropped here
+	returns 0 if there is nothing to send
+*/
+static int peer_prepare_batch (tcp_peer_t* peer)
+{
+	data_message_t* msg;
+	message_t* next;
+	message_t** link = &peer->batch;
+	unsigned int idx = 0;
+
+	peer->batch_bytes = 0;
+	// chain of oversized messages only leaves nothing to send - the next one is taken then
+	while (!idx && (msg = (data_message_t*) mpsc_pop_chain (&peer->base.queue, TCP_BATCH)))
+	{
+		for (; msg; msg = (data_message_t*)next)
+		{
+			next = msg->next;
+			if (msg->buffer_size > NET_MAX_PAYLOAD)
+			{
+				bifrost_free_message ((message_t*)msg);
+				STATS_ADD(peer->base.stats->dropped, 1);
+				continue;
+			}
+			*link = (message_t*)msg;
+			link = &msg->next;
+
+			peer->headers[idx].size = htonl (msg->buffer_size);
+			peer->headers[idx].flags = htons ((msg->message_flags & MESSAGE_FLAG_COMPRESSED) ? NET_FRAME_COMPRESSED : 0);
+			peer->headers[idx].priority = htons (msg->priority);
+			peer->headers[idx].src_id = htonl (msg->src_id.id);
+			peer->headers[idx].dest_id = htonl (msg->dest_id.id);
+
+			peer->iov[idx * 2].iov_base = &peer->headers[idx];
+			peer->iov[idx * 2].iov_len = sizeof (net_frame_header_t);
+			peer->iov[idx * 2 + 1].iov_base = msg->buf;
+			peer->iov[idx * 2 + 1].iov_len = msg->buffer_size;
+
+			peer->batch_bytes += msg->buffer_size;
+			idx++;
+		}
+	}
+	*link = NULL;
+
+	peer->batch_frames = idx;
+	peer->iov_first = 0;
+	peer->iov_count = idx * 2;
+	return idx > 0;
+}
+
+static void peer_flush (tcp_peer_t* peer)
+{
+	message_t* next;
+	ssize_t written;
+
+	if (peer->fd < 0)
+	{
+		// reconnect backoff: nothing can be sent now
+		if (!time_passed (&peer->retry_at))
+		{
+			peer_drop_queued (peer);
+			return;
+		}
+		if (peer_connect (peer))
+		{
+			peer_fail (peer, strerror (errno));
+			return;
+		}
+	}
+
+	if (!peer->connected)
+		return;		// flushed when connect completes
+
+	for (;;)
+	{
+		if (!peer->batch && !peer_prepare_batch (peer))
+			break;
+
+		written = writev (peer->fd, peer->iov + peer->iov_first, peer->iov_count - peer->iov_first);
+		if (written < 0)
+		{
+			if (errno == EAGAIN || errno == EINTR)
+			{
+				// socket buffer is full - continue when it drains
+				if (!peer->want_write && !loop_modify_fd (peer->fd, EPOLLIN | EPOLLOUT))
+					peer->want_write = 1;
+				return;
+			}
+			peer_fail (peer, strerror (errno));
+			return;
+		}
+		peer->writes++;
+
+		// skip what was written; partially written iovec is adjusted in place
+		while (peer->iov_first < peer->iov_count && (size_t)written >= peer->iov[peer->iov_first].iov_len)
+			written -= peer->iov[peer->iov_first++].iov_len;
+		if (peer->iov_first < peer->iov_count)
+		{
+			peer->iov[peer->iov_first].iov_base = (char*)peer->iov[peer->iov_first].iov_base + written;
+			peer->iov[peer->iov_first].iov_len -= written;
+			continue;
+		}
+
+		while (peer->batch)
+		{
+			next = peer->batch->next;
+			bifrost_free_message (peer->batch);
+			peer->batch = next;
+		}
+		STATS_ADD(peer->base.stats->sent, peer->batch_frames);
+		STATS_ADD(peer->base.stats->sent_bytes, peer->batch_bytes);
+	}
+
+	if (peer->want_write && !loop_modify_fd (peer->fd, EPOLLIN))
+		peer->want_write = 0;
+}
+
+static void flush_peers ()
+{
+	unsigned int count = net_peers_flush_begin (&peers);
+	tcp_peer_t* peer;
+	unsigned int idx;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		peer = (tcp_peer_t*) peers.peers[idx];
+		if (net_peer_unschedule (&peer->base) && !peer->want_write)
+			peer_flush (peer);
+	}
+}
+
+static void on_flush_request (int fd, uint32_t events, void* user_data)
+{
+	struct itimerspec delay = { { 0, 0 }, { 0, 0 } };
+
+	(void) events;
+	(void) user_data;
+
+	if (net_peers_wakeup_read (fd))
+		return;
+
+	if (!bifrost_settings.net_coalesce_us)
+	{
+		flush_peers ();
+		return;
+	}
+
+	// first request starts coalescing delay, the ones which come before it expires join the same flush
+	if (!coalesce_armed)
+	{
+		delay.it_value.tv_sec = bifrost_settings.net_coalesce_us / 1000000;
+		delay.it_value.tv_nsec = (bifrost_settings.net_coalesce_us % 1000000) * 1000L;
+		if (timerfd_settime (coalesce_fd, 0, &delay, NULL) == 0)
+			coalesce_armed = 1;
+		else
+			flush_peers ();
+	}
+}
+
+static void on_coalesce_timer (int fd, uint32_t events, void* user_data)
+{
+	uint64_t expirations;
+
+	(void) events;
+	(void) user_data;
+
+	if (read (fd, &expirations, sizeof (expirations)) != sizeof (expirations))
+		return;
+
+	coalesce_armed = 0;
+	flush_peers ();
+}
+
+//-------------------------------------------------------------------------------------------------
+// incoming side
+
+static void connection_close (tcp_connection_t* conn, const char* reason)
+{
+	tcp_connection_t** link;
+	struct in_addr addr = { .s_addr = conn->ip };
+
+	syslog (LOG_INFO, "tcp: connection from %s closed: %s", inet_ntoa (addr), reason);
+
+	for (link = &connections; *link; link = &(*link)->next)
+	{
+		if (*link == conn)
+		{
+			*link = conn->next;
+			break;
+		}
+	}
+
+	loop_remove_fd (conn->fd);
+	close (conn->fd);
+	bifrost_free_message ((message_t*)conn->current);
+	bifrost_free_message ((message_t*)conn->pending);
+	free (conn->buffer);
+	free (conn);
+}
+
+/* parse buffered bytes into messages and push them to bus.
+	returns 0 - buffer is consumed, 1 - bus rejected a message (reading is paused), negative - broken stream
+*/
+static int connection_parse (tcp_connection_t* conn)
+{
+	net_frame_header_t header;
+	unsigned int pos = 0;
+	unsigned int size;
+	unsigned int chunk;
+
+	while (pos < conn->buffered)
+	{
+		if (!conn->current)
+		{
+			if (conn->buffered - pos < sizeof (header))
+				break;
+
+			memcpy (&header, conn->buffer + pos, sizeof (header));
+			pos += sizeof (header);
+
+			if ((size = ntohl (header.size)) > NET_MAX_PAYLOAD)
+				return -1;
+
+			if (!(conn->current = (data_message_t*) bifrost_create_message (MESSAGE_DATA, size)))
+				return -2;
+
+			conn->current->src_id.ip = conn->ip;
+			conn->current->src_id.id = ntohl (header.src_id);
+			conn->current->dest_id.ip = 0;
+			conn->current->dest_id.id = ntohl (header.dest_id);
+			conn->current->priority = net_frame_priority (&header);
+			conn->payload_got = 0;
+			conn->compressed = ntohs (header.flags) & NET_FRAME_COMPRESSED;
+		}
+
+		chunk = conn->current->buffer_size - conn->payload_got;
+		if (chunk > conn->buffered - pos)
+			chunk = conn->buffered - pos;
+		memcpy (conn->current->buf + conn->payload_got, conn->buffer + pos, chunk);
+		conn->payload_got += chunk;
+		pos += chunk;
+
+		if (conn->payload_got < conn->current->buffer_size)
+			break;
+
+		if (conn->compressed && !(conn->current = net_decompress_message (conn->current)))
+			return -3;
+
+		// bus is consumed by this very thread: it must never block here
+		if (bifrost_try_push_message ((message_t*)conn->current))
+		{
+			conn->pending = conn->current;
+			conn->current = NULL;
+			break;
+		}
+		conn->current = NULL;
+	}
+
+	memmove (conn->buffer, conn->buffer + pos, conn->buffered - pos);
+	conn->buffered -= pos;
+
+	return conn->pending ? 1 : 0;
+}
+
+static void on_connection_event (int fd, uint32_t events, void* user_data)
+{
+	tcp_connection_t* conn = (tcp_connection_t*) user_data;
+	ssize_t n;
+	int rc;
+
+	(void) events;	// errors come out of recv
+
+	n = recv (fd, conn->buffer + conn->buffered, TCP_READ_BUFFER - conn->buffered, 0);
+	if (n <= 0)
+	{
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			return;
+		connection_close (conn, n == 0 ? "closed by peer" : strerror (errno));
+		return;
+	}
+	conn->buffered += n;
+
+	if ((rc = connection_parse (conn)) < 0)
+		connection_close (conn, "broken frame");
+	else if (rc > 0)
+		loop_modify_fd (fd, 0);		// backpressure: peer's socket buffer fills up
+}
+
+static void on_accept (int fd, uint32_t events, void* user_data)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof (addr);
+	tcp_connection_t* conn;
+	int conn_fd;
+
+	(void) events;
+	(void) user_data;
+
+	if ((conn_fd = accept4 (fd, (struct sockaddr*)&addr, &len, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+
+	// frames carry unit ids only - nobody but registered nodes may deliver them
+	if (!net_peer_allowed (addr.sin_addr.s_addr))
+	{
+		syslog (LOG_NOTICE, "tcp: connection from unknown node %s refused", inet_ntoa (addr.sin_addr));
+		close (conn_fd);
+		return;
+	}
+
+	conn = calloc (1, sizeof (tcp_connection_t));
+	if (!conn || !(conn->buffer = malloc (TCP_READ_BUFFER)))
+	{
+		syslog (LOG_ERR, "%s: out of memory!", __func__);
+		free (conn);
+		close (conn_fd);
+		return;
+	}
+	conn->fd = conn_fd;
+	conn->ip = addr.sin_addr.s_addr;
+
+	if (loop_add_fd (conn_fd, EPOLLIN, on_connection_event, conn))
+	{
+		free (conn->buffer);
+		free (conn);
+		close (conn_fd);
+		return;
+	}
+
+	conn->next = connections;
+	connections = conn;
+	syslog (LOG_INFO, "tcp: accepted connection from %s", inet_ntoa (addr.sin_addr));
+}
+
+// resume connections paused by backpressure
+static void on_housekeeping (int fd, uint32_t events, void* user_data)
+{
+	tcp_connection_t* conn;
+	tcp_connection_t* next;
+	int rc;
+
+	(void) fd;
+	(void) events;
+	(void) user_data;
+
+	for (conn = connections; conn; conn = next)
+	{
+		next = conn->next;
+		if (!conn->pending || bifrost_try_push_message ((message_t*)conn->pending))
+			continue;
+
+		conn->pending = NULL;
+		if ((rc = connection_parse (conn)) < 0)
+			connection_close (conn, "broken frame");
+		else if (rc == 0)
+			loop_modify_fd (conn->fd, EPOLLIN);
+	}
+}
+
+//=================================================================================================
+
+int tcp_transport_init ()
+{
+	struct sockaddr_in addr;
+	int one = 1;
+
+	coalesce_fd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (coalesce_fd < 0 || net_peers_open (&peers, on_flush_request)
+		|| loop_add_fd (coalesce_fd, EPOLLIN, on_coalesce_timer, NULL)
+		|| (housekeeping_fd = loop_add_timer (TCP_HOUSEKEEPING_MS, on_housekeeping, NULL)) < 0)
+	{
+		syslog (LOG_ERR, "%s: failed to set up transport events", __func__);
+		tcp_transport_uninit ();
+		return -1;
+	}
+
+	if (!bifrost_settings.net_listen_port)
+		return 0;	// send only
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (bifrost_settings.net_listen_port);
+	if (!inet_aton (bifrost_settings.net_listen_address, &addr.sin_addr))
+	{
+		syslog (LOG_ERR, "%s: invalid listen address '%s'", __func__, bifrost_settings.net_listen_address);
+		tcp_transport_uninit ();
+		return -2;
+	}
+
+	listen_fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0
+		|| setsockopt (listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one))
+		|| bind (listen_fd, (struct sockaddr*)&addr, sizeof (addr))
+		|| listen (listen_fd, SOMAXCONN)
+		|| loop_add_fd (listen_fd, EPOLLIN, on_accept, NULL))
+	{
+		syslog (LOG_ERR, "%s: failed to listen on %s:%u: %m", __func__, bifrost_settings.net_listen_address,
+			bifrost_settings.net_listen_port);
+		tcp_transport_uninit ();
+		return -2;
+	}
+
+	syslog (LOG_INFO, "tcp: listening on %s:%u", bifrost_settings.net_listen_address, bifrost_settings.net_listen_port);
+	return 0;
+}
+
+void tcp_transport_uninit ()
+{
+	tcp_peer_t* peer;
+	unsigned int idx;
+
+	while (connections)
+		connection_close (connections, "shutdown");
+
+	for (idx = 0; idx < peers.count; idx++)
+	{
+		peer = (tcp_peer_t*) peers.peers[idx];
+		if (peer->fd >= 0)
+		{
+			loop_remove_fd (peer->fd);
+			close (peer->fd);
+		}
+		net_peer_drop (&peer->base, peer->batch);
+		peer_drop_queued (peer);
+
+		syslog (LOG_INFO, "tcp: peer %s: %llu frames, %llu bytes in %lu writes, %llu dropped",
+			inet_ntoa ((struct in_addr){ .s_addr = peer->base.ip }), (unsigned long long) peer->base.stats->sent,
+			(unsigned long long) peer->base.stats->sent_bytes, peer->writes, (unsigned long long) peer->base.stats->dropped);
+	}
+	net_peers_close (&peers);
+
+	if (listen_fd >= 0)
+	{
+		loop_remove_fd (listen_fd);
+		close (listen_fd);
+		listen_fd = -1;
+	}
+	if (housekeeping_fd >= 0)
+	{
+		loop_remove_timer (housekeeping_fd);
+		housekeeping_fd = -1;
+	}
+	if (coalesce_fd >= 0)
+	{
+		loop_remove_fd (coalesce_fd);
+		close (coalesce_fd);
+		coalesce_fd = -1;
+	}
+	coalesce_armed = 0;
+}
+
+int tcp_transport_add_peer (int ip, unsigned int compress_threshold)
+{
+	tcp_peer_t* peer;
+	int created;
+
+	if (!(peer = (tcp_peer_t*) net_peers_add (&peers, ip, sizeof (tcp_peer_t), compress_threshold, &created)))
+		return -1;
+
+	if (created)
+		peer->fd = -1;
+	return 0;
+}
+
+int tcp_transport_send (data_message_t* msg)
+{
+	return net_peers_send (&peers, msg);
+}
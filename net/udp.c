@@ -0,0 +1,740 @@
+#define _GNU_SOURCE		// sendmmsg, recvmmsg
+#include "net.h"
+#include "../settings.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* Reliable datagram transport: one frame per datagram, numbered per peer.
+	Sender keeps every frame in its send window until receiver acknowledges it; receiver reports
+	the cumulative sequence (everything below is received) and the gaps it sees above it (NACK),
+	so only lost frames are sent again. Frames are delivered as soon as they come - a lost frame
+	doesn't hold back the ones behind it, retransmitted frame may come out of order.
+	Every datagram carries boot session of its sender and the session of receiver as sender knows it.
+	Datagrams meant for another boot are not taken; when a peer comes with a new session, it has
+	restarted: frames in flight are dropped and both directions are numbered from 0 again.
+	Acknowledgements come to net_listen_port, so socket is opened only when the first peer is added,
+	and only if the port is given. Datagrams from nodes which aren't peers are dropped.
+	All sockets and windows belong to main loop thread; routing workers only push into peer queues.
+*/
+
+#define UDP_WINDOW		1024		// frames in flight per peer, power of two
+#define UDP_BATCH		64		// datagrams per sendmmsg/recvmmsg
+#define UDP_DATAGRAM_SIZE	65507
+#define UDP_MAX_PAYLOAD		(UDP_DATAGRAM_SIZE - sizeof (udp_header_t) - sizeof (net_frame_header_t))
+#define UDP_MAX_NACKS		256		// sequences in one ACK datagram
+#define UDP_ACK_EVERY		64		// frames received between acknowledgements
+#define UDP_RETRANSMIT_MS	20		// unacknowledged window is probed after this
+#define UDP_STALL_MS		1000		// window which doesn't move for so long stops taking new messages
+#define UDP_HOUSEKEEPING_MS	5
+
+enum {
+	UDP_PACKET_DATA = 1,		// sequence - frame number; followed by frame
+	UDP_PACKET_ACK			// sequence - cumulative; followed by count nacked sequences
+};
+
+// datagram header, network byte order
+typedef struct udp_header_t {
+	uint16_t type;
+	uint16_t count;
+	uint32_t sequence;
+	uint32_t session;		// boot of sending node
+	uint32_t peer_session;		// boot of receiving node as sender knows it, 0 - not known yet
+} __attribute__ ((packed)) udp_header_t;
+
+typedef struct udp_peer_t {
+	net_peer_t base;
+
+	struct sockaddr_in addr;
+	uint32_t session;		// boot of peer, 0 - not heard of it yet
+	uint32_t stale_session;		// its previous boot: late datagrams of it are ignored
+
+	// sender: frames [send_base, send_next) are in flight, [send_next, send_staged) wait for socket buffer
+	uint32_t send_base;
+	uint32_t send_next;
+	uint32_t send_staged;
+	message_t* window[UDP_WINDOW];
+	net_frame_header_t frame_headers[UDP_WINDOW];
+	udp_header_t packet_headers[UDP_WINDOW];
+	struct timespec progress;	// last time window base moved
+	struct timespec probed;		// last time window was probed
+
+	// receiver: every frame below recv_base is received, bitmap covers [recv_base, recv_base + UDP_WINDOW)
+	uint32_t recv_base;
+	uint32_t recv_highest;		// highest received sequence + 1
+	unsigned long long recv_bitmap[UDP_WINDOW / 64];
+	unsigned int unacked;		// frames received since last ACK
+	struct timespec nacked;		// last time all open gaps were reported
+
+	unsigned long retransmitted;
+	unsigned long received;
+	unsigned long duplicates;
+	unsigned long nacks;
+	unsigned long restarts;
+} udp_peer_t;
+
+static net_peer_table_t peers = NET_PEER_TABLE_INITIALIZER ("udp", BIFROST_TRANSPORT_UDP);
+
+static uint32_t session = 0;		// boot of this node
+static int socket_fd = -1;
+static int housekeeping_fd = -1;
+static int want_write = 0;		// socket buffer was full
+static unsigned int loss_seed = 1;	// loss injection
+
+// receive buffers
+static char recv_buffers[UDP_BATCH][UDP_DATAGRAM_SIZE];
+
+//=================================================================================================
+
+static unsigned long elapsed_ms (const struct timespec* since)
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+// loss injection for tests: datagram is "sent" but never leaves
+static inline int datagram_lost ()
+{
+	return bifrost_settings.net_udp_loss_percent && (unsigned int)(rand_r (&loss_seed) % 100) < bifrost_settings.net_udp_loss_percent;
+}
+
+//-------------------------------------------------------------------------------------------------
+// sender
+
+static void fill_datagram (struct mmsghdr* mmsg, struct iovec* iov, udp_peer_t* peer, uint32_t sequence)
+{
+	unsigned int slot = sequence & (UDP_WINDOW - 1);
+	data_message_t* msg = (data_message_t*) peer->window[slot];
+
+	// peer's session may have become known since frame was staged
+	peer->packet_headers[slot].session = htonl (session);
+	peer->packet_headers[slot].peer_session = htonl (peer->session);
+
+	iov[0].iov_base = &peer->packet_headers[slot];
+	iov[0].iov_len = sizeof (udp_header_t);
+	iov[1].iov_base = &peer->frame_headers[slot];
+	iov[1].iov_len = sizeof (net_frame_header_t);
+	iov[2].iov_base = msg->buf;
+	iov[2].iov_len = msg->buffer_size;
+
+	memset (mmsg, 0, sizeof (struct mmsghdr));
+	mmsg->msg_hdr.msg_name = &peer->addr;
+	mmsg->msg_hdr.msg_namelen = sizeof (peer->addr);
+	mmsg->msg_hdr.msg_iov = iov;
+	mmsg->msg_hdr.msg_iovlen = 3;
+}
+
+/* send prepared datagrams; returns number of datagrams which left (or were lost on purpose),
+	the rest stays for the next flush when socket becomes writable
+*/
+static unsigned int send_datagrams (struct mmsghdr* mmsg, unsigned int count)
+{
+	unsigned int done = 0;
+	unsigned int run;
+	int rc;
+
+	while (done < count)
+	{
+		// with loss injection datagrams are sent in runs between the lost ones
+		for (run = 0; done + run < count && !datagram_lost (); run++);
+
+		if (run)
+		{
+			rc = sendmmsg (socket_fd, mmsg + done, run, 0);
+			if (rc < 0 && errno != EAGAIN && errno != ENOBUFS)
+			{
+				syslog (LOG_WARNING, "udp: send failed: %m");
+				rc = run;	// frames stay in window - they will be nacked or probed
+			}
+			else if (rc < (int)run)
+			{
+				// socket buffer is full
+				if (rc > 0)
+					done += rc;
+				if (!want_write && !loop_modify_fd (socket_fd, EPOLLIN | EPOLLOUT))
+					want_write = 1;
+				break;
+			}
+			done += rc;
+		}
+
+		// run is ended by a lost datagram
+		if (done < count)
+			done++;
+	}
+
+	return done;
+}
+
+// put new frames into window and send them with as few syscalls as possible
+static void peer_flush (udp_peer_t* peer)
+{
+	struct mmsghdr mmsg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][3];
+	data_message_t* msg;
+	unsigned int count, slot, idx, sent;
+	unsigned long long bytes;
+	int idle = peer->send_base == peer->send_next;
+
+	for (;;)
+	{
+		while (peer->send_staged - peer->send_base < UDP_WINDOW && peer->send_staged - peer->send_next < UDP_BATCH
+			&& (msg = (data_message_t*) mpsc_pop (&peer->base.queue)))
+		{
+			if (msg->buffer_size > UDP_MAX_PAYLOAD)
+			{
+				msg->next = NULL;
+				net_peer_drop (&peer->base, (message_t*)msg);
+				continue;
+			}
+
+			slot = peer->send_staged & (UDP_WINDOW - 1);
+			peer->window[slot] = (message_t*)msg;
+			peer->packet_headers[slot].type = htons (UDP_PACKET_DATA);
+			peer->packet_headers[slot].count = 0;
+			peer->packet_headers[slot].sequence = htonl (peer->send_staged);
+			peer->frame_headers[slot].size = htonl (msg->buffer_size);
+			peer->frame_headers[slot].flags = htons ((msg->message_flags & MESSAGE_FLAG_COMPRESSED) ? NET_FRAME_COMPRESSED : 0);
+			peer->frame_headers[slot].priority = htons (msg->priority);
+			peer->frame_headers[slot].src_id = htonl (msg->src_id.id);
+			peer->frame_headers[slot].dest_id = htonl (msg->dest_id.id);
+			peer->send_staged++;
+		}
+
+		if (!(count = peer->send_staged - peer->send_next))
+			break;
+
+		for (idx = 0; idx < count; idx++)
+			fill_datagram (&mmsg[idx], iov[idx], peer, peer->send_next + idx);
+
+		sent = send_datagrams (mmsg, count);
+		for (idx = 0, bytes = 0; idx < sent; idx++)
+			bytes += iov[idx][2].iov_len;
+		peer->send_next += sent;
+		STATS_ADD(peer->base.stats->sent, sent);
+		STATS_ADD(peer->base.stats->sent_bytes, bytes);
+		if (sent < count)
+			break;		// socket is full - the rest is sent when it becomes writable
+	}
+
+	// window was empty - timeout starts from the first frame
+	if (idle && peer->send_base != peer->send_next)
+		clock_gettime (CLOCK_MONOTONIC, &peer->progress);
+}
+
+static void peer_retransmit (udp_peer_t* peer, const uint32_t* sequences, unsigned int count)
+{
+	struct mmsghdr mmsg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH][3];
+	unsigned int n = 0;
+	unsigned int idx;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		// frame may be acknowledged already by a later ACK
+		if (sequences[idx] - peer->send_base >= peer->send_next - peer->send_base)
+			continue;
+
+		fill_datagram (&mmsg[n], iov[n], peer, sequences[idx]);
+		if (++n == UDP_BATCH)
+		{
+			peer->retransmitted += send_datagrams (mmsg, n);
+			n = 0;
+		}
+	}
+
+	if (n)
+		peer->retransmitted += send_datagrams (mmsg, n);
+}
+
+// everything in window is sent again, e.g. when it was sent before peer's session was known
+static void peer_resend (udp_peer_t* peer)
+{
+	uint32_t sequences[UDP_BATCH];
+	uint32_t sequence = peer->send_base;
+	unsigned int n;
+
+	while (sequence != peer->send_next)
+	{
+		for (n = 0; n < UDP_BATCH && sequence != peer->send_next; n++)
+			sequences[n] = sequence++;
+		peer_retransmit (peer, sequences, n);
+	}
+}
+
+// frames in window are freed; they aren't acknowledged, so they count as dropped
+static void peer_drop_window (udp_peer_t* peer)
+{
+	unsigned int count = 0;
+
+	for (; peer->send_base != peer->send_staged; peer->send_base++, count++)
+	{
+		bifrost_free_message (peer->window[peer->send_base & (UDP_WINDOW - 1)]);
+		peer->window[peer->send_base & (UDP_WINDOW - 1)] = NULL;
+	}
+	STATS_ADD(peer->base.stats->dropped, count);
+}
+
+static void peer_acknowledge (udp_peer_t* peer, uint32_t cumulative)
+{
+	// cumulative beyond what was sent is garbage
+	if (cumulative - peer->send_base > peer->send_next - peer->send_base)
+		return;
+
+	if (cumulative != peer->send_base)
+		clock_gettime (CLOCK_MONOTONIC, &peer->progress);
+
+	while (peer->send_base != cumulative)
+	{
+		unsigned int slot = peer->send_base & (UDP_WINDOW - 1);
+
+		bifrost_free_message (peer->window[slot]);
+		peer->window[slot] = NULL;
+		peer->send_base++;
+	}
+}
+
+/* flush scheduled peers; all - flush every peer (after the socket was full, unscheduled peers may
+	still have staged frames or messages which didn't fit into window)
+*/
+static void flush_peers (int all)
+{
+	unsigned int count = net_peers_flush_begin (&peers);
+	unsigned int idx;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		if (net_peer_unschedule (peers.peers[idx]) || all)
+			peer_flush ((udp_peer_t*) peers.peers[idx]);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+// receiver
+
+static inline int received_bit (udp_peer_t* peer, uint32_t sequence)
+{
+	unsigned int bit = sequence & (UDP_WINDOW - 1);
+	return (peer->recv_bitmap[bit / 64] >> (bit % 64)) & 1;
+}
+
+/* ACK carries cumulative sequence and NACKs for frames missing in [from, to) */
+static void send_ack (udp_peer_t* peer, uint32_t from, uint32_t to)
+{
+	struct {
+		udp_header_t header;
+		uint32_t nacks[UDP_MAX_NACKS];
+	} __attribute__ ((packed)) packet;
+	unsigned int count = 0;
+	uint32_t sequence;
+
+	for (sequence = from; sequence != to && count < UDP_MAX_NACKS; sequence++)
+		if (!received_bit (peer, sequence))
+			packet.nacks[count++] = htonl (sequence);
+
+	packet.header.type = htons (UDP_PACKET_ACK);
+	packet.header.count = htons (count);
+	packet.header.sequence = htonl (peer->recv_base);
+	packet.header.session = htonl (session);
+	packet.header.peer_session = htonl (peer->session);
+
+	peer->unacked = 0;
+	peer->nacks += count;
+
+	if (datagram_lost ())
+		return;
+
+	if (sendto (socket_fd, &packet, sizeof (udp_header_t) + count * sizeof (uint32_t), 0,
+		    (struct sockaddr*)&peer->addr, sizeof (peer->addr)) < 0 && errno != EAGAIN)
+		syslog (LOG_WARNING, "udp: failed to send ack: %m");
+}
+
+// frame is done with: window moves past it and sender learns it in time
+static void mark_received (udp_peer_t* peer, uint32_t sequence)
+{
+	uint32_t highest = peer->recv_highest;
+	unsigned int bit;
+	int gap;
+
+	bit = sequence & (UDP_WINDOW - 1);
+	peer->recv_bitmap[bit / 64] |= 1ULL << (bit % 64);
+
+	gap = sequence - peer->recv_base > highest - peer->recv_base;
+	if (sequence - peer->recv_base >= highest - peer->recv_base)
+		peer->recv_highest = sequence + 1;
+
+	while (received_bit (peer, peer->recv_base))
+	{
+		bit = peer->recv_base & (UDP_WINDOW - 1);
+		peer->recv_bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+		peer->recv_base++;
+	}
+
+	// a new gap is reported at once, the rest is acknowledged in bulk
+	if (gap)
+		send_ack (peer, highest, sequence);
+	else if (++peer->unacked >= UDP_ACK_EVERY)
+		send_ack (peer, peer->recv_base, peer->recv_base);
+}
+
+/* sender would repeat a broken frame forever and its window would stall on it,
+	so it is acknowledged like a received one and only counted
+*/
+static void skip_frame (udp_peer_t* peer, uint32_t sequence, const char* reason)
+{
+	syslog (LOG_WARNING, "udp: peer %s: %s frame %u is skipped", inet_ntoa ((struct in_addr){ .s_addr = peer->base.ip }),
+		reason, sequence);
+	STATS_ADD(peer->base.stats->broken, 1);
+	mark_received (peer, sequence);
+}
+
+static void receive_frame (udp_peer_t* peer, uint32_t sequence, const char* data, unsigned int size)
+{
+	net_frame_header_t header;
+	data_message_t* msg;
+	unsigned int payload;
+
+	// duplicate or too far ahead for window
+	if (sequence - peer->recv_base >= UDP_WINDOW || received_bit (peer, sequence))
+	{
+		peer->duplicates++;
+		send_ack (peer, peer->recv_base, peer->recv_base);	// sender may have missed our ACK
+		return;
+	}
+
+	if (size < sizeof (header))
+	{
+		skip_frame (peer, sequence, "truncated");
+		return;
+	}
+
+	memcpy (&header, data, sizeof (header));
+	payload = ntohl (header.size);
+	if (payload != size - sizeof (header))
+	{
+		skip_frame (peer, sequence, "inconsistent");
+		return;
+	}
+
+	if (!(msg = (data_message_t*) bifrost_create_message (MESSAGE_DATA, payload)))
+		return;		// not marked as received - sender will repeat it
+
+	msg->src_id.ip = peer->base.ip;
+	msg->src_id.id = ntohl (header.src_id);
+	msg->dest_id.ip = 0;
+	msg->dest_id.id = ntohl (header.dest_id);
+	msg->priority = net_frame_priority (&header);
+	memcpy (msg->buf, data + sizeof (header), payload);
+
+	if ((ntohs (header.flags) & NET_FRAME_COMPRESSED) && !(msg = net_decompress_message (msg)))
+	{
+		skip_frame (peer, sequence, "broken compressed");
+		return;
+	}
+
+	// bus is consumed by this very thread: it must never block here
+	if (bifrost_try_push_message ((message_t*)msg))
+	{
+		bifrost_free_message ((message_t*)msg);
+		return;		// the same - sender will repeat it
+	}
+
+	peer->received++;
+	mark_received (peer, sequence);
+}
+
+static void receive_ack (udp_peer_t* peer, uint32_t cumulative, const char* data, unsigned int size)
+{
+	uint32_t nacks[UDP_MAX_NACKS];
+	unsigned int count = size / sizeof (uint32_t);
+	unsigned int idx;
+
+	if (count > UDP_MAX_NACKS)
+		count = UDP_MAX_NACKS;
+
+	peer_acknowledge (peer, cumulative);
+
+	memcpy (nacks, data, count * sizeof (uint32_t));
+	for (idx = 0; idx < count; idx++)
+		nacks[idx] = ntohl (nacks[idx]);
+	if (count)
+		peer_retransmit (peer, nacks, count);
+
+	// window may have room now
+	peer_flush (peer);
+}
+
+/* datagram came from boot session of peer: a new one means peer has restarted.
+	Its receiver knows nothing of frames in flight and its sender numbers from 0, so both directions
+	start over; frames which were sent before peer's session was known go again.
+	returns 0 if datagram may be taken, -1 if it belongs to a boot which is gone
+*/
+static int peer_check_session (udp_peer_t* peer, uint32_t peer_session)
+{
+	if (peer_session == peer->session)
+		return 0;
+	if (!peer_session || peer_session == peer->stale_session)
+		return -1;
+
+	if (peer->session)
+	{
+		syslog (LOG_NOTICE, "udp: peer %s has restarted", inet_ntoa ((struct in_addr){ .s_addr = peer->base.ip }));
+		peer_drop_window (peer);
+		peer->send_base = peer->send_next = peer->send_staged = 0;
+		memset (peer->recv_bitmap, 0, sizeof (peer->recv_bitmap));
+		peer->recv_base = peer->recv_highest = 0;
+		peer->unacked = 0;
+		peer->restarts++;
+		clock_gettime (CLOCK_MONOTONIC, &peer->progress);
+	}
+	peer->stale_session = peer->session;
+	peer->session = peer_session;
+
+	peer_resend (peer);
+	return 0;
+}
+
+static void on_socket_event (int fd, uint32_t events, void* user_data)
+{
+	struct mmsghdr mmsg[UDP_BATCH];
+	struct iovec iov[UDP_BATCH];
+	struct sockaddr_in addrs[UDP_BATCH];
+	udp_header_t header;
+	udp_peer_t* peer;
+	int count, idx;
+
+	(void) user_data;
+
+	if (events & EPOLLOUT)
+	{
+		if (!loop_modify_fd (socket_fd, EPOLLIN))
+			want_write = 0;
+		flush_peers (1);
+	}
+
+	if (!(events & EPOLLIN))
+		return;
+
+	memset (mmsg, 0, sizeof (mmsg));
+	for (idx = 0; idx < UDP_BATCH; idx++)
+	{
+		iov[idx].iov_base = recv_buffers[idx];
+		iov[idx].iov_len = UDP_DATAGRAM_SIZE;
+		mmsg[idx].msg_hdr.msg_iov = &iov[idx];
+		mmsg[idx].msg_hdr.msg_iovlen = 1;
+		mmsg[idx].msg_hdr.msg_name = &addrs[idx];
+		mmsg[idx].msg_hdr.msg_namelen = sizeof (addrs[idx]);
+	}
+
+	if ((count = recvmmsg (fd, mmsg, UDP_BATCH, MSG_DONTWAIT, NULL)) <= 0)
+		return;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		if (mmsg[idx].msg_len < sizeof (header))
+			continue;
+
+		// only registered nodes are peers; anybody else may only be dropped
+		memcpy (&header, recv_buffers[idx], sizeof (header));
+		if (!(peer = (udp_peer_t*) net_peers_find (&peers, addrs[idx].sin_addr.s_addr))
+			|| peer_check_session (peer, ntohl (header.session)))
+			continue;
+
+		// frames and acknowledgements for a previous boot of ours: peer learns the current one from our ACK
+		if (ntohl (header.peer_session) != session)
+		{
+			if (ntohs (header.type) == UDP_PACKET_DATA)
+				send_ack (peer, peer->recv_base, peer->recv_base);
+			continue;
+		}
+
+		if (ntohs (header.type) == UDP_PACKET_DATA)
+			receive_frame (peer, ntohl (header.sequence), recv_buffers[idx] + sizeof (header), mmsg[idx].msg_len - sizeof (header));
+		else if (ntohs (header.type) == UDP_PACKET_ACK)
+			receive_ack (peer, ntohl (header.sequence), recv_buffers[idx] + sizeof (header), mmsg[idx].msg_len - sizeof (header));
+	}
+}
+
+static void on_flush_request (int fd, uint32_t events, void* user_data)
+{
+	(void) events;
+	(void) user_data;
+
+	if (net_peers_wakeup_read (fd))
+		return;
+
+	if (!want_write)
+		flush_peers (0);
+}
+
+/* lost tail of a burst isn't followed by anything which could reveal the gap:
+	window which doesn't move is probed with its first frame; receiver answers with ACK/NACK.
+	Receivers repeat NACKs for gaps which are still open after a retransmission timeout.
+	Peer which doesn't acknowledge anything for UDP_STALL_MS (down, unreachable) gets no more messages:
+	its queue is dropped, so producers don't pile messages up behind a window which doesn't move.
+*/
+static void on_housekeeping (int fd, uint32_t events, void* user_data)
+{
+	unsigned int count = __atomic_load_n (&peers.count, __ATOMIC_ACQUIRE);
+	udp_peer_t* peer;
+	unsigned int idx;
+
+	(void) fd;
+	(void) events;
+	(void) user_data;
+
+	for (idx = 0; idx < count; idx++)
+	{
+		peer = (udp_peer_t*) peers.peers[idx];
+
+		if (peer->send_base != peer->send_next && elapsed_ms (&peer->progress) >= UDP_RETRANSMIT_MS
+			&& elapsed_ms (&peer->probed) >= UDP_RETRANSMIT_MS)
+		{
+			peer_retransmit (peer, &peer->send_base, 1);
+			clock_gettime (CLOCK_MONOTONIC, &peer->probed);
+		}
+
+		if (peer->send_base != peer->send_next && elapsed_ms (&peer->progress) >= UDP_STALL_MS)
+			net_peer_drop (&peer->base, mpsc_pop_chain (&peer->base.queue, 0));
+
+		// retransmissions need a round trip - gaps are reported again only when they had time to come
+		if (peer->recv_base != peer->recv_highest && elapsed_ms (&peer->nacked) >= UDP_RETRANSMIT_MS)
+		{
+			send_ack (peer, peer->recv_base, peer->recv_highest);
+			clock_gettime (CLOCK_MONOTONIC, &peer->nacked);
+		}
+		else if (peer->unacked)
+			send_ack (peer, peer->recv_base, peer->recv_base);
+	}
+}
+
+// socket is bound to listen port: peers send acknowledgements there
+static int socket_open ()
+{
+	struct sockaddr_in addr;
+	int size = 4 * 1024 * 1024;
+
+	if (!bifrost_settings.net_listen_port)
+	{
+		syslog (LOG_ERR, "%s: udp peers need listen port - they acknowledge frames to it", __func__);
+		return -1;
+	}
+
+	memset (&addr, 0, sizeof (addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons (bifrost_settings.net_listen_port);
+	if (!inet_aton (bifrost_settings.net_listen_address, &addr.sin_addr))
+	{
+		syslog (LOG_ERR, "%s: invalid listen address '%s'", __func__, bifrost_settings.net_listen_address);
+		return -1;
+	}
+
+	socket_fd = socket (AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (socket_fd < 0
+		|| bind (socket_fd, (struct sockaddr*)&addr, sizeof (addr))
+		|| loop_add_fd (socket_fd, EPOLLIN, on_socket_event, NULL))
+	{
+		syslog (LOG_ERR, "%s: failed to set up udp socket on %s:%u: %m", __func__, bifrost_settings.net_listen_address,
+			bifrost_settings.net_listen_port);
+		if (socket_fd >= 0)
+			close (socket_fd);
+		socket_fd = -1;
+		return -1;
+	}
+
+	// bursts of a whole window must not overflow socket buffers
+	setsockopt (socket_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof (size));
+	setsockopt (socket_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof (size));
+
+	syslog (LOG_INFO, "udp: listening on %s:%u%s", bifrost_settings.net_listen_address, bifrost_settings.net_listen_port,
+		bifrost_settings.net_udp_loss_percent ? ", loss injection is on" : "");
+	return 0;
+}
+
+//=================================================================================================
+
+int udp_transport_init ()
+{
+	struct timespec now;
+
+	// new boot tells peers to start over
+	clock_gettime (CLOCK_REALTIME, &now);
+	session = ((uint32_t) now.tv_nsec ^ (uint32_t) now.tv_sec ^ ((uint32_t) getpid () << 16)) | 1;
+
+	if (net_peers_open (&peers, on_flush_request)
+		|| (housekeeping_fd = loop_add_timer (UDP_HOUSEKEEPING_MS, on_housekeeping, NULL)) < 0)
+	{
+		syslog (LOG_ERR, "%s: failed to set up transport events", __func__);
+		udp_transport_uninit ();
+		return -1;
+	}
+
+	return 0;
+}
+
+void udp_transport_uninit ()
+{
+	udp_peer_t* peer;
+	unsigned int idx;
+
+	for (idx = 0; idx < peers.count; idx++)
+	{
+		peer = (udp_peer_t*) peers.peers[idx];
+		peer_drop_window (peer);
+		net_peer_drop (&peer->base, mpsc_pop_chain (&peer->base.queue, 0));
+
+		syslog (LOG_INFO, "udp: peer %s: sent %llu, retransmitted %lu, received %lu, duplicates %lu, nacked %lu, dropped %llu, broken %llu, restarts %lu",
+			inet_ntoa ((struct in_addr){ .s_addr = peer->base.ip }), (unsigned long long) peer->base.stats->sent,
+			peer->retransmitted, peer->received, peer->duplicates, peer->nacks,
+			(unsigned long long) peer->base.stats->dropped, (unsigned long long) peer->base.stats->broken, peer->restarts);
+	}
+	net_peers_close (&peers);
+
+	if (housekeeping_fd >= 0)
+	{
+		loop_remove_timer (housekeeping_fd);
+		housekeeping_fd = -1;
+	}
+	if (socket_fd >= 0)
+	{
+		loop_remove_fd (socket_fd);
+		close (socket_fd);
+		socket_fd = -1;
+	}
+	want_write = 0;
+}
+
+int udp_transport_add_peer (int ip, unsigned int compress_threshold)
+{
+	udp_peer_t* peer;
+	int created;
+
+	if (socket_fd < 0 && socket_open ())
+		return -1;
+
+	if (!(peer = (udp_peer_t*) net_peers_add (&peers, ip, sizeof (udp_peer_t), compress_threshold, &created)))
+		return -1;
+
+	if (created)
+	{
+		peer->addr.sin_family = AF_INET;
+		peer->addr.sin_port = htons (bifrost_settings.net_peer_port);
+		peer->addr.sin_addr.s_addr = ip;
+		clock_gettime (CLOCK_MONOTONIC, &peer->progress);
+	}
+	return 0;
+}
+
+int udp_transport_send (data_message_t* msg)
+{
+	return net_peers_send (&peers, msg);
+}
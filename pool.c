@@ -0,0 +1,244 @@
+#include "pool.h"
+#include <pthread.h>
+#include <syslog.h>
+#include <stdlib.h>
+
+#define POOL_CLASSES		7		// 64, 128, ... 4096
+#define POOL_SLAB_SIZE		(64 * 1024)
+#define POOL_BATCH		32		// blocks moved between thread cache and shared pool at once
+#define POOL_CACHE_MAX		(POOL_BATCH * 2)
+
+// free block - link is kept inside of block itself
+typedef struct pool_block_t {
+	struct pool_block_t* next;
+} pool_block_t;
+
+// slab header is placed at the beginning of each slab
+typedef struct pool_slab_t {
+	struct pool_slab_t* next;
+} pool_slab_t;
+
+// shared per-class pool
+typedef struct pool_class_t {
+	pthread_mutex_t mutex;
+	pool_block_t* free_list;
+	unsigned int free_count;
+} pool_class_t;
+
+// per-thread cache
+typedef struct pool_cache_t {
+	pool_block_t* free_list;
+	unsigned int free_count;
+} pool_cache_t;
+
+static pool_class_t classes[POOL_CLASSES] = {
+	[0 ... POOL_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static pool_slab_t* slabs = NULL;
+static pthread_mutex_t slabs_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread pool_cache_t cache[POOL_CLASSES];
+static __thread int cache_registered = 0;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+//=================================================================================================
+
+static inline unsigned int size_to_class (unsigned int size)
+{
+	if (size <= POOL_MIN_BLOCK_SIZE)
+		return 0;
+
+	// ceil(log2(size)) - log2(POOL_MIN_BLOCK_SIZE)
+	return (32 - __builtin_clz (size - 1)) - 6;
+}
+
+static inline unsigned int class_to_size (unsigned int cls)
+{
+	return POOL_MIN_BLOCK_SIZE << cls;
+}
+
+//-------------------------------------------------------------------------------------------------
+// move up to count blocks from cache to shared pool
+
+static void cache_flush (unsigned int cls, unsigned int count)
+{
+	pool_cache_t* c = &cache[cls];
+	pool_block_t* first = c->free_list;
+	pool_block_t* last = first;
+	unsigned int n;
+
+	if (!first || count == 0)
+		return;
+
+	for (n = 1; n < count && last->next; n++)
+		last = last->next;
+
+	c->free_list = last->next;
+	c->free_count -= n;
+
+	pthread_mutex_lock (&classes[cls].mutex);
+	last->next = classes[cls].free_list;
+	classes[cls].free_list = first;
+	classes[cls].free_count += n;
+	pthread_mutex_unlock (&classes[cls].mutex);
+}
+
+// thread exit - return cached blocks to shared pool
+static void cache_release (void* arg)
+{
+	unsigned int cls;
+
+	(void) arg;	// cache is thread local, key value only triggers the call
+
+	for (cls = 0; cls < POOL_CLASSES; cls++)
+		cache_flush (cls, cache[cls].free_count);
+}
+
+static void cache_key_create ()
+{
+	pthread_key_create (&cache_key, cache_release);
+}
+
+//-------------------------------------------------------------------------------------------------
+// allocate new slab and put its blocks into thread cache
+
+static int slab_create (unsigned int cls)
+{
+	unsigned int block_size = class_to_size (cls);
+	pool_slab_t* slab;
+	char* block;
+	char* end;
+
+	if (posix_memalign ((void**)&slab, POOL_MIN_BLOCK_SIZE, POOL_SLAB_SIZE))
+	{
+		syslog (LOG_ERR, "%s: failed to allocate slab for %u-byte blocks", __func__, block_size);
+		return -1;
+	}
+
+	pthread_mutex_lock (&slabs_mutex);
+	slab->next = slabs;
+	slabs = slab;
+	pthread_mutex_unlock (&slabs_mutex);
+
+	// first block is partially occupied by slab header
+	end = (char*)slab + POOL_SLAB_SIZE;
+	for (block = (char*)slab + block_size; block + block_size <= end; block += block_size)
+	{
+		((pool_block_t*)block)->next = cache[cls].free_list;
+		cache[cls].free_list = (pool_block_t*)block;
+		cache[cls].free_count++;
+	}
+
+	return 0;
+}
+
+// refill thread cache from shared pool or from new slab
+static int cache_refill (unsigned int cls)
+{
+	pool_class_t* pc = &classes[cls];
+	pool_block_t* first = NULL;
+	pool_block_t* last = NULL;
+	unsigned int n = 0;
+
+	if (!cache_registered)
+	{
+		// register cache to be flushed on thread exit
+		pthread_once (&cache_key_once, cache_key_create);
+		pthread_setspecific (cache_key, cache);
+		cache_registered = 1;
+	}
+
+	pthread_mutex_lock (&pc->mutex);
+	if (pc->free_list)
+	{
+		first = last = pc->free_list;
+		for (n = 1; n < POOL_BATCH && last->next; n++)
+			last = last->next;
+		pc->free_list = last->next;
+		pc->free_count -= n;
+	}
+	pthread_mutex_unlock (&pc->mutex);
+
+	if (!first)
+		return slab_create (cls);
+
+	last->next = cache[cls].free_list;
+	cache[cls].free_list = first;
+	cache[cls].free_count += n;
+
+	return 0;
+}
+
+//=================================================================================================
+
+void* pool_alloc (unsigned int size)
+{
+	pool_block_t* block;
+	unsigned int cls;
+
+	if (size > POOL_MAX_BLOCK_SIZE)
+		return malloc (size);
+
+	cls = size_to_class (size);
+
+	if (!cache[cls].free_list && cache_refill (cls))
+		return NULL;
+
+	block = cache[cls].free_list;
+	cache[cls].free_list = block->next;
+	cache[cls].free_count--;
+
+	return block;
+}
+
+void pool_free (void* ptr, unsigned int size)
+{
+	pool_block_t* block = (pool_block_t*) ptr;
+	unsigned int cls;
+
+	if (!ptr) return;	// nothing to do
+
+	if (size > POOL_MAX_BLOCK_SIZE)
+	{
+		free (ptr);
+		return;
+	}
+
+	cls = size_to_class (size);
+
+	block->next = cache[cls].free_list;
+	cache[cls].free_list = block;
+	cache[cls].free_count++;
+
+	// blocks are usually released by another thread (broker) than allocated them (producers)
+	if (cache[cls].free_count > POOL_CACHE_MAX)
+		cache_flush (cls, POOL_BATCH);
+}
+
+void pool_destroy ()
+{
+	pool_slab_t* slab;
+	unsigned int cls;
+
+	for (cls = 0; cls < POOL_CLASSES; cls++)
+	{
+		pthread_mutex_lock (&classes[cls].mutex);
+		classes[cls].free_list = NULL;
+		classes[cls].free_count = 0;
+		pthread_mutex_unlock (&classes[cls].mutex);
+
+		cache[cls].free_list = NULL;
+		cache[cls].free_count = 0;
+	}
+
+	pthread_mutex_lock (&slabs_mutex);
+	for (; slabs; slabs = slab)
+	{
+		slab = slabs->next;
+		free (slabs);
+	}
+	pthread_mutex_unlock (&slabs_mutex);
+}
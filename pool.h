@@ -0,0 +1,21 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Size-class slab allocator for bus messages.
+	Blocks are carved from big slabs and never returned to libc until pool_destroy.
+	Every thread keeps a small cache of free blocks per size class, so allocation and release
+	in the steady state take no locks; caches are refilled/flushed from the shared pool in batches.
+	Requests larger than POOL_MAX_BLOCK_SIZE fall back to malloc/free.
+*/
+
+#define POOL_MIN_BLOCK_SIZE	64
+#define POOL_MAX_BLOCK_SIZE	4096
+
+/* allocate block for at least size bytes. Memory is not initialized */
+void* pool_alloc (unsigned int size);
+/* release block. size must be the same as for pool_alloc */
+void  pool_free (void* ptr, unsigned int size);
+/* release all slabs. No block may be used after this call */
+void  pool_destroy ();
+
+#endif
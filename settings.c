@@ -1,10 +1,35 @@
 #include "settings.h"
+#include <unistd.h>
+
+bifrost_settings_t bifrost_settings;
 
 void settings_init ()
 {
 	bifrost_settings.queue_path = "/tmp/mq";
-	bifrost_settings.message_batch_size = 5;
+	bifrost_settings.message_batch_size = BIFROST_BATCH_SIZE_ADAPTIVE;
+	bifrost_settings.message_batch_min = 5;
+	bifrost_settings.message_batch_max = 4096;
+	bifrost_settings.message_batch_latency_us = 200;
 	bifrost_settings.channel_prefix = "/tmp/bifrost/";
+	bifrost_settings.unit_tx_capacity = 256 * 1024;
+	bifrost_settings.queue_staging_slots = 64;
+	bifrost_settings.queue_staging_slot_size = 64 * 1024;
+	bifrost_settings.queue_staging_timeout = 30;
+	bifrost_settings.broadcast_slots = 256;
+	bifrost_settings.broadcast_slot_size = 1024;
+	// main loop thread takes one core for dispatching
+	bifrost_settings.broker_workers = sysconf (_SC_NPROCESSORS_ONLN) > 1 ? sysconf (_SC_NPROCESSORS_ONLN) - 1 : 0;
+	bifrost_settings.bus_capacity = 65536;
+	bifrost_settings.bus_high_watermark = 57344;
+	bifrost_settings.bus_low_watermark = 32768;
+	bifrost_settings.bus_producer_credits = 16384;
+	bifrost_settings.bus_overload_policy = 0;		// BUS_OVERLOAD_BLOCK
+	bifrost_settings.net_listen_address = "0.0.0.0";
+	bifrost_settings.net_listen_port = 0;			// no network exposure unless asked for
+	bifrost_settings.net_peer_port = 7300;
+	bifrost_settings.net_coalesce_us = 50;
+	bifrost_settings.net_udp_loss_percent = 0;
+	bifrost_settings.net_compress_threshold = 0;
 }
 
 void settings_free ()
@@ -1,11 +1,37 @@
 #ifndef SETTINGS_H
 #define SETTINGS_H
 
-static struct {
+// message_batch_size value: broker sizes batches from bus depth, see message_batch_latency_us
+#define BIFROST_BATCH_SIZE_ADAPTIVE	((unsigned int)-1)
+
+typedef struct bifrost_settings_t {
 	char* queue_path;
-	unsigned int message_batch_size;
+	unsigned int message_batch_size;	// 0 - process all available messages at once
+	unsigned int message_batch_min;		// adaptive batch limits
+	unsigned int message_batch_max;
+	unsigned int message_batch_latency_us;	// adaptive: longest time a batch may hold main loop
 	char* channel_prefix;
-} bifrost_settings;
+	unsigned int unit_tx_capacity;		// ring every unit sends through, bytes (0 - units can't send)
+	unsigned int queue_staging_slots;	// number of shared slots for large queue messages (0 - disabled)
+	unsigned int queue_staging_slot_size;	// largest message which can be sent through queue
+	unsigned int queue_staging_timeout;	// seconds: staged message not received by then may be dropped when area is full
+	unsigned int broadcast_slots;		// broadcast ring length (0 - disabled)
+	unsigned int broadcast_slot_size;	// largest broadcast message
+	unsigned int broker_workers;		// routing threads (0 - route in main loop thread)
+	unsigned int bus_capacity;		// data messages in flight (0 - unbounded)
+	unsigned int bus_high_watermark;	// overload starts above it...
+	unsigned int bus_low_watermark;		// ...and ends at it
+	unsigned int bus_producer_credits;	// data messages in flight per source (0 - unlimited)
+	unsigned int bus_overload_policy;	// bus_overload_policy_t from message.h
+	char* net_listen_address;		// remote forwarding: IPv4 address to listen on
+	unsigned int net_listen_port;		// TCP and UDP port to listen on (0 - remote nodes can't send here)
+	unsigned int net_peer_port;		// port peers listen on
+	unsigned int net_coalesce_us;		// delay before flush, messages coming meanwhile share a write
+	unsigned int net_udp_loss_percent;	// testing: outgoing datagrams dropped on purpose
+	unsigned int net_compress_threshold;	// remote payloads from this size are compressed, unless unit asks otherwise (0 - never)
+} bifrost_settings_t;
+
+extern bifrost_settings_t bifrost_settings;
 
 void settings_init ();
 void settings_free ();
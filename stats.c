@@ -0,0 +1,145 @@
+#include "stats.h"
+#include <syslog.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+static const char ftok_stats_id = 't';	// next to queue ('m'), staging ('s') and broadcast ('b') ids
+
+static bifrost_stats_t* page = NULL;
+static int page_id = -1;	// -1 - page is in private memory
+
+static size_t page_size ()
+{
+	return sizeof (bifrost_stats_t) + BIFROST_STATS_UNITS * sizeof (bifrost_unit_stats_t);
+}
+
+bifrost_stats_t* stats_create (const char* queue_path)
+{
+	struct timespec now;
+	key_t key;
+	int id;
+	void* seg;
+
+	if (page)
+		return page;
+
+	if (!queue_path || (key = ftok (queue_path, ftok_stats_id)) == -1)
+		syslog (LOG_WARNING, "%s: no key for statistics page ('%s'), it is kept private", __func__, queue_path);
+	else
+	{
+		// page of a crashed daemon may be of another size - it is dropped, its readers keep the old copy
+		if ((id = shmget (key, 0, 0)) != -1)
+			shmctl (id, IPC_RMID, 0);
+
+		// others may only read
+		if ((page_id = shmget (key, page_size (), IPC_CREAT | IPC_EXCL | 0644)) == -1)
+			syslog (LOG_WARNING, "%s: failed to create statistics page: %s", __func__, strerror (errno));
+		else if ((seg = shmat (page_id, 0, 0)) == (void*)-1)
+		{
+			syslog (LOG_WARNING, "%s: failed to attach statistics page: %s", __func__, strerror (errno));
+			shmctl (page_id, IPC_RMID, 0);
+			page_id = -1;
+		} else
+			page = (bifrost_stats_t*) seg;
+	}
+
+	if (!page && !(page = (bifrost_stats_t*) malloc (page_size ())))
+	{
+		syslog (LOG_ERR, "%s: out of memory", __func__);
+		return NULL;
+	}
+
+	memset (page, 0, page_size ());
+	clock_gettime (CLOCK_REALTIME, &now);
+	page->size = page_size ();
+	page->max_units = BIFROST_STATS_UNITS;
+	page->max_peers = BIFROST_STATS_PEERS;
+	page->pid = getpid ();
+	page->started = now.tv_sec;
+	page->running = 1;
+	page->version = BIFROST_STATS_VERSION;
+	// magic goes last: a reader which sees it sees the whole header
+	__atomic_store_n (&page->magic, BIFROST_STATS_MAGIC, __ATOMIC_RELEASE);
+
+	return page;
+}
+
+void stats_destroy ()
+{
+	if (!page)	// nothing to do
+		return;
+
+	__atomic_store_n (&page->running, 0, __ATOMIC_RELEASE);
+
+	if (page_id == -1)
+		free (page);
+	else
+	{
+		// attached readers keep final counters until they detach
+		shmdt (page);
+		shmctl (page_id, IPC_RMID, 0);
+	}
+
+	page = NULL;
+	page_id = -1;
+}
+
+bifrost_peer_stats_t* stats_add_peer (int ip, int transport)
+{
+	bifrost_peer_stats_t* slot;
+
+	if (!page || page->peers >= page->max_peers)
+		return NULL;
+
+	slot = &page->peer[page->peers];
+	memset (slot, 0, sizeof (bifrost_peer_stats_t));
+	slot->ip = ip;
+	slot->transport = transport;
+
+	// readers look only at slots below peers
+	__atomic_store_n (&page->peers, page->peers + 1, __ATOMIC_RELEASE);
+	return slot;
+}
+
+//-------------------------------------------------------------------------------------------------
+
+const bifrost_stats_t* stats_open (const char* queue_path)
+{
+	const bifrost_stats_t* stats;
+	struct shmid_ds info;
+	key_t key;
+	int id;
+	void* seg;
+
+	if (!queue_path || (key = ftok (queue_path, ftok_stats_id)) == -1
+		|| (id = shmget (key, 0, 0)) == -1 || shmctl (id, IPC_STAT, &info) == -1
+		|| info.shm_segsz < sizeof (bifrost_stats_t))
+		return NULL;
+
+	if ((seg = shmat (id, 0, SHM_RDONLY)) == (void*)-1)
+		return NULL;
+
+	stats = (const bifrost_stats_t*) seg;
+	if (__atomic_load_n (&stats->magic, __ATOMIC_ACQUIRE) != BIFROST_STATS_MAGIC
+		|| stats->version != BIFROST_STATS_VERSION
+		|| stats->size > info.shm_segsz
+		|| stats->max_peers > BIFROST_STATS_PEERS
+		|| sizeof (bifrost_stats_t) + (size_t) stats->max_units * sizeof (bifrost_unit_stats_t) > stats->size)
+	{
+		shmdt (seg);
+		return NULL;
+	}
+
+	return stats;
+}
+
+void stats_close (const bifrost_stats_t* stats)
+{
+	if (stats)
+		shmdt (stats);
+}
@@ -0,0 +1,111 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Statistics page - shared memory segment next to message queue (SysV key from queue path),
+	written by daemon and mapped read-only by anybody, e.g. bifrost-stat. Readers never talk to daemon.
+	All counters are monotonic: readers take rates from deltas between two looks.
+	Counters are updated with relaxed atomics - plain stores by their only writer, atomic adds where
+	writers are many - so readers always see whole values, but not a consistent snapshot of the whole page.
+	Layout is versioned: a reader must check magic and version before looking further.
+*/
+
+#define BIFROST_STATS_MAGIC	0x54534642u	// "BFST"
+#define BIFROST_STATS_VERSION	4
+#define BIFROST_STATS_UNITS	1024		// units beyond it are counted privately by daemon
+#define BIFROST_STATS_PEERS	128		// remote nodes beyond it are counted privately by transports
+#define BIFROST_STATS_NAME_SIZE	64
+
+typedef struct bifrost_unit_stats_t {
+	char name[BIFROST_STATS_NAME_SIZE];	// filled before slot is published by units counter
+	uint32_t id;
+	uint32_t online;
+	uint32_t channel_mode;		// channel_mode_t
+	uint32_t channel_capacity;	// 0 - unit has no channel
+
+	// unit as a source of data messages: written by main loop thread
+	uint64_t sent;
+	uint64_t sent_bytes;
+
+	// unit's channel: written by routing worker of unit
+	uint64_t delivered __attribute__ ((aligned (64)));
+	uint64_t delivered_bytes;
+	uint64_t dropped_offline;	// unit is offline or has no channel
+	uint64_t dropped_full;		// ring is full or slot is busy
+	uint64_t dropped_invalid;	// payload is empty or doesn't fit into channel
+} __attribute__ ((aligned (64))) bifrost_unit_stats_t;
+
+// remote node, one slot per node and transport
+typedef struct bifrost_peer_stats_t {
+	uint32_t ip;			// IPv4, network byte order
+	uint32_t transport;		// bifrost_transport_t
+
+	// written by main loop thread
+	uint64_t sent;			// frames handed over to socket, retransmissions aren't counted
+	uint64_t sent_bytes;		// their payload
+	uint64_t dropped;		// messages which never left: peer unreachable, connection lost, too large
+	uint64_t broken;		// frames from peer which couldn't be decoded, they are skipped
+
+	// payload compression: written by any routing worker, with atomic adds
+	uint64_t compressed __attribute__ ((aligned (64)));	// messages over threshold which got smaller
+	uint64_t incompressible;	// over threshold, but compressed data wasn't smaller
+	uint64_t compress_in_bytes;	// payload of both before compression...
+	uint64_t compress_out_bytes;	// ...and after it
+	uint64_t compress_ns;		// time spent on both
+} __attribute__ ((aligned (64))) bifrost_peer_stats_t;
+
+typedef struct bifrost_stats_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;			// whole segment
+	uint32_t max_units;		// slots in unit array
+	uint32_t units;			// slots in use; released after slot is filled
+	uint32_t running;		// 0 - daemon has stopped, counters are final
+	uint64_t pid;
+	uint64_t started;		// CLOCK_REALTIME seconds
+
+	// bus, written by main loop thread once per batch
+	uint64_t bus_depth __attribute__ ((aligned (64)));	// messages left in bus after the last batch
+	uint64_t batches;
+	uint64_t batch_messages;	// messages taken by batches...
+	uint64_t batch_limit;		// ...out of this many allowed - batch utilization
+	uint64_t bus_rejected;		// overload: messages refused to producers
+	uint64_t bus_dropped;		// overload: queued messages dropped
+	uint64_t dropped_no_route;	// messages to unknown destinations or unreachable peers
+
+	uint32_t max_peers;		// slots in peer array
+	uint32_t peers;			// slots in use; released after slot is filled
+	bifrost_peer_stats_t peer[BIFROST_STATS_PEERS] __attribute__ ((aligned (64)));
+
+	bifrost_unit_stats_t unit[0] __attribute__ ((aligned (64)));
+} bifrost_stats_t;
+
+// counter with a single writer: plain add, without bus lock
+#define STATS_ADD(counter, value) \
+	__atomic_store_n (&(counter), __atomic_load_n (&(counter), __ATOMIC_RELAXED) + (value), __ATOMIC_RELAXED)
+#define STATS_SET(counter, value) __atomic_store_n (&(counter), (value), __ATOMIC_RELAXED)
+#define STATS_GET(counter) __atomic_load_n (&(counter), __ATOMIC_RELAXED)
+
+/* daemon: publish statistics page for given queue path
+	Page left by a crashed daemon is replaced. If shared segment can't be created, page is kept in
+	private memory, so counting goes on anyway. The page which exists already is returned as it is,
+	so broker and transports take the same one; it lives until stats_destroy.
+	returns page or NULL if memory is exhausted
+*/
+bifrost_stats_t* stats_create (const char* queue_path);
+// daemon: mark page as final and remove it
+void stats_destroy ();
+/* daemon, main loop thread: take slot of a new remote node
+	returns NULL if there is no page or it is full - caller counts privately then
+*/
+bifrost_peer_stats_t* stats_add_peer (int ip, int transport);
+
+/* reader: map page of daemon running with given queue path read-only
+	returns NULL if there is no page or its layout is of another version
+*/
+const bifrost_stats_t* stats_open (const char* queue_path);
+void stats_close (const bifrost_stats_t* stats);
+
+#endif
@@ -0,0 +1,290 @@
+/* bifrost-stat - daemon statistics in vmstat style
+	usage: bifrost-stat [-q queue path] [-u] [-n] [delay [count]]
+	Reads statistics page (see stats.h) and never talks to daemon. The first line covers the time
+	since daemon start, the following ones - each delay seconds. -u adds per-unit lines, -n per-peer ones.
+*/
+
+#include "../stats.h"
+#include "../settings.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#define HEADER_EVERY	20	// lines between repeated headers, as vmstat does
+
+typedef struct sample_t {
+	bifrost_stats_t bus;
+	bifrost_unit_stats_t* units;
+	unsigned int units_count;
+	bifrost_peer_stats_t peers[BIFROST_STATS_PEERS];
+	unsigned int peers_count;
+	double time;		// CLOCK_MONOTONIC seconds
+} sample_t;
+
+static double now ()
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// counters are copied one by one - page is live
+static void take_sample (const bifrost_stats_t* page, sample_t* sample)
+{
+	unsigned int idx;
+
+	sample->time = now ();
+	sample->bus.running = STATS_GET(page->running);
+	sample->bus.bus_depth = STATS_GET(page->bus_depth);
+	sample->bus.batches = STATS_GET(page->batches);
+	sample->bus.batch_messages = STATS_GET(page->batch_messages);
+	sample->bus.batch_limit = STATS_GET(page->batch_limit);
+	sample->bus.bus_rejected = STATS_GET(page->bus_rejected);
+	sample->bus.bus_dropped = STATS_GET(page->bus_dropped);
+	sample->bus.dropped_no_route = STATS_GET(page->dropped_no_route);
+
+	sample->units_count = __atomic_load_n (&page->units, __ATOMIC_ACQUIRE);
+	if (sample->units_count > page->max_units)
+		sample->units_count = page->max_units;
+
+	for (idx = 0; idx < sample->units_count; idx++)
+	{
+		const bifrost_unit_stats_t* src = &page->unit[idx];
+		bifrost_unit_stats_t* dst = &sample->units[idx];
+
+		memcpy (dst->name, src->name, BIFROST_STATS_NAME_SIZE);
+		dst->name[BIFROST_STATS_NAME_SIZE - 1] = 0;
+		dst->online = STATS_GET(src->online);
+		dst->sent = STATS_GET(src->sent);
+		dst->sent_bytes = STATS_GET(src->sent_bytes);
+		dst->delivered = STATS_GET(src->delivered);
+		dst->delivered_bytes = STATS_GET(src->delivered_bytes);
+		dst->dropped_offline = STATS_GET(src->dropped_offline);
+		dst->dropped_full = STATS_GET(src->dropped_full);
+		dst->dropped_invalid = STATS_GET(src->dropped_invalid);
+	}
+
+	sample->peers_count = __atomic_load_n (&page->peers, __ATOMIC_ACQUIRE);
+	if (sample->peers_count > page->max_peers)
+		sample->peers_count = page->max_peers;
+
+	for (idx = 0; idx < sample->peers_count; idx++)
+	{
+		const bifrost_peer_stats_t* src = &page->peer[idx];
+		bifrost_peer_stats_t* dst = &sample->peers[idx];
+
+		dst->ip = src->ip;
+		dst->transport = src->transport;
+		dst->sent = STATS_GET(src->sent);
+		dst->sent_bytes = STATS_GET(src->sent_bytes);
+		dst->dropped = STATS_GET(src->dropped);
+		dst->broken = STATS_GET(src->broken);
+		dst->compressed = STATS_GET(src->compressed);
+		dst->incompressible = STATS_GET(src->incompressible);
+		dst->compress_in_bytes = STATS_GET(src->compress_in_bytes);
+		dst->compress_out_bytes = STATS_GET(src->compress_out_bytes);
+		dst->compress_ns = STATS_GET(src->compress_ns);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+
+static void print_header ()
+{
+	printf ("---bus--- ----batch---- ----------traffic---------- -------------drops--------------\n");
+	printf ("    depth    /s  util%%       in/s     out/s    outMB/s   full offline invalid noroute overload\n");
+}
+
+// previous sample is zeroed for the first line - rates are averages since start then
+static void print_line (const sample_t* prev, const sample_t* cur, double seconds)
+{
+	unsigned long long in = 0, out = 0, bytes = 0, full = 0, offline = 0, invalid = 0;
+	unsigned long long messages, limit;
+	unsigned int idx;
+
+	for (idx = 0; idx < cur->units_count; idx++)
+	{
+		const bifrost_unit_stats_t* c = &cur->units[idx];
+		const bifrost_unit_stats_t* p = &prev->units[idx];
+
+		// unit which appeared meanwhile has zeroes in previous sample
+		in += c->sent - (idx < prev->units_count ? p->sent : 0);
+		out += c->delivered - (idx < prev->units_count ? p->delivered : 0);
+		bytes += c->delivered_bytes - (idx < prev->units_count ? p->delivered_bytes : 0);
+		full += c->dropped_full - (idx < prev->units_count ? p->dropped_full : 0);
+		offline += c->dropped_offline - (idx < prev->units_count ? p->dropped_offline : 0);
+		invalid += c->dropped_invalid - (idx < prev->units_count ? p->dropped_invalid : 0);
+	}
+
+	messages = cur->bus.batch_messages - prev->bus.batch_messages;
+	limit = cur->bus.batch_limit - prev->bus.batch_limit;
+
+	printf ("%9llu %5.0f %6.1f %10.0f %9.0f %10.2f %6llu %7llu %7llu %7llu %8llu\n",
+		(unsigned long long) cur->bus.bus_depth,
+		(cur->bus.batches - prev->bus.batches) / seconds,
+		limit ? 100.0 * messages / limit : 0.0,
+		in / seconds, out / seconds, bytes / seconds / (1024 * 1024),
+		full, offline, invalid,
+		(unsigned long long)(cur->bus.dropped_no_route - prev->bus.dropped_no_route),
+		(unsigned long long)(cur->bus.bus_rejected - prev->bus.bus_rejected
+				     + cur->bus.bus_dropped - prev->bus.bus_dropped));
+}
+
+static void print_units (const sample_t* prev, const sample_t* cur, double seconds)
+{
+	unsigned int idx;
+
+	printf ("    %-24s %3s %10s %10s %10s %6s %7s %7s\n", "unit", "on", "in/s", "out/s", "outKB/s", "full", "offline", "invalid");
+	for (idx = 0; idx < cur->units_count; idx++)
+	{
+		const bifrost_unit_stats_t* c = &cur->units[idx];
+		bifrost_unit_stats_t zero;
+		const bifrost_unit_stats_t* p = &zero;
+
+		memset (&zero, 0, sizeof (zero));
+		if (idx < prev->units_count)
+			p = &prev->units[idx];
+
+		printf ("    %-24.24s %3s %10.0f %10.0f %10.1f %6llu %7llu %7llu\n", c->name, c->online ? "yes" : "no",
+			(c->sent - p->sent) / seconds, (c->delivered - p->delivered) / seconds,
+			(c->delivered_bytes - p->delivered_bytes) / seconds / 1024,
+			(unsigned long long)(c->dropped_full - p->dropped_full),
+			(unsigned long long)(c->dropped_offline - p->dropped_offline),
+			(unsigned long long)(c->dropped_invalid - p->dropped_invalid));
+	}
+}
+
+static void print_peers (const sample_t* prev, const sample_t* cur, double seconds)
+{
+	struct in_addr addr;
+	unsigned long long frames, packed, in, out;
+	unsigned int idx;
+
+	printf ("    %-16s %4s %10s %10s %8s %8s %6s %6s %8s\n", "peer", "via", "out/s", "outKB/s", "dropped",
+		"broken", "comp%", "ratio", "ns/comp");
+	for (idx = 0; idx < cur->peers_count; idx++)
+	{
+		const bifrost_peer_stats_t* c = &cur->peers[idx];
+		bifrost_peer_stats_t zero;
+		const bifrost_peer_stats_t* p = &zero;
+
+		memset (&zero, 0, sizeof (zero));
+		if (idx < prev->peers_count)
+			p = &prev->peers[idx];
+
+		// compression: share of messages over threshold which got smaller, bytes in per byte out
+		packed = c->compressed - p->compressed;
+		frames = packed + c->incompressible - p->incompressible;
+		in = c->compress_in_bytes - p->compress_in_bytes;
+		out = c->compress_out_bytes - p->compress_out_bytes;
+
+		addr.s_addr = c->ip;
+		printf ("    %-16s %4s %10.0f %10.1f %8llu %8llu %6.1f %6.2f %8llu\n", inet_ntoa (addr), c->transport ? "udp" : "tcp",
+			(c->sent - p->sent) / seconds, (c->sent_bytes - p->sent_bytes) / seconds / 1024,
+			(unsigned long long)(c->dropped - p->dropped), (unsigned long long)(c->broken - p->broken),
+			frames ? 100.0 * packed / frames : 0.0,
+			out ? (double)in / out : 0.0, frames ? (unsigned long long)(c->compress_ns - p->compress_ns) / frames : 0);
+	}
+}
+
+//=================================================================================================
+
+static void usage (const char* name)
+{
+	fprintf (stderr, "usage: %s [-q queue path] [-u] [-n] [delay [count]]\n", name);
+}
+
+int main (int argc, char** argv)
+{
+	const char* queue_path;
+	const bifrost_stats_t* page;
+	sample_t samples[2];
+	sample_t* prev = &samples[0];
+	sample_t* cur = &samples[1];
+	sample_t* swap;
+	struct timespec wall;
+	unsigned int delay = 0;
+	long count = 1;
+	int per_unit = 0;
+	int per_peer = 0;
+	int lines = 0;
+	int opt;
+
+	settings_init ();
+	queue_path = bifrost_settings.queue_path;
+
+	while ((opt = getopt (argc, argv, "q:unh")) != -1)
+	{
+		switch (opt)
+		{
+		case 'q': queue_path = optarg; break;
+		case 'u': per_unit = 1; break;
+		case 'n': per_peer = 1; break;
+		default:
+			usage (argv[0]);
+			return 1;
+		}
+	}
+
+	// same arguments as vmstat: no delay - one line; delay without count - forever
+	if (optind < argc)
+	{
+		delay = atoi (argv[optind++]);
+		count = optind < argc ? atol (argv[optind++]) : -1;
+		if (!delay || optind < argc)
+		{
+			usage (argv[0]);
+			return 1;
+		}
+	}
+
+	if (!(page = stats_open (queue_path)))
+	{
+		fprintf (stderr, "%s: no statistics of bifrost at '%s' (daemon isn't running or is of another version)\n",
+			 argv[0], queue_path);
+		return 1;
+	}
+
+	memset (samples, 0, sizeof (samples));
+	samples[0].units = calloc (page->max_units, sizeof (bifrost_unit_stats_t));
+	samples[1].units = calloc (page->max_units, sizeof (bifrost_unit_stats_t));
+
+	// first line: everything since daemon start
+	clock_gettime (CLOCK_REALTIME, &wall);
+	take_sample (page, cur);
+	prev->time = cur->time - (wall.tv_sec > (time_t) page->started ? wall.tv_sec - page->started : 1);
+
+	while (count < 0 || count-- > 0)
+	{
+		if (lines++ % HEADER_EVERY == 0 || per_unit || per_peer)
+			print_header ();
+
+		print_line (prev, cur, cur->time - prev->time);
+		if (per_unit)
+			print_units (prev, cur, cur->time - prev->time);
+		if (per_peer)
+			print_peers (prev, cur, cur->time - prev->time);
+		fflush (stdout);
+
+		if (!cur->bus.running)
+		{
+			fprintf (stderr, "%s: daemon has stopped\n", argv[0]);
+			break;
+		}
+		if (!count)
+			break;
+
+		sleep (delay);
+		swap = prev; prev = cur; cur = swap;
+		take_sample (page, cur);
+	}
+
+	free (samples[0].units);
+	free (samples[1].units);
+	stats_close (page);
+	return 0;
+}
@@ -0,0 +1,241 @@
+#include "trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+typedef struct trace_thread_t {
+	trace_ring_t* ring;
+	pid_t tid;
+	int alive;		// 0 - thread has exited, ring may be taken over
+	char name[32];
+} trace_thread_t;
+
+/* thread table is changed only when a thread writes its first event or exits, and is walked by dumps;
+	recording itself never looks at it
+*/
+static trace_thread_t threads[TRACE_MAX_THREADS];
+static unsigned int threads_count = 0;
+static pthread_mutex_t threads_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t thread_key;
+static pthread_once_t thread_key_once = PTHREAD_ONCE_INIT;
+
+__thread trace_ring_t* trace_ring = NULL;
+static __thread int trace_refused = 0;	// table was full - thread is not recorded
+
+static const char* event_names[TRACE_EVENT_TYPES] = {
+	"?", "push", "pop", "route", "channel_write", "command"
+};
+
+static void thread_exit (void* arg)
+{
+	pthread_mutex_lock (&threads_mutex);
+	((trace_thread_t*) arg)->alive = 0;
+	pthread_mutex_unlock (&threads_mutex);
+}
+
+static void thread_key_create ()
+{
+	pthread_key_create (&thread_key, thread_exit);
+}
+
+static trace_thread_t* thread_attach ()
+{
+	trace_thread_t* thread = NULL;
+	unsigned int idx;
+
+	if (trace_refused)
+		return NULL;
+
+	pthread_once (&thread_key_once, thread_key_create);
+	pthread_mutex_lock (&threads_mutex);
+
+	// ring of an exited thread is reused before a new one is allocated
+	for (idx = 0; idx < threads_count && !thread; idx++)
+		if (!threads[idx].alive)
+			thread = &threads[idx];
+
+	if (!thread && threads_count < TRACE_MAX_THREADS)
+	{
+		if ((threads[threads_count].ring = (trace_ring_t*) calloc (1, sizeof (trace_ring_t))))
+			thread = &threads[threads_count++];
+		else
+			syslog (LOG_ERR, "%s: failed to allocate trace ring", __func__);
+	}
+
+	if (thread)
+	{
+		// dumps copy rings under the same mutex, so nobody reads old events meanwhile
+		thread->ring->head = 0;
+		thread->tid = syscall (SYS_gettid);
+		thread->alive = 1;
+		snprintf (thread->name, sizeof (thread->name), "thread %d", (int) thread->tid);
+		trace_ring = thread->ring;
+	} else
+		trace_refused = 1;
+
+	pthread_mutex_unlock (&threads_mutex);
+
+	if (thread)
+		pthread_setspecific (thread_key, thread);
+
+	return thread;
+}
+
+trace_ring_t* trace_ring_attach ()
+{
+	trace_thread_t* thread = thread_attach ();
+
+	return thread ? thread->ring : NULL;
+}
+
+void trace_thread_name (const char* name)
+{
+	trace_thread_t* thread;
+
+	if (!name)
+	{
+		syslog (LOG_ERR, "%s: invalid arguments!", __func__);
+		return;
+	}
+
+	if (!trace_ring)
+		thread_attach ();
+	if (!trace_ring || !(thread = (trace_thread_t*) pthread_getspecific (thread_key)))
+		return;
+
+	pthread_mutex_lock (&threads_mutex);
+	snprintf (thread->name, sizeof (thread->name), "%s", name);
+	pthread_mutex_unlock (&threads_mutex);
+}
+
+//-------------------------------------------------------------------------------------------------
+// dump
+
+typedef struct trace_sample_t {
+	trace_event_t event;
+	unsigned int thread;	// index in threads
+} trace_sample_t;
+
+static int sample_compare (const void* a, const void* b)
+{
+	uint64_t ta = ((const trace_sample_t*) a)->event.ts;
+	uint64_t tb = ((const trace_sample_t*) b)->event.ts;
+
+	return ta < tb ? -1 : ta > tb;
+}
+
+/* copy newest events of ring; writer keeps going, so events it could overwrite meanwhile are dropped
+	returns number of copied events
+*/
+static unsigned int ring_copy (trace_ring_t* ring, unsigned int thread, trace_sample_t* out, unsigned int max_events)
+{
+	uint64_t head, first, seq, valid;
+	unsigned int count = 0;
+
+	head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+	first = head > max_events ? head - max_events : 0;
+
+	for (seq = first; seq < head; seq++)
+	{
+		memcpy (&out[seq - first].event, &ring->events[seq & (TRACE_RING_EVENTS - 1)], sizeof (trace_event_t));
+		out[seq - first].thread = thread;
+	}
+
+	// writer at head' is overwriting head' - TRACE_RING_EVENTS, so only events after it are intact
+	__atomic_thread_fence (__ATOMIC_ACQUIRE);
+	head = __atomic_load_n (&ring->head, __ATOMIC_RELAXED);
+	valid = head >= TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS + 1 : 0;
+
+	if (valid > first)
+	{
+		count = (valid - first) < (seq - first) ? valid - first : seq - first;
+		memmove (out, out + count, (seq - first - count) * sizeof (trace_sample_t));
+	}
+
+	return (seq - first) - count;
+}
+
+static void print_event (FILE* out, const trace_sample_t* sample, uint64_t base, int pid)
+{
+	const trace_event_t* ev = &sample->event;
+	const trace_thread_t* thread = &threads[sample->thread];
+	double ts = latency_to_ns (ev->ts - base) / 1000.0;
+
+	fprintf (out, ",\n{\"name\":\"%s\",\"cat\":\"bifrost\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,",
+		 event_names[ev->type < TRACE_EVENT_TYPES ? ev->type : 0], pid, (int) thread->tid, ts);
+
+	if (ev->duration)
+		fprintf (out, "\"ph\":\"X\",\"dur\":%.3f,", latency_to_ns (ev->duration) / 1000.0);
+	else
+		fprintf (out, "\"ph\":\"i\",\"s\":\"t\",");
+
+	switch (ev->type)
+	{
+	case TRACE_PUSH:	fprintf (out, "\"args\":{\"source\":%u,\"size\":%u}}", ev->id, ev->size); break;
+	case TRACE_POP:		fprintf (out, "\"args\":{\"messages\":%u}}", ev->size); break;
+	case TRACE_ROUTE:	fprintf (out, "\"args\":{\"destination\":%u,\"result\":%d}}", ev->id, (int) ev->size); break;
+	case TRACE_CHANNEL_WRITE: fprintf (out, "\"args\":{\"destination\":%u,\"size\":%u}}", ev->id, ev->size); break;
+	case TRACE_COMMAND:	fprintf (out, "\"args\":{\"command\":%u}}", ev->id); break;
+	default:		fprintf (out, "\"args\":{}}");
+	}
+}
+
+char* trace_dump_json (unsigned int max_events)
+{
+	trace_sample_t* samples;
+	unsigned int per_thread, threads_seen, count = 0, first, idx;
+	char* json = NULL;
+	size_t json_size = 0;
+	FILE* out;
+	int pid = getpid ();
+
+	latency_init ();
+
+	// threads which come meanwhile are left for the next dump
+	pthread_mutex_lock (&threads_mutex);
+	threads_seen = threads_count;
+	pthread_mutex_unlock (&threads_mutex);
+
+	per_thread = (max_events && max_events < TRACE_RING_EVENTS) ? max_events : TRACE_RING_EVENTS;
+	if (!(samples = (trace_sample_t*) malloc ((size_t) (threads_seen ? threads_seen : 1) * per_thread * sizeof (trace_sample_t))))
+	{
+		syslog (LOG_ERR, "%s: out of memory", __func__);
+		return NULL;
+	}
+
+	if (!(out = open_memstream (&json, &json_size)))
+	{
+		free (samples);
+		return NULL;
+	}
+
+	pthread_mutex_lock (&threads_mutex);
+
+	for (idx = 0; idx < threads_seen; idx++)
+		count += ring_copy (threads[idx].ring, idx, samples + count, per_thread);
+
+	// newest events of all threads together
+	qsort (samples, count, sizeof (trace_sample_t), sample_compare);
+	first = (max_events && count > max_events) ? count - max_events : 0;
+
+	fprintf (out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	fprintf (out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"bifrost\"}}", pid);
+	for (idx = 0; idx < threads_seen; idx++)
+		fprintf (out, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			 pid, (int) threads[idx].tid, threads[idx].name);
+
+	for (idx = first; idx < count; idx++)
+		print_event (out, &samples[idx], samples[first].event.ts, pid);
+
+	pthread_mutex_unlock (&threads_mutex);
+
+	fprintf (out, "\n]}\n");
+	fclose (out);
+	free (samples);
+
+	return json;
+}
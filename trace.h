@@ -0,0 +1,80 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "latency.h"
+#include <stdint.h>
+
+/* Flight recorder - always-on record of the latest bus events.
+	Every thread writes compact binary events into its own ring (allocated on its first event),
+	so recording takes no locks and no atomic read-modify-write: a TSC read and a 24-byte store.
+	When ring is full, the oldest events are overwritten. Ring of an exited thread is kept until
+	another new thread takes it over, so events of short-lived threads survive a while.
+	Dump merges the newest events of all threads into Chrome trace / Perfetto JSON;
+	it may be taken at any time, events overwritten while they are copied are skipped.
+*/
+
+#define TRACE_RING_EVENTS	8192	// per thread, power of two
+#define TRACE_MAX_THREADS	64	// threads beyond it are not recorded
+
+typedef enum trace_event_type_t {
+	TRACE_PUSH = 1,		// message pushed to bus: id - source unit (command type for commands), size - payload
+	TRACE_POP,		// batch taken from bus and processed: size - messages in batch; duration
+	TRACE_ROUTE,		// message not delivered locally: id - destination, size - route_message result
+	TRACE_CHANNEL_WRITE,	// delivery into channel: id - destination, size - payload; duration
+	TRACE_COMMAND,		// command executed by broker: id - command type; duration
+	TRACE_EVENT_TYPES
+} trace_event_type_t;
+
+typedef struct trace_event_t {
+	uint64_t ts;		// latency_now () ticks
+	uint32_t duration;	// ticks, 0 - instant event
+	uint16_t type;		// trace_event_type_t
+	uint16_t reserved;
+	uint32_t id;
+	uint32_t size;
+} trace_event_t;
+
+typedef struct trace_ring_t {
+	uint64_t head;			// events written so far, next slot is head & (TRACE_RING_EVENTS - 1)
+	trace_event_t events[TRACE_RING_EVENTS];
+} trace_ring_t;
+
+extern __thread trace_ring_t* trace_ring;	// ring of the current thread
+trace_ring_t* trace_ring_attach ();
+
+static inline void trace_event (trace_event_type_t type, uint32_t id, uint32_t size,
+				unsigned long long ts, unsigned long long end)
+{
+	trace_ring_t* ring = trace_ring;
+	trace_event_t* ev;
+	uint64_t head;
+
+	if (!ring && !(ring = trace_ring_attach ()))
+		return;
+
+	head = ring->head;
+	ev = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+	ev->ts = ts;
+	ev->duration = end > ts ? (end - ts > UINT32_MAX ? UINT32_MAX : end - ts) : 0;
+	ev->type = type;
+	ev->id = id;
+	ev->size = size;
+	// publishes the event: dump never looks at slot of head
+	__atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// instant event, stamped now
+static inline void trace_instant (trace_event_type_t type, uint32_t id, uint32_t size)
+{
+	trace_event (type, id, size, latency_now (), 0);
+}
+
+// label of the current thread in dumps (thread id is used otherwise)
+void trace_thread_name (const char* name);
+
+/* newest max_events events of all threads (0 - everything recorded) in Chrome trace JSON
+	returns malloc'ed string, caller frees it; NULL on failure
+*/
+char* trace_dump_json (unsigned int max_events);
+
+#endif